@@ -0,0 +1,281 @@
+/*
+ *   batch.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu3bm.h"
+#include "batch.h"
+
+#define EMU3_BATCH_EXTRACTION_DIR_SUFFIX "_samples"
+
+struct emu3_batch_job
+{
+  const gchar *bank;
+  gchar *extraction_dir;	//Directory named after the bank
+  gchar *output;		//Listing printed while processing the bank
+  gsize output_len;
+  gchar *log;			//Messages printed while processing the bank
+  gsize log_len;
+  gint err;
+  gboolean done;
+};
+
+struct emu3_batch
+{
+  struct emu_context *ctx;
+  const struct emu3_batch_params *params;
+  GMutex mutex;
+  GCond cond;
+};
+
+static gint
+emu3_batch_process_bank (struct emu3_batch_job *job,
+			 const struct emu3_batch_params *params)
+{
+  gint err;
+  struct emu_file *file;
+  struct emu_context *ctx = emu_get_context ();
+
+  if (params->ext_mode)
+    {
+      //The bank directories go inside the extraction directory if any.
+      if (ctx->extraction_dir)
+	{
+	  gchar *dir = g_build_filename (ctx->extraction_dir,
+					 job->extraction_dir, NULL);
+	  g_free (ctx->extraction_dir);
+	  ctx->extraction_dir = dir;
+	}
+      else
+	{
+	  ctx->extraction_dir = g_strdup (job->extraction_dir);
+	}
+
+      if (g_mkdir_with_parents (ctx->extraction_dir, 0755))
+	{
+	  emu_error ("Error while creating directory '%s': %s",
+		     ctx->extraction_dir, strerror (errno));
+	  return EXIT_FAILURE;
+	}
+    }
+
+  file = emu3_open_file (ctx, job->bank, !params->write);
+  if (!file)
+    {
+      return EXIT_FAILURE;
+    }
+
+  err = emu3_process_bank (file, params->ext_mode, params->preset_num,
+			   params->rt_controls, params->pbr, params->level,
+			   params->cutoff, params->q, params->filter);
+  if (!err && params->write)
+    {
+      err = emu3_write_file (file);
+    }
+
+  emu_close_file (file);
+
+  return err;
+}
+
+//Every bank is processed with a context of its own so that its listing and
+//its messages can be printed in order and its samples are extracted to a
+//directory named after it.
+static void
+emu3_batch_run_job (gpointer data, gpointer user_data)
+{
+  FILE *output, *log;
+  struct emu3_batch_job *job = data;
+  struct emu3_batch *batch = user_data;
+  struct emu_context *ctx = emu_context_copy (batch->ctx);
+
+  //Banks are already processed in parallel.
+  ctx->sample_jobs = 1;
+  emu_set_context (ctx);
+
+  output = open_memstream (&job->output, &job->output_len);
+  log = open_memstream (&job->log, &job->log_len);
+  if (output && log)
+    {
+      ctx->output = output;
+      ctx->log = log;
+      job->err = emu3_batch_process_bank (job, batch->params);
+      ctx->output = NULL;
+      ctx->log = NULL;
+    }
+  else
+    {
+      emu_error ("Error while creating output: %s", strerror (errno));
+      job->err = EXIT_FAILURE;
+    }
+
+  if (output)
+    {
+      fclose (output);
+    }
+  if (log)
+    {
+      fclose (log);
+    }
+  emu_context_free (ctx);
+
+  g_mutex_lock (&batch->mutex);
+  job->done = TRUE;
+  g_cond_broadcast (&batch->cond);
+  g_mutex_unlock (&batch->mutex);
+}
+
+//The samples of every bank are extracted to a directory named after the bank
+//file so two banks with the same file name can not be extracted together.
+static gint
+emu3_batch_set_extraction_dirs (struct emu3_batch_job *jobs, gint banks_num)
+{
+  gchar *name;
+  gint err = EXIT_SUCCESS;
+  struct emu3_batch_job *prev;
+  GHashTable *dirs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (gint i = 0; i < banks_num; i++)
+    {
+      name = g_path_get_basename (jobs[i].bank);
+      jobs[i].extraction_dir = g_strdup_printf ("%s%s", name,
+						EMU3_BATCH_EXTRACTION_DIR_SUFFIX);
+      g_free (name);
+
+      prev = g_hash_table_lookup (dirs, jobs[i].extraction_dir);
+      if (prev)
+	{
+	  emu_error ("Banks '%s' and '%s' would be extracted to '%s'",
+		     prev->bank, jobs[i].bank, jobs[i].extraction_dir);
+	  err = EXIT_FAILURE;
+	  break;
+	}
+
+      g_hash_table_insert (dirs, jobs[i].extraction_dir, &jobs[i]);
+    }
+
+  g_hash_table_destroy (dirs);
+
+  return err;
+}
+
+static void
+emu3_batch_free_jobs (struct emu3_batch_job *jobs, gint banks_num)
+{
+  for (gint i = 0; i < banks_num; i++)
+    {
+      g_free (jobs[i].extraction_dir);
+    }
+  g_free (jobs);
+}
+
+//Processes the banks in a thread pool of ctx->sample_jobs threads. The
+//results are printed in the order of the banks as soon as they are available
+//and a failing bank does not stop the others.
+gint
+emu3_run_batch (struct emu_context *ctx, gchar **banks, gint banks_num,
+		const struct emu3_batch_params *params)
+{
+  gint failed = 0;
+  GError *error = NULL;
+  GThreadPool *pool;
+  struct emu3_batch batch;
+  struct emu3_batch_job *job, *jobs;
+
+  emu_set_context (ctx);
+
+  jobs = g_malloc0 (sizeof (struct emu3_batch_job) * banks_num);
+  for (gint i = 0; i < banks_num; i++)
+    {
+      jobs[i].bank = banks[i];
+    }
+
+  if (params->ext_mode && emu3_batch_set_extraction_dirs (jobs, banks_num))
+    {
+      emu3_batch_free_jobs (jobs, banks_num);
+      return EXIT_FAILURE;
+    }
+
+  batch.ctx = ctx;
+  batch.params = params;
+  g_mutex_init (&batch.mutex);
+  g_cond_init (&batch.cond);
+
+  pool = g_thread_pool_new (emu3_batch_run_job, &batch, ctx->sample_jobs,
+			    TRUE, &error);
+  if (!pool)
+    {
+      emu_error ("Error while creating thread pool: %s", error->message);
+      g_error_free (error);
+      emu3_batch_free_jobs (jobs, banks_num);
+      return EXIT_FAILURE;
+    }
+
+  for (gint i = 0; i < banks_num; i++)
+    {
+      g_thread_pool_push (pool, &jobs[i], NULL);
+    }
+
+  for (gint i = 0; i < banks_num; i++)
+    {
+      job = &jobs[i];
+
+      g_mutex_lock (&batch.mutex);
+      while (!job->done)
+	{
+	  g_cond_wait (&batch.cond, &batch.mutex);
+	}
+      g_mutex_unlock (&batch.mutex);
+
+      emu_print (0, 0, "Bank file: %s\n", job->bank);
+      if (job->output)
+	{
+	  fwrite (job->output, 1, job->output_len, emu_get_output ());
+	  free (job->output);
+	}
+
+      //The job messages already include its errors.
+      if (job->log)
+	{
+	  fwrite (job->log, 1, job->log_len, emu_get_log ());
+	  free (job->log);
+	}
+
+      if (job->err)
+	{
+	  emu_error ("Error while processing %s", job->bank);
+	  failed++;
+	}
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&batch.mutex);
+  g_cond_clear (&batch.cond);
+  emu3_batch_free_jobs (jobs, banks_num);
+
+  if (failed)
+    {
+      emu_error ("%d of %d banks failed", failed, banks_num);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
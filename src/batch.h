@@ -0,0 +1,43 @@
+/*
+ *   batch.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utils.h"
+
+//The arguments of emu3_process_bank applied to every bank.
+struct emu3_batch_params
+{
+  gint ext_mode;
+  gint preset_num;
+  gchar *rt_controls;
+  gint pbr;
+  gint level;
+  gint cutoff;
+  gint q;
+  gint filter;
+  gboolean write;		//TRUE if the banks are edited
+};
+
+gint emu3_run_batch (struct emu_context *ctx, gchar ** banks, gint banks_num,
+		     const struct emu3_batch_params *params);
+
+#endif
@@ -19,13 +19,16 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../config.h"
 #include "emu3bm.h"
 #include "sfz.h"
-#include "sfz.tab.h"
 #include "utils.h"
 
 #define FORMAT_SIZE 16
@@ -56,13 +59,12 @@
 
 #define WRITE_BUFLEN 4096
 
-#define EMU3_BLOCK_SIZE 512
-
 #define DEFAULT_CUTOFF_U8 0xef
 
-#define EMU3_BANK(f) ((struct emu3_bank *) ((f)->raw))
+#define EMU3_GAP_SIZE 0x10000	//64 KiB
 
-extern void yyset_in (FILE * _in_str);
+#define EMU3_BANK(f) ((struct emu3_bank *) ((f)->raw))
+#define EMU3_LAYOUT(f) ((const struct emu3_layout *) ((f)->layout))
 
 struct emu3_bank
 {
@@ -107,6 +109,52 @@ struct emu3_preset
   guint8 note_zone_mappings[EMU3_NOTES];
 };
 
+//Format dependent values. This is resolved when opening a bank.
+struct emu3_layout
+{
+  const gchar *format;
+  guint32 preset_addr_start;
+  guint32 sample_addr_start;
+  guint32 preset_start;
+  guint32 preset_offset;
+  gint max_presets;
+  gint max_samples;
+  guint8 vcf_q_flags;		//The bit 7 / 0x80 enables Q on ESI32.
+};
+
+static const struct emu3_layout EMU3_LAYOUTS[] = {
+  {
+   .format = EMULATOR_3X_DEF,
+   .preset_addr_start = PRESET_SIZE_ADDR_START_EMU_3X,
+   .sample_addr_start = SAMPLE_ADDR_START_EMU_3X,
+   .preset_start = PRESET_START_EMU_3X,
+   .preset_offset = 0,
+   .max_presets = MAX_PRESETS_EMU_3X,
+   .max_samples = MAX_SAMPLES_EMU_3X,
+   .vcf_q_flags = 0},
+  {
+   .format = ESI_32_V3_DEF,
+   .preset_addr_start = PRESET_SIZE_ADDR_START_EMU_3X,
+   .sample_addr_start = SAMPLE_ADDR_START_EMU_3X,
+   .preset_start = PRESET_START_EMU_3X,
+   .preset_offset = 0,
+   .max_presets = MAX_PRESETS_EMU_3X,
+   .max_samples = MAX_SAMPLES_EMU_3X,
+   .vcf_q_flags = 0x80},
+  {
+   .format = EMULATOR_THREE_DEF,
+   .preset_addr_start = PRESET_SIZE_ADDR_START_EMU_THREE,
+   .sample_addr_start = SAMPLE_ADDR_START_EMU_THREE,
+   .preset_start = PRESET_START_EMU_THREE,
+   .preset_offset = PRESET_OFFSET_EMU_THREE,
+   .max_presets = MAX_PRESETS_EMU_THREE,
+   .max_samples = MAX_SAMPLES_EMU_THREE,
+   .vcf_q_flags = 0}
+};
+
+static const gint EMU3_LAYOUTS_SIZE =
+  sizeof (EMU3_LAYOUTS) / sizeof (struct emu3_layout);
+
 static const gint8 DEFAULT_RT_CONTROLS[RT_CONTROLS_SIZE +
 				       RT_CONTROLS_FS_SIZE] =
   { 1, 0, 0, 2, 0, 0, 0, 0, 0, 0, 1, 8 };
@@ -843,7 +891,6 @@ emu3_set_preset_zone_q (struct emu_file *file, struct emu3_preset_zone *zone,
     }
   else
     {
-      struct emu3_bank *bank = EMU3_BANK (file);
       emu_debug (1, "Setting Q to %d...", q);
       zone->vcf_q = emu3_get_s8_from_percent (q);
 
@@ -855,10 +902,7 @@ emu3_set_preset_zone_q (struct emu_file *file, struct emu3_preset_zone *zone,
       // always be enabled perhaps?
       // zone->vcf_q |= 0x80
 
-      if (strcmp (ESI_32_V3_DEF, bank->format) == 0)
-	{
-	  zone->vcf_q |= 0x80;
-	}
+      zone->vcf_q |= EMU3_LAYOUT (file)->vcf_q_flags;
     }
 }
 
@@ -934,127 +978,80 @@ emu3_set_preset_pbr (struct emu3_preset *preset, gint pbr)
     }
 }
 
-static guint32 *
-emu3_get_preset_addresses (struct emu3_bank *bank)
+static const struct emu3_layout *
+emu3_get_layout (struct emu3_bank *bank)
 {
-  gchar *raw = (gchar *) bank;
+  for (gint i = 0; i < EMU3_LAYOUTS_SIZE; i++)
+    if (strcmp (EMU3_LAYOUTS[i].format, bank->format) == 0)
+      return &EMU3_LAYOUTS[i];
 
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    return (guint32 *) & raw[PRESET_SIZE_ADDR_START_EMU_3X];
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return (guint32 *) & raw[PRESET_SIZE_ADDR_START_EMU_THREE];
-  else
-    return NULL;
+  return NULL;
 }
 
-static guint32
-emu3_get_preset_address (struct emu3_bank *bank, gint preset)
+static guint32 *
+emu3_get_preset_addresses (struct emu_file *file)
 {
-  guint32 offset = emu3_get_preset_addresses (bank)[preset];
+  return (guint32 *) & file->raw[EMU3_LAYOUT (file)->preset_addr_start];
+}
 
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    return PRESET_START_EMU_3X + offset;
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return PRESET_START_EMU_THREE + offset - PRESET_OFFSET_EMU_THREE;
-  else
-    return 0;
+static guint32
+emu3_get_preset_address (struct emu_file *file, gint preset)
+{
+  const struct emu3_layout *layout = EMU3_LAYOUT (file);
+  guint32 offset = emu3_get_preset_addresses (file)[preset];
+  return layout->preset_start + offset - layout->preset_offset;
 }
 
 static gint
-emu3_get_max_presets (struct emu3_bank *bank)
+emu3_get_max_presets (struct emu_file *file)
 {
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    return MAX_PRESETS_EMU_3X;
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return MAX_PRESETS_EMU_THREE;
-  else
-    return 0;
+  return EMU3_LAYOUT (file)->max_presets;
 }
 
 static guint32
-emu3_get_sample_start_address (struct emu3_bank *bank)
-{
-  gint max_presets = emu3_get_max_presets (bank);
-  guint32 *paddresses = emu3_get_preset_addresses (bank);
-  guint32 offset = paddresses[max_presets];
-  guint32 start_address;
-
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    //There is always a 0xee byte before the samples
-    start_address = PRESET_START_EMU_3X + 1;
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    //There is always a 0x00 byte before the samples
-    start_address = PRESET_START_EMU_THREE + 1 - PRESET_OFFSET_EMU_THREE;
-  else
-    start_address = 0;
+emu3_get_sample_start_address (struct emu_file *file)
+{
+  const struct emu3_layout *layout = EMU3_LAYOUT (file);
+  guint32 *paddresses = emu3_get_preset_addresses (file);
+  guint32 offset = paddresses[layout->max_presets];
 
-  return start_address + offset;
+  //There is always a 0xee (3X and ESI) or a 0x00 (Three) byte before the samples
+  return layout->preset_start + 1 - layout->preset_offset + offset;
 }
 
 static guint32 *
-emu3_get_sample_addresses (struct emu3_bank *bank)
+emu3_get_sample_addresses (struct emu_file *file)
 {
-  gchar *raw = (gchar *) bank;
-
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    return (guint32 *) & (raw[SAMPLE_ADDR_START_EMU_3X]);
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return (guint32 *) & (raw[SAMPLE_ADDR_START_EMU_THREE]);
-  else
-    return NULL;
+  return (guint32 *) & file->raw[EMU3_LAYOUT (file)->sample_addr_start];
 }
 
 static gint
-emu3_get_max_samples (struct emu3_bank *bank)
+emu3_get_max_samples (struct emu_file *file)
 {
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0)
-    return MAX_SAMPLES_EMU_3X;
-  else if (strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return MAX_SAMPLES_EMU_THREE;
-  else
-    return 0;
+  return EMU3_LAYOUT (file)->max_samples;
 }
 
 static guint32
-emu3_get_next_sample_address (struct emu3_bank *bank)
+emu3_get_next_sample_address (struct emu_file *file)
 {
-  gint max_samples = emu3_get_max_samples (bank);
-  guint32 *saddresses = emu3_get_sample_addresses (bank);
-  guint32 sample_start_addr = emu3_get_sample_start_address (bank);
+  gint max_samples = emu3_get_max_samples (file);
+  guint32 *saddresses = emu3_get_sample_addresses (file);
+  guint32 sample_start_addr = emu3_get_sample_start_address (file);
 
   return sample_start_addr + saddresses[max_samples] - SAMPLE_OFFSET;
 }
 
-static gint
-emu3_check_bank_format (struct emu3_bank *bank)
-{
-  if (strcmp (EMULATOR_3X_DEF, bank->format) == 0 ||
-      strcmp (ESI_32_V3_DEF, bank->format) == 0 ||
-      strcmp (EMULATOR_THREE_DEF, bank->format) == 0)
-    return 1;
-  else
-    return 0;
-}
-
 struct emu3_preset *
 emu3_get_preset (struct emu_file *file, gint preset_num)
 {
-  struct emu3_bank *bank = EMU3_BANK (file);
-  guint32 addr = emu3_get_preset_address (bank, preset_num);
+  guint32 addr = emu3_get_preset_address (file, preset_num);
   return (struct emu3_preset *) &file->raw[addr];
 }
 
 static guint32
 emu3_get_preset_note_zone_addr (struct emu_file *file, gint preset_num)
 {
-  struct emu3_bank *bank = EMU3_BANK (file);
-  guint32 addr = emu3_get_preset_address (bank, preset_num);
+  guint32 addr = emu3_get_preset_address (file, preset_num);
   return addr + sizeof (struct emu3_preset);
 }
 
@@ -1081,12 +1078,10 @@ emu3_get_preset_zones (struct emu_file *file, gint preset_num)
 }
 
 static gint
-emu3_count_preset_zones (struct emu_file *file, gint preset_num)
+emu3_count_zones (struct emu3_preset *preset,
+		  struct emu3_preset_note_zone *note_zone)
 {
   gint i, max = -1;
-  struct emu3_preset *preset = emu3_get_preset (file, preset_num);
-  struct emu3_preset_note_zone *note_zone =
-    emu3_get_preset_note_zones (file, preset_num);
 
   for (i = 0; i < preset->note_zones; i++)
     {
@@ -1099,12 +1094,30 @@ emu3_count_preset_zones (struct emu_file *file, gint preset_num)
   return max + 1;
 }
 
+static gboolean
+emu3_is_zone_used (struct emu3_preset *preset,
+		   struct emu3_preset_note_zone *note_zone, guint8 zone)
+{
+  for (gint i = 0; i < preset->note_zones; i++, note_zone++)
+    {
+      if (note_zone->pri_zone == zone || note_zone->sec_zone == zone)
+	{
+	  return TRUE;
+	}
+    }
+  return FALSE;
+}
+
 struct emu_file *
-emu3_open_file (const gchar *name)
+emu3_open_file (struct emu_context *ctx, const gchar *name,
+		gboolean read_only)
 {
   struct emu3_bank *bank;
-  struct emu_file *file = emu_open_file (name);
+  struct emu_file *file;
 
+  emu_set_context (ctx);
+
+  file = emu_open_file (name, read_only);
   if (!file)
     {
       return NULL;
@@ -1112,7 +1125,8 @@ emu3_open_file (const gchar *name)
 
   bank = EMU3_BANK (file);
 
-  if (!emu3_check_bank_format (bank))
+  if (file->size < sizeof (struct emu3_bank)
+      || !(file->layout = emu3_get_layout (bank)))
     {
       emu_error ("Bank format not supported");
       emu_close_file (file);
@@ -1152,6 +1166,111 @@ emu3_open_file (const gchar *name)
   return file;
 }
 
+static gint
+emu3_pread (gint fd, gpointer buf, gsize size, off_t offset)
+{
+  return pread (fd, buf, size, offset) == size ? 0 : -1;
+}
+
+//Only the bank header, the address tables and the sample headers are read.
+gint
+emu3_print_bank_info (struct emu_context *ctx, const gchar *name)
+{
+  gint fd, err, presets, samples;
+  struct stat st;
+  struct emu3_bank bank;
+  struct emu3_sample sample;
+  const struct emu3_layout *layout;
+  guint32 *paddresses, *saddresses, sample_start_addr, addr;
+
+  emu_set_context (ctx);
+
+  fd = open (name, O_RDONLY);
+  if (fd < 0)
+    {
+      emu_error ("Error while opening %s for input", name);
+      return EXIT_FAILURE;
+    }
+
+  if (fstat (fd, &st))
+    {
+      emu_error ("Error while getting %s size", name);
+      close (fd);
+      return EXIT_FAILURE;
+    }
+
+  if (emu3_pread (fd, &bank, sizeof (struct emu3_bank), 0)
+      || !(layout = emu3_get_layout (&bank)))
+    {
+      emu_error ("Bank format not supported");
+      close (fd);
+      return EXIT_FAILURE;
+    }
+
+  err = EXIT_FAILURE;
+  paddresses = g_malloc ((layout->max_presets + 1) * sizeof (guint32));
+  saddresses = g_malloc ((layout->max_samples + 1) * sizeof (guint32));
+
+  if (emu3_pread (fd, paddresses,
+		  (layout->max_presets + 1) * sizeof (guint32),
+		  layout->preset_addr_start)
+      || emu3_pread (fd, saddresses,
+		     (layout->max_samples + 1) * sizeof (guint32),
+		     layout->sample_addr_start))
+    {
+      emu_error ("Unexpected end of bank");
+      goto end;
+    }
+
+  presets = 0;
+  for (gint i = 0; i < layout->max_presets; i++)
+    {
+      if (paddresses[i] != paddresses[i + 1])
+	{
+	  presets++;
+	}
+    }
+
+  samples = 0;
+  while (samples < layout->max_samples && saddresses[samples])
+    {
+      samples++;
+    }
+
+  emu_print (0, 0, "Bank name: %.*s\n", EMU3_NAME_SIZE, bank.name);
+  emu_print (0, 0, "Bank size: %zuB\n", (gsize) st.st_size);
+  emu_print (0, 0, "Bank format: %s\n", bank.format);
+  emu_print (0, 0, "Preset blocks: %d\n", bank.preset_blocks);
+  emu_print (0, 0, "Sample blocks: %d\n", bank.sample_blocks);
+  emu_print (0, 0, "Total  blocks: %d\n", bank.total_blocks);
+  emu_print (0, 0, "Presets: %d\n", presets);
+  emu_print (0, 0, "Samples: %d\n", samples);
+
+  //There is always a 0xee (3X and ESI) or a 0x00 (Three) byte before the samples
+  sample_start_addr = layout->preset_start + 1 - layout->preset_offset +
+    paddresses[layout->max_presets];
+
+  //The sample metadata is shown by default as it is what this mode is for.
+  err = EXIT_SUCCESS;
+  for (gint i = 0; i < samples; i++)
+    {
+      addr = sample_start_addr + saddresses[i] - SAMPLE_OFFSET;
+      if (emu3_pread (fd, &sample, sizeof (struct emu3_sample), addr))
+	{
+	  emu_error ("Unexpected end of bank");
+	  err = EXIT_FAILURE;
+	  break;
+	}
+      emu3_print_sample (&sample, i + 1, 0);
+    }
+
+end:
+  g_free (paddresses);
+  g_free (saddresses);
+  close (fd);
+  return err;
+}
+
 static void
 emu3_process_zone (struct emu_file *file, struct emu3_preset_zone *zone,
 		   gint level, gint cutoff, gint q, gint filter)
@@ -1164,6 +1283,9 @@ emu3_process_zone (struct emu_file *file, struct emu3_preset_zone *zone,
     emu3_set_preset_zone_q (file, zone, q);
   if (filter != -1)
     emu3_set_preset_zone_filter (zone, filter);
+  if (level != -1 || cutoff != -1 || q != -1 || filter != -1)
+    emu_file_set_dirty (file, (gchar *) zone - file->raw,
+			sizeof (struct emu3_preset_zone));
 }
 
 static void
@@ -1193,17 +1315,10 @@ emu3_process_note_zone (struct emu_file *file,
 }
 
 static void
-emu3_process_preset (struct emu_file *file, gint preset_num,
-		     gchar *rt_controls, gint pbr, gint level, gint cutoff,
-		     gint q, gint filter)
+emu3_process_preset_params (struct emu_file *file,
+			    struct emu3_preset *preset, gchar *rt_controls,
+			    gint pbr)
 {
-  struct emu3_preset *preset = emu3_get_preset (file, preset_num);
-  struct emu3_preset_zone *zones;
-  struct emu3_preset_note_zone *note_zones;
-
-  emu_print (0, 0, "Preset %03d: %.*s\n", preset_num, EMU3_NAME_SIZE,
-	     preset->name);
-
   if (rt_controls)
     {
       gchar *rtc = strdup (rt_controls);
@@ -1216,6 +1331,27 @@ emu3_process_preset (struct emu_file *file, gint preset_num,
       emu3_set_preset_pbr (preset, pbr);
     }
 
+  if (rt_controls || pbr != -1)
+    {
+      emu_file_set_dirty (file, (gchar *) preset - file->raw,
+			  sizeof (struct emu3_preset));
+    }
+}
+
+static void
+emu3_process_preset (struct emu_file *file, gint preset_num,
+		     gchar *rt_controls, gint pbr, gint level, gint cutoff,
+		     gint q, gint filter)
+{
+  struct emu3_preset *preset = emu3_get_preset (file, preset_num);
+  struct emu3_preset_zone *zones;
+  struct emu3_preset_note_zone *note_zones;
+
+  emu_print (0, 0, "Preset %03d: %.*s\n", preset_num, EMU3_NAME_SIZE,
+	     preset->name);
+
+  emu3_process_preset_params (file, preset, rt_controls, pbr);
+
   emu3_print_preset_info (preset);
 
   emu_print (1, 1, "Note mappings:\n");
@@ -1239,68 +1375,161 @@ emu3_process_preset (struct emu_file *file, gint preset_num,
     }
 }
 
-static gint
-emu3_find_first_zone_for_sample (struct emu_file *file, gint sample_num,
-				 struct emu3_preset_zone **first_zone)
+struct emu3_sample_refs
 {
+  struct emu3_preset_zone *first_zone;
+  GArray *presets;
+};
+
+// Builds the sample to zone index in a single pass over all the presets. The
+// first zone of a sample is the one used when extracting it and it is taken
+// from the first note zone that uses it, preferring the sec layer.
+static struct emu3_sample_refs *
+emu3_new_sample_index (struct emu_file *file)
+{
+  gint zones, sample_num;
   guint32 *addresses;
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint preset_num, max_presets = emu3_get_max_presets (bank);
+  gint max_presets = emu3_get_max_presets (file);
+  gint max_samples = emu3_get_max_samples (file);
   struct emu3_preset *preset;
   struct emu3_preset_note_zone *note_zones;
-  struct emu3_preset_zone *zones;
+  struct emu3_preset_zone *preset_zones;
   struct emu3_preset_zone *zone;
+  struct emu3_sample_refs *refs, *index;
+
+  //Sample numbers are 1 based.
+  index = g_malloc0 (sizeof (struct emu3_sample_refs) * (max_samples + 1));
 
-  preset_num = 0;
-  addresses = emu3_get_preset_addresses (bank);
-  while (preset_num < max_presets)
+  addresses = emu3_get_preset_addresses (file);
+  for (gint i = 0; i < max_presets; i++, addresses++)
     {
-      if (addresses[0] != addresses[1])
+      if (addresses[0] == addresses[1])
+	{
+	  continue;
+	}
+
+      preset = emu3_get_preset (file, i);
+      note_zones = emu3_get_preset_note_zones (file, i);
+      preset_zones = emu3_get_preset_zones (file, i);
+
+      for (gint j = 0; j < preset->note_zones; j++)
 	{
-	  preset = emu3_get_preset (file, preset_num);
-	  note_zones = emu3_get_preset_note_zones (file, preset_num);
-	  zones = emu3_get_preset_zones (file, preset_num);
-	  for (gint i = 0; i < preset->note_zones; i++)
+	  zone = NULL;
+	  if (note_zones[j].pri_zone != 0xff)
 	    {
-	      zone = NULL;
-	      if (note_zones->pri_zone != 0xff)
-		{
-		  zone = &zones[note_zones->pri_zone];
-		}
-	      if (note_zones->sec_zone != 0xff)
-		{
-		  zone = &zones[note_zones->sec_zone];
-		}
+	      zone = &preset_zones[note_zones[j].pri_zone];
+	    }
+	  if (note_zones[j].sec_zone != 0xff)
+	    {
+	      zone = &preset_zones[note_zones[j].sec_zone];
+	    }
 
-	      if (zone != NULL && emu3_get_sample_num (zone) == sample_num)
+	  if (zone)
+	    {
+	      sample_num = emu3_get_sample_num (zone);
+	      if (sample_num > 0 && sample_num <= max_samples &&
+		  !index[sample_num].first_zone)
 		{
-		  *first_zone = zone;
-		  return 1;
+		  index[sample_num].first_zone = zone;
 		}
+	    }
+	}
+
+      zones = emu3_count_zones (preset, note_zones);
+      for (gint j = 0; j < zones; j++)
+	{
+	  sample_num = emu3_get_sample_num (&preset_zones[j]);
+	  if (sample_num <= 0 || sample_num > max_samples)
+	    {
+	      continue;
+	    }
 
-	      note_zones++;
+	  refs = &index[sample_num];
+	  if (!refs->presets)
+	    {
+	      refs->presets = g_array_new (FALSE, FALSE, sizeof (gint));
+	    }
+	  if (!refs->presets->len ||
+	      g_array_index (refs->presets, gint, refs->presets->len - 1) != i)
+	    {
+	      g_array_append_val (refs->presets, i);
 	    }
 	}
-      addresses++;
-      preset_num++;
     }
 
-  return 0;
+  return index;
+}
+
+static void
+emu3_free_sample_index (struct emu_file *file,
+			struct emu3_sample_refs *index)
+{
+  gint max_samples = emu3_get_max_samples (file);
+
+  for (gint i = 0; i <= max_samples; i++)
+    {
+      if (index[i].presets)
+	{
+	  g_array_free (index[i].presets, TRUE);
+	}
+    }
+  g_free (index);
+}
+
+GArray *
+emu3_get_sample_presets (struct emu_file *file, gint sample_num)
+{
+  GArray *presets;
+  struct emu3_sample_refs *index;
+
+  emu_set_context (file->ctx);
+
+  if (sample_num <= 0 || sample_num > emu3_get_max_samples (file))
+    {
+      emu_error ("Invalid sample number: %d", sample_num);
+      return NULL;
+    }
+
+  index = emu3_new_sample_index (file);
+  presets = index[sample_num].presets;
+  index[sample_num].presets = NULL;
+  emu3_free_sample_index (file, index);
+
+  return presets ? presets : g_array_new (FALSE, FALSE, sizeof (gint));
+}
+
+static void
+emu3_print_sample_presets (GArray *presets)
+{
+  GString *str;
+
+  if (!presets)
+    {
+      return;
+    }
+
+  str = g_string_new (NULL);
+  for (guint i = 0; i < presets->len; i++)
+    {
+      g_string_append_printf (str, "%s%03d", i ? ", " : "",
+			      g_array_index (presets, gint, i));
+    }
+  emu_print (1, 1, "Presets: %s\n", str->str);
+  g_string_free (str, TRUE);
 }
 
 static gint
 emu3_get_sample (struct emu_file *file, gint sample_num,
 		 struct emu3_sample **sample)
 {
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint max_samples = emu3_get_max_samples (bank);
+  gint max_samples = emu3_get_max_samples (file);
 
   if (sample_num - 1 < max_samples)
     {
-      guint32 *addresses = emu3_get_sample_addresses (bank);
-      guint32 sample_start_addr = emu3_get_sample_start_address (bank);
+      guint32 *addresses = emu3_get_sample_addresses (file);
+      guint32 sample_start_addr = emu3_get_sample_start_address (file);
       guint32 address = sample_start_addr + addresses[sample_num - 1] -
-	SAMPLE_OFFSET;
+	SAMPLE_OFFSET + file->gap;
       *sample = (struct emu3_sample *) &file->raw[address];
       return 0;
     }
@@ -1317,18 +1546,20 @@ emu3_process_bank (struct emu_file *file, gint ext_mode, gint edit_preset,
 		   gchar *rt_controls, gint pbr, gint level, gint cutoff,
 		   gint q, gint filter)
 {
-  gint i;
+  gint i, err = EXIT_SUCCESS;
   guint32 *addresses;
   guint32 address;
   guint32 sample_start_addr;
   guint32 next_sample_addr;
   struct emu3_sample *sample;
+  struct emu3_sample_refs *index;
   gint max_samples;
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint max_presets = emu3_get_max_presets (bank);
+  gint max_presets = emu3_get_max_presets (file);
+
+  emu_set_context (file->ctx);
 
   i = 0;
-  addresses = emu3_get_preset_addresses (bank);
+  addresses = emu3_get_preset_addresses (file);
   while (i < max_presets)
     {
       if (addresses[0] != addresses[1])
@@ -1340,45 +1571,57 @@ emu3_process_bank (struct emu_file *file, gint ext_mode, gint edit_preset,
       i++;
     }
 
-  sample_start_addr = emu3_get_sample_start_address (bank);
+  sample_start_addr = emu3_get_sample_start_address (file);
   emu_print (1, 0, "Sample start: 0x%08x\n", sample_start_addr);
 
-  max_samples = emu3_get_max_samples (bank);
-  addresses = emu3_get_sample_addresses (bank);
+  max_samples = emu3_get_max_samples (file);
+  addresses = emu3_get_sample_addresses (file);
   emu_print (1, 0, "Start with offset: 0x%08x\n", addresses[0]);
   emu_print (1, 0, "Next with offset: 0x%08x\n", addresses[max_samples]);
-  next_sample_addr = emu3_get_next_sample_address (bank);
+  next_sample_addr = emu3_get_next_sample_address (file);
   emu_print (1, 0, "Next sample: 0x%08x (equals bank size)\n",
 	     next_sample_addr);
 
+  index = emu3_new_sample_index (file);
+
   i = 0;
   while (addresses[i] != 0 && i < max_samples)
     {
-      struct emu3_preset_zone *zone;
+      struct emu3_preset_zone *zone = index[i + 1].first_zone;
       guint32 original_key = 0;
       gfloat fraction = 0;
-      address = sample_start_addr + addresses[i] - SAMPLE_OFFSET;
+      address = sample_start_addr + addresses[i] - SAMPLE_OFFSET + file->gap;
       sample = (struct emu3_sample *) &file->raw[address];
-      if (ext_mode)
+      if (ext_mode && zone)
 	{
-	  if (emu3_find_first_zone_for_sample (file, i + 1, &zone))
-	    {
-	      original_key = zone->original_key;
-	      fraction = emu3_get_note_tuning_from_s8 (zone->note_tuning);
-	    }
+	  original_key = zone->original_key;
+	  fraction = emu3_get_note_tuning_from_s8 (zone->note_tuning);
+	}
+      //A failed extraction does not stop the others.
+      if (emu3_process_sample (sample, i + 1, ext_mode, original_key,
+			       fraction))
+	{
+	  err = EXIT_FAILURE;
 	}
-      emu3_process_sample (sample, i + 1, ext_mode, original_key, fraction);
+      emu3_print_sample_presets (index[i + 1].presets);
       i++;
     }
 
-  return EXIT_SUCCESS;
+  if (emu3_finish_sample_extraction ())
+    {
+      err = EXIT_FAILURE;
+    }
+
+  emu3_free_sample_index (file, index);
+
+  return err;
 }
 
 static gint
-emu3_get_bank_presets (struct emu3_bank *bank)
+emu3_get_bank_presets (struct emu_file *file)
 {
-  guint32 *paddresses = emu3_get_preset_addresses (bank);
-  gint max_presets = emu3_get_max_presets (bank);
+  guint32 *paddresses = emu3_get_preset_addresses (file);
+  gint max_presets = emu3_get_max_presets (file);
   gint total = 0;
 
   while (paddresses[0] != paddresses[1] && total < max_presets)
@@ -1391,10 +1634,10 @@ emu3_get_bank_presets (struct emu3_bank *bank)
 }
 
 static gint
-emu3_get_bank_samples (struct emu3_bank *bank)
+emu3_get_bank_samples (struct emu_file *file)
 {
-  guint32 *saddresses = emu3_get_sample_addresses (bank);
-  gint max_samples = emu3_get_max_samples (bank);
+  guint32 *saddresses = emu3_get_sample_addresses (file);
+  gint max_samples = emu3_get_max_samples (file);
   gint total = 0;
 
   while (saddresses[0] != 0 && total < max_samples)
@@ -1406,170 +1649,847 @@ emu3_get_bank_samples (struct emu3_bank *bank)
   return total;
 }
 
-gint
-emu3_add_sample (struct emu_file *file, gchar *sample_path, gint *sample_num,
-		 gboolean *mono_out, guint32 *frames_out)
+//Appends the presets and the samples to list with the same format used by
+//emu3_process_bank. The bank is only read and ctx is used instead of the bank
+//context so that several threads can list the same bank at the same time.
+void
+emu3_list_bank (struct emu_context *ctx, struct emu_file *file,
+		GString *list)
 {
-  gboolean mono;
-  guint32 frames;
-  gint size, next_sample, sample_offset;
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint max_samples = emu3_get_max_samples (bank);
-  gint total_samples = emu3_get_bank_samples (bank);
-  guint32 *saddresses = emu3_get_sample_addresses (bank);
-  guint32 sample_start_addr = emu3_get_sample_start_address (bank);
-  guint32 next_sample_addr = emu3_get_next_sample_address (bank);
-  struct emu3_sample *sample =
-    (struct emu3_sample *) &file->raw[next_sample_addr];
+  struct emu3_preset *preset;
+  struct emu3_sample *sample;
+  gint presets = emu3_get_bank_presets (file);
+  gint samples = emu3_get_bank_samples (file);
 
-  if (total_samples == max_samples)
-    {
-      emu_error ("Sample limit reached");
-      return EXIT_FAILURE;
-    }
+  emu_set_context (ctx);
 
-  next_sample = total_samples + 1;	//Sample number is 1 based
-  if (sample_num)
+  for (gint i = 0; i < presets; i++)
     {
-      *sample_num = next_sample;
+      preset = emu3_get_preset (file, i);
+      g_string_append_printf (list, "Preset %03d: %.*s\n", i,
+			      EMU3_NAME_SIZE, preset->name);
     }
 
-  emu_debug (1, "Adding sample %d...", next_sample);
-  sample_offset = next_sample_addr - sample_start_addr - total_samples * 2;
-  size = emu3_append_sample (file, sample, sample_path, sample_offset,
-			     &mono, &frames);
-  if (size < 0)
+  for (gint i = 1; i <= samples; i++)
     {
-      emu_error ("Appending sample error");
-      return -size;
+      emu3_get_sample (file, i, &sample);
+      g_string_append_printf (list, "Sample %03d: %.*s\n", i,
+			      EMU3_NAME_SIZE, sample->name);
     }
+}
 
-  if (mono_out)
-    {
-      *mono_out = mono;
-    }
+//Applies the edits of emu3_process_bank to a single preset without listing it.
+gint
+emu3_edit_preset (struct emu_file *file, gint preset_num, gchar *rt_controls,
+		  gint pbr, gint level, gint cutoff, gint q, gint filter)
+{
+  struct emu3_preset *preset;
+  struct emu3_preset_zone *zones;
+  struct emu3_preset_note_zone *note_zones;
 
-  if (frames_out)
+  emu_set_context (file->ctx);
+
+  if (preset_num < 0 || preset_num >= emu3_get_bank_presets (file))
     {
-      *frames_out = frames;
+      emu_error ("Invalid preset number: %d", preset_num);
+      return EXIT_FAILURE;
     }
 
-  file->size += size;
+  preset = emu3_get_preset (file, preset_num);
+  emu3_process_preset_params (file, preset, rt_controls, pbr);
 
-  bank->objects++;
-  bank->next_sample = next_sample_addr + size - sample_start_addr;
-  saddresses[total_samples] = saddresses[max_samples];
-  saddresses[max_samples] = bank->next_sample + SAMPLE_OFFSET;
+  note_zones = emu3_get_preset_note_zones (file, preset_num);
+  zones = emu3_get_preset_zones (file, preset_num);
+  for (gint j = 0; j < preset->note_zones; j++, note_zones++)
+    {
+      if (note_zones->pri_zone != 0xff)
+	{
+	  emu3_process_zone (file, &zones[note_zones->pri_zone], level,
+			     cutoff, q, filter);
+	}
+      if (note_zones->sec_zone != 0xff)
+	{
+	  emu3_process_zone (file, &zones[note_zones->sec_zone], level,
+			     cutoff, q, filter);
+	}
+    }
 
   return EXIT_SUCCESS;
 }
 
-static void
-emu3_reset_envelope (struct emu3_envelope *envelope)
+static gsize
+emu3_get_end_address (struct emu_file *file)
 {
-  envelope->attack = 0;
-  envelope->hold = 0;
-  envelope->decay = 0;
-  envelope->sustain = 0x7f;
-  envelope->release = 0;
+  guint32 next_sample_addr = emu3_get_next_sample_address (file);
+  return file->size > next_sample_addr ? file->size : next_sample_addr;
 }
 
+//Ensures the buffer can grow inc_size bytes. As this might reallocate it, any
+//pointer to the bank memory must be obtained after calling this.
 static gint
-emu3_add_zones (struct emu_file *file, gint preset_num, gint zone_num,
-		struct emu3_preset_zone **preset_zone)
+emu3_reserve (struct emu_file *file, gsize inc_size)
 {
-  void *src, *dst, *zone_src, *zone_dst;
-  guint32 next_preset_addr, dst_addr;
-  guint32 *paddresses;
-  gsize size, inc_size;
-  guint32 next_sample_addr;
-  struct emu3_preset *preset;
-  struct emu3_preset_note_zone *note_zone;
-  gint max_presets;
-  struct emu3_bank *bank;
+  return emu_file_reserve (file, emu3_get_end_address (file) + file->gap +
+			   inc_size);
+}
+
+//While editing, there is a gap between the presets and the samples so that
+//inserting zones or presets only moves the presets that follow the insertion
+//point. The samples are moved only when the gap is exhausted, and then the
+//gap grows by at least EMU3_GAP_SIZE. emu3_write_file closes it.
+static gint
+emu3_reserve_gap (struct emu_file *file, gsize size)
+{
+  gsize inc, end;
+  guint32 sample_start_addr;
+
+  if (file->gap >= size)
+    {
+      return EXIT_SUCCESS;
+    }
 
-  inc_size = sizeof (struct emu3_preset_zone);
-  if (zone_num == -1)
-    inc_size += sizeof (struct emu3_preset_note_zone);
+  end = emu3_get_end_address (file);
+  inc = size - file->gap;
+  if (inc < EMU3_GAP_SIZE && end + file->gap + EMU3_GAP_SIZE <= EMU3_MEM_SIZE)
+    {
+      inc = EMU3_GAP_SIZE;
+    }
 
-  if (file->size + inc_size > EMU3_MEM_SIZE)
-    return -1;
+  if (emu_file_reserve (file, end + file->gap + inc))
+    {
+      return EXIT_FAILURE;
+    }
+
+  sample_start_addr = emu3_get_sample_start_address (file);
+
+  emu_debug (3, "Moving %zu B of samples to grow the gap to %zu B...",
+	     end - sample_start_addr, file->gap + inc);
+
+  memmove (&file->raw[sample_start_addr + file->gap + inc],
+	   &file->raw[sample_start_addr + file->gap],
+	   end - sample_start_addr);
+  file->gap += inc;
+  emu_file_set_all_dirty (file);
+
+  return EXIT_SUCCESS;
+}
+
+static void
+emu3_close_gap (struct emu_file *file)
+{
+  gsize end;
+  guint32 sample_start_addr;
+
+  if (!file->gap)
+    {
+      return;
+    }
+
+  end = emu3_get_end_address (file);
+  sample_start_addr = emu3_get_sample_start_address (file);
+
+  emu_debug (3, "Moving %zu B of samples to close a %zu B gap...",
+	     end - sample_start_addr, file->gap);
+
+  memmove (&file->raw[sample_start_addr],
+	   &file->raw[sample_start_addr + file->gap],
+	   end - sample_start_addr);
+  file->gap = 0;
+  emu_file_set_all_dirty (file);
+}
+
+//Adds the sample at sample_path or, if decoded is not NULL, the sample already
+//decoded by emu3_decode_sample from that path.
+static gint
+emu3_add_sample_data (struct emu_file *file, const gchar *sample_path,
+		      const struct emu3_sample *decoded, gint decoded_size,
+		      gint *sample_num, gboolean *mono_out,
+		      guint32 *frames_out)
+{
+  gboolean mono;
+  guint32 frames;
+  guint32 *saddresses;
+  gint size, next_sample, sample_offset;
+  struct emu3_bank *bank = EMU3_BANK (file);
+  gint max_samples = emu3_get_max_samples (file);
+  gint total_samples = emu3_get_bank_samples (file);
+  guint32 sample_start_addr = emu3_get_sample_start_address (file);
+  guint32 next_sample_addr = emu3_get_next_sample_address (file);
 
+  if (total_samples == max_samples)
+    {
+      emu_error ("Sample limit reached");
+      return EXIT_FAILURE;
+    }
+
+  next_sample = total_samples + 1;	//Sample number is 1 based
+  if (sample_num)
+    {
+      *sample_num = next_sample;
+    }
+
+  emu_debug (1, "Adding sample %d...", next_sample);
+  sample_offset = next_sample_addr - sample_start_addr - total_samples * 2;
+  if (decoded)
+    {
+      size = emu3_append_decoded_sample (file, next_sample_addr + file->gap,
+					 decoded, decoded_size,
+					 sample_offset);
+      mono = !(decoded->options & EMU3_SAMPLE_OPT_MONO_R);
+      frames = (decoded->end_l + sizeof (gint16) - decoded->start_l) /
+	sizeof (gint16);
+    }
+  else
+    {
+      size = emu3_append_sample (file, next_sample_addr + file->gap,
+				 sample_path, sample_offset, &mono, &frames);
+    }
+  //The cause was already reported and it is kept as the context error.
+  if (size < 0)
+    {
+      emu_debug (1, "Appending sample error");
+      return -size;
+    }
+
+  if (mono_out)
+    {
+      *mono_out = mono;
+    }
+
+  if (frames_out)
+    {
+      *frames_out = frames;
+    }
+
+  file->size += size;
+
+  //The buffer might have been reallocated.
   bank = EMU3_BANK (file);
-  next_preset_addr = emu3_get_preset_address (bank, preset_num + 1);
-  dst_addr = next_preset_addr + inc_size;
+  saddresses = emu3_get_sample_addresses (file);
 
-  paddresses = emu3_get_preset_addresses (bank);
-  max_presets = emu3_get_max_presets (bank);
-  for (gint i = preset_num + 1; i < max_presets + 1; i++)
-    paddresses[i] += inc_size;
+  bank->objects++;
+  bank->next_sample = next_sample_addr + size - sample_start_addr;
+  saddresses[total_samples] = saddresses[max_samples];
+  saddresses[max_samples] = bank->next_sample + SAMPLE_OFFSET;
 
-  next_sample_addr = emu3_get_next_sample_address (bank);
-  size = next_sample_addr - next_preset_addr;
+  emu_file_set_dirty (file, 0, sizeof (struct emu3_bank));
+  emu_file_set_dirty (file, (gchar *) &saddresses[total_samples] - file->raw,
+		      sizeof (guint32));
+  emu_file_set_dirty (file, (gchar *) &saddresses[max_samples] - file->raw,
+		      sizeof (guint32));
+  emu_file_set_dirty (file, next_sample_addr + file->gap, size);
 
-  emu_debug (3, "Moving %zu B from 0x%08x to 0x%08x...", size,
-	     next_preset_addr, dst_addr);
+  return EXIT_SUCCESS;
+}
 
-  src = &file->raw[next_preset_addr];
-  dst = &file->raw[dst_addr];
-  memmove (dst, src, size);
+gint
+emu3_add_sample (struct emu_file *file, gchar *sample_path, gint *sample_num,
+		 gboolean *mono_out, guint32 *frames_out)
+{
+  emu_set_context (file->ctx);
 
-  preset = emu3_get_preset (file, preset_num);
+  return emu3_add_sample_data (file, sample_path, NULL, 0, sample_num,
+			       mono_out, frames_out);
+}
 
-  if (zone_num == -1)
+//Samples are decoded in parallel while the ones already decoded are added to
+//the bank in the order of paths. With a single sample or job, decoding can not
+//overlap with the adding so the samples are decoded straight into the bank.
+gint
+emu3_add_samples (struct emu_file *file, GPtrArray *paths)
+{
+  gint size;
+  const gchar *path;
+  struct emu3_sample *decoded;
+  struct emu3_sample_queue *queue;
+  gint err = EXIT_SUCCESS;
+
+  emu_set_context (file->ctx);
+
+  if (paths->len == 1 || file->ctx->sample_jobs == 1)
     {
-      guint32 zone_addr = emu3_get_preset_zone_addr (file, preset_num);
-      guint32 zone_addr_dst =
-	zone_addr + sizeof (struct emu3_preset_note_zone);
+      for (guint i = 0; !err && i < paths->len; i++)
+	{
+	  err = emu3_add_sample_data (file, g_ptr_array_index (paths, i),
+				      NULL, 0, NULL, NULL, NULL);
+	}
+      return err;
+    }
+
+  queue = emu3_sample_queue_new (paths);
+  for (guint i = 0; !err && i < paths->len; i++)
+    {
+      decoded = emu3_sample_queue_pop (queue, &path, &size);
+      if (!decoded)
+	{
+	  emu_error ("Appending sample error");
+	  err = EXIT_FAILURE;
+	  break;
+	}
+
+      err = emu3_add_sample_data (file, path, decoded, size, NULL, NULL,
+				  NULL);
+      g_free (decoded);
+    }
+  emu3_sample_queue_free (queue);
 
-      zone_src = &file->raw[zone_addr];
-      zone_dst = &file->raw[zone_addr_dst];
+  return err;
+}
+
+static guint32
+emu3_get_sample_size (struct emu_file *file, gint sample_num)
+{
+  guint32 *saddresses = emu3_get_sample_addresses (file);
+  gint max_samples = emu3_get_max_samples (file);
+  guint32 next = sample_num < max_samples && saddresses[sample_num] ?
+    saddresses[sample_num] : saddresses[max_samples];
+
+  return next - saddresses[sample_num - 1];
+}
 
-      if (preset->note_zones > 0)
+//Removes samples from the bank. targets[i] is the sample the zones using the
+//sample i must use after the removal. The sample i is kept if targets[i] is i
+//and it is removed otherwise, which requires targets[i] to be a kept sample or
+//0 if no zone uses it. The sample data is repacked in a single pass.
+static void
+emu3_remove_samples (struct emu_file *file, const gint *targets)
+{
+  gint kept, zones, sample_num;
+  gint *numbers;
+  guint32 *paddresses, *saddresses;
+  guint32 src, dst, size, end, removed_bytes;
+  gint32 delta;
+  struct emu3_preset *preset;
+  struct emu3_preset_zone *preset_zones;
+  struct emu3_sample *sample;
+  struct emu3_bank *bank = EMU3_BANK (file);
+  gint max_presets = emu3_get_max_presets (file);
+  gint max_samples = emu3_get_max_samples (file);
+  gint total_samples = emu3_get_bank_samples (file);
+  guint32 sample_start_addr = emu3_get_sample_start_address (file);
+  guint32 next_sample_addr = emu3_get_next_sample_address (file);
+  gsize end_addr = emu3_get_end_address (file);
+
+  //Sample numbers are 1 based.
+  numbers = g_malloc0 (sizeof (gint) * (total_samples + 1));
+  kept = 0;
+  for (gint i = 1; i <= total_samples; i++)
+    {
+      if (targets[i] == i)
 	{
-	  size = next_preset_addr - zone_addr;
+	  kept++;
+	  numbers[i] = kept;
+	}
+    }
 
-	  emu_debug (3, "Moving %zu B from from 0x%08x to 0x%08x...", size,
-		     zone_addr, zone_addr_dst);
+  paddresses = emu3_get_preset_addresses (file);
+  for (gint i = 0; i < max_presets; i++, paddresses++)
+    {
+      if (paddresses[0] == paddresses[1])
+	{
+	  continue;
+	}
 
-	  memmove (zone_dst, zone_src, size);
+      preset = emu3_get_preset (file, i);
+      preset_zones = emu3_get_preset_zones (file, i);
+      zones = emu3_count_zones (preset, emu3_get_preset_note_zones (file, i));
+      for (gint j = 0; j < zones; j++)
+	{
+	  sample_num = emu3_get_sample_num (&preset_zones[j]);
+	  if (sample_num <= 0 || sample_num > total_samples)
+	    {
+	      continue;
+	    }
+	  sample_num = numbers[targets[sample_num]];
+	  preset_zones[j].sample_id_lsb = sample_num % 256;
+	  preset_zones[j].sample_id_msb = sample_num / 256;
 	}
+    }
 
-      note_zone = zone_src;
-      note_zone->options_lsb = 0;
-      note_zone->options_msb = 0;
-      note_zone->pri_zone = preset->note_zones;
-      note_zone->sec_zone = 0xff;
+  saddresses = emu3_get_sample_addresses (file);
+  dst = saddresses[0] - SAMPLE_OFFSET;
+  for (gint i = 1; i <= total_samples; i++)
+    {
+      src = saddresses[i - 1] - SAMPLE_OFFSET;
+      size = emu3_get_sample_size (file, i);
+      if (!numbers[i])
+	{
+	  emu_debug (1, "Removing sample %03d (%d B)...", i, size);
+	  continue;
+	}
 
-      guint32 next_zone_addr =
-	next_preset_addr + sizeof (struct emu3_preset_note_zone);
+      memmove (&file->raw[sample_start_addr + file->gap + dst],
+	       &file->raw[sample_start_addr + file->gap + src], size);
 
-      *preset_zone = (struct emu3_preset_zone *) &file->raw[next_zone_addr];
+      //The data offsets do not count the 2 bytes of every previous sample.
+      sample = (struct emu3_sample *) &file->raw[sample_start_addr +
+						 file->gap + dst];
+      delta = (gint32) (dst - (numbers[i] - 1) * 2) -
+	(gint32) (src - (i - 1) * 2);
+      sample->sample_data_offset_l += delta;
+      if (sample->sample_data_offset_r)
+	{
+	  sample->sample_data_offset_r += delta;
+	}
 
-      preset->note_zones++;
+      //The addresses of the samples not processed yet are not overwritten.
+      saddresses[numbers[i] - 1] = dst + SAMPLE_OFFSET;
+      dst += size;
     }
-  else
+
+  end = saddresses[max_samples] - SAMPLE_OFFSET;
+  removed_bytes = end - dst;
+
+  //Whatever follows the samples is kept.
+  memmove (&file->raw[sample_start_addr + file->gap + dst],
+	   &file->raw[next_sample_addr + file->gap],
+	   end_addr - next_sample_addr);
+
+  for (gint i = kept; i < total_samples; i++)
     {
-      note_zone = &emu3_get_preset_note_zones (file, preset_num)[zone_num];
-      note_zone->sec_zone = emu3_count_preset_zones (file, preset_num);
+      saddresses[i] = 0;
+    }
+  saddresses[max_samples] = dst + SAMPLE_OFFSET;
+
+  bank->next_sample = dst;
+  bank->objects -= total_samples - kept;
+  file->size -= removed_bytes;
+
+  emu_debug (1, "%d samples removed (%d B)", total_samples - kept,
+	     removed_bytes);
 
-      *preset_zone = (struct emu3_preset_zone *) &file->raw[next_preset_addr];
+  emu_file_set_all_dirty (file);
+
+  g_free (numbers);
+}
+
+struct emu3_sample_hash
+{
+  guint64 hash;
+  guint32 size;
+  gint sample_num;
+};
+
+//Fast non cryptographic hash. It takes the FNV-1a constants but XORs a whole
+//64 bits word before every multiplication, and only the tail byte by byte, so
+//it is not FNV-1a. Equal hashes are always confirmed by comparing the samples.
+static guint64
+emu3_hash_words (const guint8 *data, gsize len)
+{
+  guint64 word, hash = 0xcbf29ce484222325ULL;
+  gsize i = 0;
+
+  for (; i + sizeof (guint64) <= len; i += sizeof (guint64))
+    {
+      memcpy (&word, &data[i], sizeof (guint64));
+      hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+
+  for (; i < len; i++)
+    {
+      hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+static gint
+emu3_sample_hash_compare (gconstpointer a, gconstpointer b)
+{
+  const struct emu3_sample_hash *ha = a;
+  const struct emu3_sample_hash *hb = b;
+
+  if (ha->hash != hb->hash)
+    {
+      return ha->hash < hb->hash ? -1 : 1;
+    }
+  if (ha->size != hb->size)
+    {
+      return ha->size < hb->size ? -1 : 1;
     }
+  return ha->sample_num - hb->sample_num;
+}
+
+//Everything but the name and the data offsets, which depend on the position
+//of the sample in the bank, must be equal.
+static gboolean
+emu3_sample_equal (const struct emu3_sample *a, const struct emu3_sample *b,
+		   guint32 size)
+{
+  gsize header = offsetof (struct emu3_sample, sample_data_offset_l) -
+    offsetof (struct emu3_sample, header);
+  gsize data = size - offsetof (struct emu3_sample, parameters);
 
-  return inc_size;
+  return !memcmp (&a->header, &b->header, header) &&
+    !memcmp (a->parameters, b->parameters, data);
 }
 
 gint
-emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
-		      struct emu_zone_range *zone_range,
-		      struct emu3_preset_zone **zone_)
+emu3_dedup_samples (struct emu_file *file)
+{
+  gint *targets, duplicates;
+  GArray *hashes;
+  struct emu3_sample_hash h, *hi, *hj;
+  struct emu3_sample *si, *sj;
+  gint total_samples = emu3_get_bank_samples (file);
+
+  emu_set_context (file->ctx);
+
+  hashes = g_array_sized_new (FALSE, FALSE, sizeof (struct emu3_sample_hash),
+			      total_samples);
+  targets = g_malloc0 (sizeof (gint) * (total_samples + 1));
+
+  for (gint i = 1; i <= total_samples; i++)
+    {
+      emu3_get_sample (file, i, &si);
+      h.size = emu3_get_sample_size (file, i);
+      h.hash = emu3_hash_words ((guint8 *) si->parameters,
+				h.size -
+				offsetof (struct emu3_sample, parameters));
+      h.sample_num = i;
+      g_array_append_val (hashes, h);
+      targets[i] = i;
+    }
+
+  g_array_sort (hashes, emu3_sample_hash_compare);
+
+  //Samples with the same hash are contiguous and sorted by number so the
+  //kept samples are always the ones with the lowest number.
+  duplicates = 0;
+  for (guint i = 0; i < hashes->len; i++)
+    {
+      hi = &g_array_index (hashes, struct emu3_sample_hash, i);
+      emu3_get_sample (file, hi->sample_num, &si);
+      for (guint j = 0; j < i; j++)
+	{
+	  hj = &g_array_index (hashes, struct emu3_sample_hash, i - j - 1);
+	  if (hj->hash != hi->hash || hj->size != hi->size)
+	    {
+	      break;
+	    }
+	  if (targets[hj->sample_num] != hj->sample_num)
+	    {
+	      continue;
+	    }
+	  emu3_get_sample (file, hj->sample_num, &sj);
+	  if (emu3_sample_equal (si, sj, hi->size))
+	    {
+	      emu_debug (1, "Sample %03d is a duplicate of sample %03d",
+			 hi->sample_num, hj->sample_num);
+	      targets[hi->sample_num] = hj->sample_num;
+	      duplicates++;
+	      break;
+	    }
+	}
+    }
+
+  if (duplicates)
+    {
+      emu3_remove_samples (file, targets);
+    }
+
+  emu_print (1, 0, "%d duplicated samples removed\n", duplicates);
+
+  g_array_free (hashes, TRUE);
+  g_free (targets);
+
+  return EXIT_SUCCESS;
+}
+
+gint
+emu3_compact_samples (struct emu_file *file)
+{
+  gint *targets, unused;
+  struct emu3_sample_refs *index;
+  gint total_samples = emu3_get_bank_samples (file);
+
+  emu_set_context (file->ctx);
+
+  index = emu3_new_sample_index (file);
+  targets = g_malloc0 (sizeof (gint) * (total_samples + 1));
+
+  unused = 0;
+  for (gint i = 1; i <= total_samples; i++)
+    {
+      if (index[i].presets)
+	{
+	  targets[i] = i;
+	}
+      else
+	{
+	  emu_debug (1, "Sample %03d is not used by any preset", i);
+	  unused++;
+	}
+    }
+
+  if (unused)
+    {
+      emu3_remove_samples (file, targets);
+    }
+
+  emu_print (1, 0, "%d unused samples removed\n", unused);
+
+  emu3_free_sample_index (file, index);
+  g_free (targets);
+
+  return EXIT_SUCCESS;
+}
+
+static void
+emu3_reset_envelope (struct emu3_envelope *envelope)
+{
+  envelope->attack = 0;
+  envelope->hold = 0;
+  envelope->decay = 0;
+  envelope->sustain = 0x7f;
+  envelope->release = 0;
+}
+
+static void
+emu3_init_preset_zone (struct emu_file *file, struct emu3_preset_zone *zone,
+		       gint sample_num, struct emu_zone_range *zone_range)
+{
+  zone->original_key = zone_range->original_key;
+  zone->sample_id_lsb = sample_num % 256;
+  zone->sample_id_msb = sample_num / 256;
+  zone->parameter_a = 0x1f;
+  emu3_reset_envelope (&zone->vca_envelope);
+  zone->lfo_rate = 0x41;
+  zone->lfo_delay = 0x00;
+  zone->lfo_variation = 0;
+  zone->vcf_cutoff = DEFAULT_CUTOFF_U8;
+  zone->vcf_q = EMU3_LAYOUT (file)->vcf_q_flags;
+  zone->vcf_envelope_amount = 0;
+  emu3_reset_envelope (&zone->vcf_envelope);
+  emu3_reset_envelope (&zone->aux_envelope);
+  zone->aux_envelope_amount = 0;
+  zone->aux_envelope_dest = 0;
+  zone->vel_to_vca_level = 0;
+  zone->vel_to_vca_attack = 0;
+  zone->vel_to_vcf_cutoff = 0;
+  zone->vel_to_pitch = 0;
+  zone->vel_to_aux_env = 0;
+  zone->vel_to_vcf_q = 0;
+  zone->vel_to_vcf_attack = 0;
+  zone->vel_to_sample_start = 0;
+  zone->vel_to_pan = 0;
+  zone->lfo_to_pitch = 0;
+  zone->lfo_to_vca = 0;
+  zone->lfo_to_cutoff = 0;
+  zone->lfo_to_pan = 0;
+  zone->vca_level = 0x7f;
+  zone->note_tuning = 0;
+  zone->vcf_tracking = 0x40;
+  zone->note_on_delay = 0;
+  zone->vca_pan = 0x40;
+  zone->vcf_type_lfo_shape = 0x8;
+  zone->rt_enable_flags = 0xff;
+  zone->flags = 0x01;
+}
+
+// A transaction keeps a private copy of every preset it modifies. Operations
+// only change these copies and the commit writes all the presets following
+// the first modified one in a single pass. This way, the cost of an operation
+// does not depend on the bank size.
+
+struct emu3_transaction
+{
+  struct emu_file *file;
+  GByteArray **presets;		//Modified presets or NULL
+  GPtrArray *samples;		//Paths of the samples to append
+  gint total_samples;
+  guint32 objects;
+  gboolean preset_added;
+};
+
+#define EMU3_TX_PRESET(b) ((struct emu3_preset *) (b)->data)
+#define EMU3_TX_NOTE_ZONES(b) ((struct emu3_preset_note_zone *) &(b)->data[sizeof (struct emu3_preset)])
+#define EMU3_TX_ZONES_OFFSET(b) (sizeof (struct emu3_preset) + EMU3_TX_PRESET (b)->note_zones * sizeof (struct emu3_preset_note_zone))
+
+struct emu3_transaction *
+emu3_transaction_begin (struct emu_file *file)
+{
+  struct emu3_transaction *tx = g_malloc (sizeof (struct emu3_transaction));
+
+  emu_set_context (file->ctx);
+
+  tx->file = file;
+  tx->presets = g_malloc0 (sizeof (GByteArray *) *
+			   emu3_get_max_presets (file));
+  tx->samples = g_ptr_array_new_with_free_func (g_free);
+  tx->total_samples = emu3_get_bank_samples (file);
+  tx->objects = EMU3_BANK (file)->objects;
+  tx->preset_added = FALSE;
+
+  return tx;
+}
+
+void
+emu3_transaction_free (struct emu3_transaction *tx)
 {
+  gint max_presets = emu3_get_max_presets (tx->file);
+
+  for (gint i = 0; i < max_presets; i++)
+    {
+      if (tx->presets[i])
+	{
+	  g_byte_array_free (tx->presets[i], TRUE);
+	}
+    }
+  g_free (tx->presets);
+  g_ptr_array_free (tx->samples, TRUE);
+  g_free (tx);
+}
+
+static gsize
+emu3_transaction_get_preset_size (struct emu3_transaction *tx,
+				  gint preset_num)
+{
+  guint32 *paddresses;
+
+  if (tx->presets[preset_num])
+    {
+      return tx->presets[preset_num]->len;
+    }
+
+  paddresses = emu3_get_preset_addresses (tx->file);
+  return paddresses[preset_num + 1] - paddresses[preset_num];
+}
+
+static GByteArray *
+emu3_transaction_get_preset (struct emu3_transaction *tx, gint preset_num)
+{
+  guint32 addr;
+  GByteArray *preset = tx->presets[preset_num];
+
+  if (!preset)
+    {
+      addr = emu3_get_preset_address (tx->file, preset_num);
+      preset = g_byte_array_new ();
+      g_byte_array_append (preset, (guint8 *) & tx->file->raw[addr],
+			   emu3_transaction_get_preset_size (tx,
+							     preset_num));
+      tx->presets[preset_num] = preset;
+    }
+
+  return preset;
+}
+
+static gint
+emu3_transaction_get_bank_presets (struct emu3_transaction *tx)
+{
+  gint max_presets = emu3_get_max_presets (tx->file);
+  gint total = 0;
+
+  while (total < max_presets &&
+	 emu3_transaction_get_preset_size (tx, total) != 0)
+    {
+      total++;
+    }
+
+  return total;
+}
+
+static void
+emu3_byte_array_insert (GByteArray *array, guint pos, guint len)
+{
+  guint tail = array->len - pos;
+  g_byte_array_set_size (array, array->len + len);
+  memmove (&array->data[pos + len], &array->data[pos], tail);
+}
+
+gint
+emu3_transaction_add_sample (struct emu3_transaction *tx,
+			     const gchar *sample_path, gint *sample_num)
+{
+  emu_set_context (tx->file->ctx);
+
+  if (tx->total_samples == emu3_get_max_samples (tx->file))
+    {
+      emu_error ("Sample limit reached");
+      return EXIT_FAILURE;
+    }
+
+  tx->total_samples++;
+  tx->objects++;
+  g_ptr_array_add (tx->samples, g_strdup (sample_path));
+
+  if (sample_num)
+    {
+      *sample_num = tx->total_samples;	//Sample number is 1 based
+    }
+
+  return EXIT_SUCCESS;
+}
+
+gint
+emu3_transaction_add_preset (struct emu3_transaction *tx,
+			     const gchar *preset_name, gint *preset_num)
+{
+  gint i;
+  GByteArray *buf;
+  struct emu3_preset *new_preset;
+  gint max_presets = emu3_get_max_presets (tx->file);
+
+  emu_set_context (tx->file->ctx);
+
+  for (i = 0; i < max_presets; i++)
+    {
+      if (emu3_transaction_get_preset_size (tx, i) == 0)
+	break;
+    }
+
+  if (i == max_presets)
+    {
+      emu_error ("No more presets allowed");
+      return EXIT_FAILURE;
+    }
+
+  emu_debug (1, "Adding preset %d...", i);
+
+  if (preset_num)
+    {
+      *preset_num = i;
+    }
+
+  buf = emu3_transaction_get_preset (tx, i);
+  g_byte_array_set_size (buf, sizeof (struct emu3_preset));
+
+  new_preset = EMU3_TX_PRESET (buf);
+  emu3_cpystr (new_preset->name, preset_name);
+  memcpy (new_preset->rt_controls, DEFAULT_RT_CONTROLS,
+	  RT_CONTROLS_SIZE + RT_CONTROLS_FS_SIZE);
+  memset (new_preset->unknown_0, 0, PRESET_UNKNOWN_0_SIZE);
+  new_preset->pitch_bend_range = 2;
+  new_preset->velocity_range_pri_low = 0;
+  new_preset->velocity_range_pri_high = 0;
+  new_preset->velocity_range_sec_low = 0;
+  new_preset->velocity_range_sec_high = 0;
+  new_preset->link_preset_lsb = 0;
+  new_preset->link_preset_msb = 0;
+  memset (new_preset->unknown_1, 0, PRESET_UNKNOWN_1_SIZE);
+  new_preset->note_zones = 0;
+  memset (new_preset->note_zone_mappings, 0xff, EMU3_NOTES);
+
+  tx->objects = tx->total_samples + i;
+  tx->preset_added = TRUE;
+
+  return EXIT_SUCCESS;
+}
+
+gint
+emu3_transaction_add_preset_zone (struct emu3_transaction *tx,
+				  gint preset_num, gint sample_num,
+				  struct emu_zone_range *zone_range)
+{
+  guint offset;
   gint sec_zone_id;
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint total_presets = emu3_get_bank_presets (bank);
-  guint32 inc_size = 0;
+  GByteArray *buf;
   struct emu3_preset *preset;
-  struct emu3_preset_zone *zone;
+  struct emu3_preset_note_zone *note_zone;
+  gint total_presets = emu3_transaction_get_bank_presets (tx);
+
+  emu_set_context (tx->file->ctx);
 
   if (preset_num < 0 || preset_num >= total_presets)
     {
@@ -1587,7 +2507,8 @@ emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
 	     emu_get_note_name (zone_range->higher_key),
 	     zone_range->higher_key, preset_num);
 
-  preset = emu3_get_preset (file, preset_num);
+  buf = emu3_transaction_get_preset (tx, preset_num);
+  preset = EMU3_TX_PRESET (buf);
 
   if (zone_range->layer == 1)
     {
@@ -1609,12 +2530,19 @@ emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
 	  preset->note_zone_mappings[i] = preset->note_zones;
 	}
 
-      inc_size = emu3_add_zones (file, preset_num, -1, &zone);
-      if (inc_size < 0)
-	{
-	  emu_error ("No space left in bank");
-	  return EXIT_FAILURE;
-	}
+      //The new note zone goes after the existing ones.
+      offset = EMU3_TX_ZONES_OFFSET (buf);
+      emu3_byte_array_insert (buf, offset,
+			      sizeof (struct emu3_preset_note_zone));
+
+      preset = EMU3_TX_PRESET (buf);
+      note_zone = (struct emu3_preset_note_zone *) &buf->data[offset];
+      note_zone->options_lsb = 0;
+      note_zone->options_msb = 0;
+      note_zone->pri_zone = preset->note_zones;
+      note_zone->sec_zone = 0xff;
+
+      preset->note_zones++;
     }
   else if (zone_range->layer == 2)
     {
@@ -1634,226 +2562,393 @@ emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
 	  return EXIT_FAILURE;
 	}
 
-      inc_size = emu3_add_zones (file, preset_num, sec_zone_id, &zone);
-      if (inc_size < 0)
+      if (sec_zone_id == 0xff)
 	{
-	  emu_error ("No space left for zones");
+	  emu_error ("No pri zone assigned to these notes");
 	  return EXIT_FAILURE;
 	}
-    }
 
-  if (zone_)
+      note_zone = &EMU3_TX_NOTE_ZONES (buf)[sec_zone_id];
+      note_zone->sec_zone = emu3_count_zones (preset, EMU3_TX_NOTE_ZONES (buf));
+    }
+  else
     {
-      *zone_ = zone;
+      emu_error ("Invalid layer: %d", zone_range->layer);
+      return EXIT_FAILURE;
     }
 
-  zone->original_key = zone_range->original_key;
-  zone->sample_id_lsb = sample_num % 256;
-  zone->sample_id_msb = sample_num / 256;
-  zone->parameter_a = 0x1f;
-  emu3_reset_envelope (&zone->vca_envelope);
-  zone->lfo_rate = 0x41;
-  zone->lfo_delay = 0x00;
-  zone->lfo_variation = 0;
-  zone->vcf_cutoff = DEFAULT_CUTOFF_U8;
-  zone->vcf_q = strcmp (ESI_32_V3_DEF, bank->format) == 0 ? 0x80 : 0;
-  zone->vcf_envelope_amount = 0;
-  emu3_reset_envelope (&zone->vcf_envelope);
-  emu3_reset_envelope (&zone->aux_envelope);
-  zone->aux_envelope_amount = 0;
-  zone->aux_envelope_dest = 0;
-  zone->vel_to_vca_level = 0;
-  zone->vel_to_vca_attack = 0;
-  zone->vel_to_vcf_cutoff = 0;
-  zone->vel_to_pitch = 0;
-  zone->vel_to_aux_env = 0;
-  zone->vel_to_vcf_q = 0;
-  zone->vel_to_vcf_attack = 0;
-  zone->vel_to_sample_start = 0;
-  zone->vel_to_pan = 0;
-  zone->lfo_to_pitch = 0;
-  zone->lfo_to_vca = 0;
-  zone->lfo_to_cutoff = 0;
-  zone->lfo_to_pan = 0;
-  zone->vca_level = 0x7f;
-  zone->note_tuning = 0;
-  zone->vcf_tracking = 0x40;
-  zone->note_on_delay = 0;
-  zone->vca_pan = 0x40;
-  zone->vcf_type_lfo_shape = 0x8;
-  zone->rt_enable_flags = 0xff;
-  zone->flags = 0x01;
-
-  bank->next_preset += inc_size;
-  file->size += inc_size;
+  //The new zone goes always at the end of the preset.
+  offset = buf->len;
+  g_byte_array_set_size (buf, offset + sizeof (struct emu3_preset_zone));
+  emu3_init_preset_zone (tx->file,
+			 (struct emu3_preset_zone *) &buf->data[offset],
+			 sample_num, zone_range);
 
   return EXIT_SUCCESS;
 }
 
 gint
-emu3_del_preset_zone (struct emu_file *file, gint preset_num, gint zone_num)
+emu3_transaction_del_preset_zone (struct emu3_transaction *tx,
+				  gint preset_num, gint zone_num)
 {
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint zones, max_presets, total_presets = emu3_get_bank_presets (bank);
-  guint32 *paddresses, src_addr, dst_addr, dec_size_note_zone,
-    dec_size_zone, size, addr;
-  void *src, *dst;
+  gint zones;
+  GByteArray *buf;
+  guint offset;
+  guint8 removed[2];
   struct emu3_preset *preset;
   struct emu3_preset_note_zone *note_zone;
+  gint total_presets = emu3_transaction_get_bank_presets (tx);
+
+  emu_set_context (tx->file->ctx);
+
+  if (preset_num < 0 || preset_num >= total_presets)
+    {
+      emu_error ("Invalid preset number: %d", preset_num);
+      return EXIT_FAILURE;
+    }
+
+  buf = emu3_transaction_get_preset (tx, preset_num);
+  preset = EMU3_TX_PRESET (buf);
+  zones = emu3_count_zones (preset, EMU3_TX_NOTE_ZONES (buf));
+
+  if (zone_num < 0 || zone_num >= preset->note_zones)
+    {
+      emu_error ("Invalid zone number: %d", zone_num);
+      return EXIT_FAILURE;
+    }
+
+  //The zones of the note zone are removed from the highest one so that the
+  //offset of the other one is still valid.
+  note_zone = &EMU3_TX_NOTE_ZONES (buf)[zone_num];
+  removed[0] = MAX (note_zone->pri_zone, note_zone->sec_zone);
+  removed[1] = MIN (note_zone->pri_zone, note_zone->sec_zone);
+  if (removed[1] == removed[0])
+    {
+      removed[1] = 0xff;
+    }
+
+  offset = sizeof (struct emu3_preset) +
+    sizeof (struct emu3_preset_note_zone) * zone_num;
+  g_byte_array_remove_range (buf, offset,
+			     sizeof (struct emu3_preset_note_zone));
+  preset = EMU3_TX_PRESET (buf);
+  preset->note_zones--;
+
+  for (gint i = 0; i < 2; i++)
+    {
+      //Zones might be shared by several note zones.
+      if (removed[i] == 0xff || removed[i] >= zones ||
+	  emu3_is_zone_used (preset, EMU3_TX_NOTE_ZONES (buf), removed[i]))
+	{
+	  continue;
+	}
+
+      offset = EMU3_TX_ZONES_OFFSET (buf) +
+	sizeof (struct emu3_preset_zone) * removed[i];
+      g_byte_array_remove_range (buf, offset,
+				 sizeof (struct emu3_preset_zone));
+
+      note_zone = EMU3_TX_NOTE_ZONES (buf);
+      for (gint j = 0; j < preset->note_zones; j++, note_zone++)
+	{
+	  if (note_zone->pri_zone != 0xff && note_zone->pri_zone > removed[i])
+	    note_zone->pri_zone--;
+	  if (note_zone->sec_zone != 0xff && note_zone->sec_zone > removed[i])
+	    note_zone->sec_zone--;
+	}
+    }
+
+  for (gint i = 0; i < EMU3_NOTES; i++)
+    {
+      if (preset->note_zone_mappings[i] == zone_num)
+	preset->note_zone_mappings[i] = 0xff;
+      else if (preset->note_zone_mappings[i] > zone_num &&
+	       preset->note_zone_mappings[i] != 0xff)
+	preset->note_zone_mappings[i]--;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+//Writes all the presets from the first modified one and the byte that
+//precedes the samples. The gap must be big enough.
+static void
+emu3_transaction_write_presets (struct emu3_transaction *tx, gint first,
+				gsize size)
+{
+  GByteArray *area;
+  struct emu_file *file = tx->file;
+  gint max_presets = emu3_get_max_presets (file);
+  guint32 *paddresses = emu3_get_preset_addresses (file);
+  guint32 start_addr = emu3_get_preset_address (file, first);
+  guint32 sample_start_addr = emu3_get_sample_start_address (file);
+  guint32 *sizes = g_malloc (sizeof (guint32) * max_presets);
+
+  area = g_byte_array_sized_new (size);
+  for (gint i = first; i < max_presets; i++)
+    {
+      sizes[i] = emu3_transaction_get_preset_size (tx, i);
+      if (tx->presets[i])
+	{
+	  g_byte_array_append (area, tx->presets[i]->data, sizes[i]);
+	}
+      else
+	{
+	  guint32 addr = emu3_get_preset_address (file, i);
+	  g_byte_array_append (area, (guint8 *) & file->raw[addr], sizes[i]);
+	}
+    }
+  g_byte_array_append (area, (guint8 *) & file->raw[sample_start_addr - 1],
+		       1);
+
+  emu_debug (2, "Writing %u B of presets at 0x%08x...", area->len,
+	     start_addr);
+
+  memcpy (&file->raw[start_addr], area->data, area->len);
 
-  if (preset_num < 0 || preset_num >= total_presets)
+  for (gint i = first; i < max_presets; i++)
     {
-      emu_error ("Invalid preset number: %d", preset_num);
-      return EXIT_FAILURE;
+      paddresses[i + 1] = paddresses[i] + sizes[i];
     }
 
-  zones = emu3_count_preset_zones (file, preset_num);
+  g_byte_array_free (area, TRUE);
+  g_free (sizes);
+}
 
-  if (zone_num < 0 || zone_num >= zones)
-    {
-      emu_error ("Invalid zone number: %d", zone_num);
-      return EXIT_FAILURE;
+gint
+emu3_transaction_commit (struct emu3_transaction *tx)
+{
+  gint first;
+  gssize delta;
+  gsize old_size;
+  guint32 *saddresses;
+  struct emu3_bank *bank, bank_backup;
+  struct emu_file *file = tx->file;
+  guint32 *saddresses_backup = NULL;
+  gsize size_backup = file->size;
+  gint err = EXIT_SUCCESS;
+  gint max_presets = emu3_get_max_presets (file);
+  gsize saddresses_size = sizeof (guint32) *
+    (emu3_get_max_samples (file) + 1);
+
+  emu_set_context (file->ctx);
+
+  // Samples are appended at the end so they do not change the layout but
+  // they are restored if anything fails.
+  if (tx->samples->len)
+    {
+      bank_backup = *EMU3_BANK (file);
+      saddresses_backup = g_malloc (saddresses_size);
+      memcpy (saddresses_backup, emu3_get_sample_addresses (file),
+	      saddresses_size);
+
+      for (guint i = 0; i < tx->samples->len; i++)
+	{
+	  err = emu3_add_sample (file, g_ptr_array_index (tx->samples, i),
+				 NULL, NULL, NULL);
+	  if (err)
+	    {
+	      goto rollback;
+	    }
+	}
     }
 
-  preset = emu3_get_preset (file, preset_num);
+  for (first = 0; first < max_presets && !tx->presets[first]; first++);
 
-  note_zone = emu3_get_preset_note_zones (file, preset_num);
-  note_zone += zone_num;
-
-  addr = emu3_get_preset_note_zone_addr (file, preset_num);
-  dec_size_note_zone = sizeof (struct emu3_preset_note_zone);
-  src_addr = addr + sizeof (struct emu3_preset_note_zone) * (zone_num + 1);
-  dst_addr = addr + sizeof (struct emu3_preset_note_zone) * zone_num;
-  src = &file->raw[src_addr];
-  dst = &file->raw[dst_addr];
-  size = file->size - src_addr;
-  emu_debug (3, "Moving %d B from 0x%08x to 0x%08x...", size,
-	     src_addr, dst_addr);
-  memmove (dst, src, size);
-  preset->note_zones--;
+  if (first < max_presets)
+    {
+      delta = 0;
+      old_size = emu3_get_sample_start_address (file) -
+	emu3_get_preset_address (file, first);
+      for (gint i = first; i < max_presets; i++)
+	{
+	  if (tx->presets[i])
+	    {
+	      guint32 *paddresses = emu3_get_preset_addresses (file);
+	      delta += (gssize) tx->presets[i]->len -
+		(paddresses[i + 1] - paddresses[i]);
+	    }
+	}
 
-  dec_size_zone = 0;
-  if (note_zone->pri_zone != 0xff)
-    dec_size_zone += sizeof (struct emu3_preset_zone);
-  if (note_zone->sec_zone != 0xff)
-    dec_size_zone += sizeof (struct emu3_preset_zone);
+      if (delta > 0 && emu3_reserve_gap (file, delta))
+	{
+	  err = EXIT_FAILURE;
+	  goto rollback;
+	}
 
-  addr = emu3_get_preset_zone_addr (file, preset_num);
-  dst_addr = addr + sizeof (struct emu3_preset_zone) * zone_num;
-  src_addr = dst_addr + dec_size_zone;
-  src = &file->raw[src_addr];
-  dst = &file->raw[dst_addr];
-  size = file->size - dec_size_note_zone - src_addr;
-  emu_debug (3, "Moving %d B from 0x%08x to 0x%08x...", size,
-	     src_addr, dst_addr);
-  memmove (dst, src, size);
+      emu3_transaction_write_presets (tx, first, old_size + delta);
 
-  paddresses = emu3_get_preset_addresses (bank);
-  max_presets = emu3_get_max_presets (bank);
+      bank = EMU3_BANK (file);
+      bank->next_preset += delta;
+      file->size += delta;
+      file->gap -= delta;
+      emu_file_set_all_dirty (file);
+    }
 
-  for (gint i = preset_num + 1; i < max_presets + 1; i++)
-    paddresses[i] -= dec_size_note_zone + dec_size_zone;
+  bank = EMU3_BANK (file);
+  bank->objects = tx->objects;
+  if (tx->preset_added)
+    {
+      bank->selected_preset = 0;
+    }
 
-  bank->next_preset -= dec_size_note_zone + dec_size_zone;
-  file->size -= dec_size_note_zone + dec_size_zone;
+  goto end;
 
-  for (gint i = 0; i < EMU3_NOTES; i++)
+rollback:
+  if (saddresses_backup)
     {
-      if (preset->note_zone_mappings[i] == zone_num)
-	preset->note_zone_mappings[i] = 0xff;
-      else if (preset->note_zone_mappings[i] > zone_num &&
-	       preset->note_zone_mappings[i] != 0xff)
-	preset->note_zone_mappings[i]--;
+      *EMU3_BANK (file) = bank_backup;
+      saddresses = emu3_get_sample_addresses (file);
+      memcpy (saddresses, saddresses_backup, saddresses_size);
+      file->size = size_backup;
     }
 
-  return 0;
+end:
+  g_free (saddresses_backup);
+  emu3_transaction_free (tx);
+  return err;
 }
 
+//Parses the sample,layer,original,lower,higher zone parameters used by -z and
+//-Z. Keys are note names or, if is_num, note numbers.
 gint
-emu3_add_preset (struct emu_file *file, gchar *preset_name, gint *preset_num)
-{
-  gint i, objects;
-  guint32 copy_start_addr;
-  struct emu3_bank *bank = EMU3_BANK (file);
-  gint max_presets = emu3_get_max_presets (bank);
-  guint32 *paddresses = emu3_get_preset_addresses (bank);
-  guint32 next_sample_addr = emu3_get_next_sample_address (bank);
-  void *src, *dst;
+emu3_parse_zone_params (gchar *zone_params, gint *sample_num,
+			struct emu_zone_range *zone_range, gboolean is_num)
+{
+  gchar *sample_str = strsep (&zone_params, ",");
+  gchar *layer = strsep (&zone_params, ",");
+  gchar *original_key = strsep (&zone_params, ",");
+  gchar *lower_key = strsep (&zone_params, ",");
+  gchar *higher_key = strsep (&zone_params, ",");
+  gchar *endtoken;
 
-  objects = emu3_get_bank_samples (bank);
+  if (!higher_key)
+    {
+      emu_error ("Invalid zone parameters");
+      return EXIT_FAILURE;
+    }
 
-  for (i = 0; i < max_presets; i++)
+  *sample_num = strtol (sample_str, &endtoken, 10);
+  if (*endtoken != '\0' || *sample_num <= 0)
     {
-      if (paddresses[0] == paddresses[1])
-	break;
-      paddresses++;
+      emu_error ("Invalid sample %d", *sample_num);
+      return EXIT_FAILURE;
     }
 
-  if (i == max_presets)
+  gint orig_key_int;
+  if (is_num)
+    orig_key_int = strtol (original_key, &endtoken, 10);
+  else
+    orig_key_int = emu_reverse_note_search (original_key);
+  if (orig_key_int == -1 || orig_key_int < 0 || orig_key_int >= EMU3_NOTES)
     {
-      emu_error ("No more presets allowed");
+      emu_error ("Invalid original key %s", original_key);
       return EXIT_FAILURE;
     }
+  zone_range->original_key = orig_key_int;
 
-  emu_debug (1, "Adding preset %d...", i);
+  gint lower_key_int;
+  if (is_num)
+    lower_key_int = strtol (lower_key, &endtoken, 10);
+  else
+    lower_key_int = emu_reverse_note_search (lower_key);
+  if (lower_key_int == -1 || lower_key_int < 0 || lower_key_int >= EMU3_NOTES)
+    {
+      emu_error ("Invalid lower key %s", lower_key);
+      return EXIT_FAILURE;
+    }
+  zone_range->lower_key = lower_key_int;
 
-  if (preset_num)
+  gint higher_key_int;
+  if (is_num)
+    higher_key_int = strtol (higher_key, &endtoken, 10);
+  else
+    higher_key_int = emu_reverse_note_search (higher_key);
+  if (higher_key_int == -1 || higher_key_int < 0 ||
+      higher_key_int >= EMU3_NOTES)
     {
-      *preset_num = i;
+      emu_error ("Invalid higher key %s", higher_key);
+      return EXIT_FAILURE;
+    }
+  zone_range->higher_key = higher_key_int;
+
+  if (!strcmp ("pri", layer))
+    zone_range->layer = 1;
+  else if (!strcmp ("sec", layer))
+    zone_range->layer = 2;
+  else
+    {
+      emu_error ("Invalid layer %s", layer);
+      return EXIT_FAILURE;
     }
-  objects += i;
 
-  copy_start_addr = emu3_get_preset_address (bank, i);
+  return 0;
+}
 
-  src = &file->raw[copy_start_addr];
-  dst = &file->raw[copy_start_addr + sizeof (struct emu3_preset)];
+gint
+emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
+		      struct emu_zone_range *zone_range,
+		      struct emu3_preset_zone **zone)
+{
+  gint err;
+  guint32 addr;
+  struct emu3_transaction *tx = emu3_transaction_begin (file);
 
-  i++;
-  paddresses++;
+  err = emu3_transaction_add_preset_zone (tx, preset_num, sample_num,
+					  zone_range);
+  if (err)
+    {
+      emu3_transaction_free (tx);
+      return err;
+    }
 
-  for (; i < max_presets + 1; i++)
+  err = emu3_transaction_commit (tx);
+  if (!err && zone)
     {
-      *paddresses += sizeof (struct emu3_preset);
-      paddresses++;
+      //The new zone is the last one in the preset.
+      addr = emu3_get_preset_address (file, preset_num + 1) -
+	sizeof (struct emu3_preset_zone);
+      *zone = (struct emu3_preset_zone *) &file->raw[addr];
     }
 
-  gsize size = next_sample_addr - copy_start_addr;
+  return err;
+}
+
+gint
+emu3_del_preset_zone (struct emu_file *file, gint preset_num, gint zone_num)
+{
+  gint err;
+  struct emu3_transaction *tx = emu3_transaction_begin (file);
 
-  if (file->size + size > EMU3_MEM_SIZE)
+  err = emu3_transaction_del_preset_zone (tx, preset_num, zone_num);
+  if (err)
     {
-      emu_error ("Bank is full");
-      return EXIT_FAILURE;
+      emu3_transaction_free (tx);
+      return err;
     }
 
-  emu_debug (2, "Moving %zu B...", size);
-
-  memmove (dst, src, size);
+  return emu3_transaction_commit (tx);
+}
 
-  struct emu3_preset *new_preset = (struct emu3_preset *) src;
-  emu3_cpystr (new_preset->name, preset_name);
-  memcpy (new_preset->rt_controls, DEFAULT_RT_CONTROLS,
-	  RT_CONTROLS_SIZE + RT_CONTROLS_FS_SIZE);
-  memset (new_preset->unknown_0, 0, PRESET_UNKNOWN_0_SIZE);
-  new_preset->pitch_bend_range = 2;
-  new_preset->velocity_range_pri_low = 0;
-  new_preset->velocity_range_pri_high = 0;
-  new_preset->velocity_range_sec_low = 0;
-  new_preset->link_preset_lsb = 0;
-  new_preset->link_preset_msb = 0;
-  memset (new_preset->unknown_1, 0, PRESET_UNKNOWN_1_SIZE);
-  new_preset->note_zones = 0;
-  memset (new_preset->note_zone_mappings, 0xff, EMU3_NOTES);
+gint
+emu3_add_preset (struct emu_file *file, gchar *preset_name, gint *preset_num)
+{
+  gint err;
+  struct emu3_transaction *tx = emu3_transaction_begin (file);
 
-  bank->objects = objects;
-  bank->next_preset += sizeof (struct emu3_preset);
-  bank->selected_preset = 0;
-  file->size += sizeof (struct emu3_preset);
+  err = emu3_transaction_add_preset (tx, preset_name, preset_num);
+  if (err)
+    {
+      emu3_transaction_free (tx);
+      return err;
+    }
 
-  return EXIT_SUCCESS;
+  return emu3_transaction_commit (tx);
 }
 
 gint
-emu3_create_bank (const gchar *path, const gchar *type)
+emu3_create_bank (struct emu_context *ctx, const gchar *path,
+		  const gchar *type)
 {
   gint rvalue;
   struct emu3_bank bank;
@@ -1868,6 +2963,8 @@ emu3_create_bank (const gchar *path, const gchar *type)
   gint ret = sprintf (src_path, "%s/%s/%s%s", DATADIR, PACKAGE,
 		      EMPTY_BANK_TEMPLATE, type);
 
+  emu_set_context (ctx);
+
   if (ret < 0)
     {
       emu_error ("Error while creating src path");
@@ -1927,39 +3024,52 @@ gint
 emu3_write_file (struct emu_file *file)
 {
   struct emu3_bank *bank = EMU3_BANK (file);
-  guint32 sample_addr = emu3_get_sample_start_address (bank) - 1;
-  guint32 preset = ceil (sample_addr / (gdouble) EMU3_BLOCK_SIZE);
-  guint32 total = ceil (file->size / (gdouble) EMU3_BLOCK_SIZE);
+  guint32 sample_addr;
+  guint32 preset;
+  guint32 total;
+
+  emu_set_context (file->ctx);
+
+  emu3_close_gap (file);
+
+  sample_addr = emu3_get_sample_start_address (file) - 1;
+  preset = ceil (sample_addr / (gdouble) EMU3_BLOCK_SIZE);
+  total = ceil (file->size / (gdouble) EMU3_BLOCK_SIZE);
 
   bank->total_blocks = htole32 (total);
   bank->preset_blocks = htole32 (preset);
   bank->sample_blocks = htole32 (total - preset);
+  emu_file_set_dirty (file, 0, sizeof (struct emu3_bank));
 
   return emu_write_file (file);
 }
 
-static const gpointer
-emu3_get_opcode_val (struct emu_sfz_context *esctx, const gchar *key)
+static const union emu_sfz_value *
+emu3_get_opcode_val (struct emu_sfz_context *esctx,
+		     enum emu_sfz_opcode opcode)
 {
-  gchar *v = g_hash_table_lookup (esctx->region_opcodes, key);
+  const union emu_sfz_value *v;
+
+  v = emu_sfz_opcodes_get (esctx->region_opcodes, opcode);
   if (v)
     {
       return v;
     }
-  v = g_hash_table_lookup (esctx->group_opcodes, key);
+  v = emu_sfz_opcodes_get (esctx->group_opcodes, opcode);
   if (v)
     {
       return v;
     }
-  return g_hash_table_lookup (esctx->global_opcodes, key);
+  return emu_sfz_opcodes_get (esctx->global_opcodes, opcode);
 }
 
-static const gpointer
+static const union emu_sfz_value *
 emu3_get_opcode_val_with_alias (struct emu_sfz_context *esctx,
-				const gchar *key, const gchar *alias)
+				enum emu_sfz_opcode opcode,
+				enum emu_sfz_opcode alias)
 {
-  gpointer v = emu3_get_opcode_val (esctx, key);
-  if (!v && alias)
+  const union emu_sfz_value *v = emu3_get_opcode_val (esctx, opcode);
+  if (!v && alias != EMU_SFZ_OPCODE_NONE)
     {
       v = emu3_get_opcode_val (esctx, alias);
     }
@@ -1967,19 +3077,23 @@ emu3_get_opcode_val_with_alias (struct emu_sfz_context *esctx,
 }
 
 static gdouble
-emu3_get_opcode_number_val (struct emu_sfz_context *esctx, const gchar *key,
-			    const gchar *alias, gdouble min, gdouble max,
-			    gdouble def, gboolean *defined, gint decimals)
+emu3_get_opcode_number_val (struct emu_sfz_context *esctx,
+			    enum emu_sfz_opcode opcode,
+			    enum emu_sfz_opcode alias, gdouble min,
+			    gdouble max, gdouble def, gboolean *defined,
+			    gint decimals)
 {
   gdouble v;
-  const gdouble *val = emu3_get_opcode_val_with_alias (esctx, key, alias);
+  const union emu_sfz_value *val;
+
+  val = emu3_get_opcode_val_with_alias (esctx, opcode, alias);
   if (defined)
     {
       *defined = val != NULL;
     }
   if (val)
     {
-      v = *val;
+      v = val->number;
       if (v < min)
 	{
 	  v = min;
@@ -1988,12 +3102,13 @@ emu3_get_opcode_number_val (struct emu_sfz_context *esctx, const gchar *key,
 	{
 	  v = max;
 	}
-      if (v != *val)
+      if (v != val->number)
 	{
 	  emu_debug (1,
 		     "Value %.*f for opcode '%s' (alias or fallback '%s') outside range [ %.*f, %.*f ]. Using %.*f...",
-		     decimals, v, key, alias, decimals, min, decimals, max,
-		     decimals, v);
+		     decimals, v, emu_sfz_get_opcode_name (opcode),
+		     emu_sfz_get_opcode_name (alias), decimals, min, decimals,
+		     max, decimals, v);
 	}
     }
   else
@@ -2004,37 +3119,42 @@ emu3_get_opcode_number_val (struct emu_sfz_context *esctx, const gchar *key,
 }
 
 static gint64
-emu3_get_opcode_integer_val (struct emu_sfz_context *esctx, const gchar *key,
-			     const gchar *alias, gint64 min, gint64 max,
-			     gint64 def, gboolean *defined)
+emu3_get_opcode_integer_val (struct emu_sfz_context *esctx,
+			     enum emu_sfz_opcode opcode,
+			     enum emu_sfz_opcode alias, gint64 min,
+			     gint64 max, gint64 def, gboolean *defined)
 {
-  return emu3_get_opcode_number_val (esctx, key, alias, min, max, def,
+  return emu3_get_opcode_number_val (esctx, opcode, alias, min, max, def,
 				     defined, 0);
 }
 
 static gdouble
-emu3_get_opcode_float_val (struct emu_sfz_context *esctx, const gchar *key,
-			   const gchar *alias, gdouble min, gdouble max,
-			   gdouble def, gboolean *defined)
+emu3_get_opcode_float_val (struct emu_sfz_context *esctx,
+			   enum emu_sfz_opcode opcode,
+			   enum emu_sfz_opcode alias, gdouble min,
+			   gdouble max, gdouble def, gboolean *defined)
 {
-  return emu3_get_opcode_number_val (esctx, key, alias, min, max, def,
+  return emu3_get_opcode_number_val (esctx, opcode, alias, min, max, def,
 				     defined, 2);
 }
 
 static const gchar *
-emu3_get_opcode_string_val (struct emu_sfz_context *esctx, const gchar *key,
-			    const gchar *alias, const gchar *def,
+emu3_get_opcode_string_val (struct emu_sfz_context *esctx,
+			    enum emu_sfz_opcode opcode,
+			    enum emu_sfz_opcode alias, const gchar *def,
 			    gboolean *defined)
 {
   const gchar *v;
-  const gchar *val = emu3_get_opcode_val_with_alias (esctx, key, alias);
+  const union emu_sfz_value *val;
+
+  val = emu3_get_opcode_val_with_alias (esctx, opcode, alias);
   if (defined)
     {
       *defined = val != NULL;
     }
   if (val)
     {
-      v = val;
+      v = val->string;
     }
   else
     {
@@ -2173,25 +3293,28 @@ emu_replace_backslashes_in_path (gchar *sample_path)
 
 static void
 emu3_sfz_set_envelope (struct emu_sfz_context *esctx, struct emu3_envelope *e,
-		       const gchar *attack_opcode,
-		       const gchar *hold_opcode,
-		       const gchar *decay_opcode,
-		       const gchar *sustain_opcode,
-		       const gchar *release_opcode)
+		       enum emu_sfz_opcode attack_opcode,
+		       enum emu_sfz_opcode hold_opcode,
+		       enum emu_sfz_opcode decay_opcode,
+		       enum emu_sfz_opcode sustain_opcode,
+		       enum emu_sfz_opcode release_opcode)
 {
   gdouble v;
 
-  v = emu3_get_opcode_float_val (esctx, attack_opcode, NULL, 0, 100, 0, NULL);
+  v = emu3_get_opcode_float_val (esctx, attack_opcode, EMU_SFZ_OPCODE_NONE, 0,
+				 100, 0, NULL);
   e->attack = emu3_get_u8_from_time_163_69 (v);
-  v = emu3_get_opcode_float_val (esctx, hold_opcode, NULL, 0, 100, 0, NULL);
+  v = emu3_get_opcode_float_val (esctx, hold_opcode, EMU_SFZ_OPCODE_NONE, 0,
+				 100, 0, NULL);
   e->hold = emu3_get_u8_from_time_163_69 (v);
-  v = emu3_get_opcode_float_val (esctx, decay_opcode, NULL, 0, 100, 0, NULL);
+  v = emu3_get_opcode_float_val (esctx, decay_opcode, EMU_SFZ_OPCODE_NONE, 0,
+				 100, 0, NULL);
   e->decay = emu3_get_u8_from_time_163_69 (v);
-  v = emu3_get_opcode_float_val (esctx, sustain_opcode, NULL, 0, 100, 100,
-				 NULL);
+  v = emu3_get_opcode_float_val (esctx, sustain_opcode, EMU_SFZ_OPCODE_NONE, 0,
+				 100, 100, NULL);
   e->sustain = emu3_get_s8_from_percent (v);
-  v = emu3_get_opcode_float_val (esctx, release_opcode, NULL, 0, 100, 0.001,
-				 NULL);
+  v = emu3_get_opcode_float_val (esctx, release_opcode, EMU_SFZ_OPCODE_NONE, 0,
+				 100, 0.001, NULL);
   e->release = emu3_get_u8_from_time_163_69 (v);
 }
 
@@ -2201,7 +3324,7 @@ struct emu3_sfz_fil_type_map
   gint emu3_filter_id;		// -1 means not implemented
 };
 
-const struct emu3_sfz_fil_type_map EMU3_SFZ_FIL_TYPE_MAPS[] = {
+static const struct emu3_sfz_fil_type_map EMU3_SFZ_FIL_TYPE_MAPS[] = {
   {"bpf_1p", -1},
   {"brf_1p", -1},
   {"apf_1p", 11},		// Phaser 1
@@ -2305,24 +3428,221 @@ emu3_set_sample_options_from_sfz_loop_mode (struct emu3_sample *sample,
     }
 }
 
+struct emu3_sfz_sample
+{
+  gchar *path;
+  guint index;			//Position in the decoding queue
+  gint sample_num;		//Bank sample number once added
+};
+
+//The opcodes that apply to a region when it is parsed.
+struct emu3_sfz_region
+{
+  struct emu_sfz_opcodes *global_opcodes;
+  struct emu_sfz_opcodes *group_opcodes;
+  struct emu_sfz_opcodes *region_opcodes;
+  struct emu3_sfz_sample *sample;
+};
+
+static void
+emu3_sfz_sample_free (gpointer data)
+{
+  struct emu3_sfz_sample *sfz_sample = data;
+
+  g_free (sfz_sample->path);
+  g_free (sfz_sample);
+}
+
+static void
+emu3_sfz_region_free (gpointer data)
+{
+  struct emu3_sfz_region *region = data;
+
+  emu_sfz_opcodes_unref (region->global_opcodes);
+  emu_sfz_opcodes_unref (region->group_opcodes);
+  emu_sfz_opcodes_unref (region->region_opcodes);
+  g_free (region);
+}
+
+static void
+emu3_sfz_set_sample_opcodes (struct emu_sfz_context *esctx, gint sample_num,
+			     gboolean mono, guint32 frames)
+{
+  gint err;
+  const gchar *s;
+  gboolean defined;
+  const gchar *fil_type_def;
+  guint32 loop_start, loop_end;
+  struct emu3_sample *emu3_sample;
+
+  err = emu3_get_sample (esctx->file, sample_num, &emu3_sample);
+  if (err)
+    {
+      return;
+    }
+  fil_type_def = emu3_sample->options & EMU3_SAMPLE_OPT_LOOP ?
+    "loop_continuous" : "no_loop";
+  s = emu3_get_opcode_string_val (esctx, EMU_SFZ_OPCODE_LOOP_MODE,
+				  EMU_SFZ_OPCODE_NONE, fil_type_def, NULL);
+  emu3_set_sample_options_from_sfz_loop_mode (emu3_sample, s);
+
+  loop_start = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_LOOP_START,
+					    EMU_SFZ_OPCODE_NONE, 0,
+					    G_MAXUINT32, 0, &defined);
+  if (defined)
+    {
+      emu3_sample_set_loop_start (emu3_sample, mono, frames, loop_start);
+    }
+  loop_end = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_LOOP_END,
+					  EMU_SFZ_OPCODE_NONE, 0, G_MAXUINT32,
+					  0, &defined);
+  if (defined)
+    {
+      emu3_sample_set_loop_end (emu3_sample, mono, frames, loop_end);
+    }
+}
+
+// Regions sharing a sample file share the bank sample as long as all the
+// settings applied to the sample itself are the same.
+static gchar *
+emu3_sfz_get_sample_key (struct emu_sfz_context *esctx,
+			 const gchar *sample_path)
+{
+  gchar *key, *path;
+  const gchar *loop_mode;
+  const union emu_sfz_value *loop_start, *loop_end;
+  struct emu_context *ctx = esctx->file->ctx;
+
+  path = realpath (sample_path, NULL);
+  loop_mode = emu3_get_opcode_string_val (esctx, EMU_SFZ_OPCODE_LOOP_MODE,
+					  EMU_SFZ_OPCODE_NONE, "", NULL);
+  loop_start = emu3_get_opcode_val (esctx, EMU_SFZ_OPCODE_LOOP_START);
+  loop_end = emu3_get_opcode_val (esctx, EMU_SFZ_OPCODE_LOOP_END);
+
+  key = g_strdup_printf ("%s:%d:%d:%d:%s:%.0f:%.0f",
+			 path ? path : sample_path, ctx->max_sample_rate,
+			 ctx->bit_depth, ctx->resample_quality, loop_mode,
+			 loop_start ? loop_start->number : -1,
+			 loop_end ? loop_end->number : -1);
+
+  free (path);
+
+  return key;
+}
+
+//Samples are added to the bank in the order of the regions that use them.
+//The queue decodes them in the order they are first used, so the ones of
+//skipped regions are dropped and, if used later, decoded into the bank.
+static gint
+emu3_sfz_add_sample (struct emu_sfz_context *esctx,
+		     struct emu3_sfz_sample *sfz_sample, gint *sample_num)
+{
+  gint err, size;
+  gboolean mono;
+  guint32 frames;
+  const gchar *path;
+  struct emu3_sample *decoded;
+
+  if (sfz_sample->sample_num)
+    {
+      emu_debug (1, "Reusing sample %03d...", sfz_sample->sample_num);
+      *sample_num = sfz_sample->sample_num;
+      return EXIT_SUCCESS;
+    }
+
+  while (esctx->queue && esctx->next_sample < sfz_sample->index)
+    {
+      g_free (emu3_sample_queue_pop (esctx->queue, &path, &size));
+      esctx->next_sample++;
+    }
+
+  if (esctx->queue && esctx->next_sample == sfz_sample->index)
+    {
+      decoded = emu3_sample_queue_pop (esctx->queue, &path, &size);
+      esctx->next_sample++;
+      if (!decoded)
+	{
+	  emu_error ("Appending sample error");
+	  return EXIT_FAILURE;
+	}
+
+      err = emu3_add_sample_data (esctx->file, sfz_sample->path, decoded,
+				  size, sample_num, &mono, &frames);
+      g_free (decoded);
+    }
+  else
+    {
+      err = emu3_add_sample (esctx->file, sfz_sample->path, sample_num,
+			     &mono, &frames);
+    }
+  if (err)
+    {
+      return err;
+    }
+
+  sfz_sample->sample_num = *sample_num;
+  emu3_sfz_set_sample_opcodes (esctx, *sample_num, mono, frames);
+
+  return EXIT_SUCCESS;
+}
+
+//Called by the parser. The regions are processed after parsing the whole file
+//and the samples are queued to be decoded in the order they are first used.
 void
 emu3_sfz_add_region (struct emu_sfz_context *esctx)
+{
+  const gchar *sample;
+  gchar *sample_path, *sample_key;
+  struct emu3_sfz_region *region;
+  struct emu3_sfz_sample *sfz_sample = NULL;
+
+  sample = emu3_get_opcode_string_val (esctx, EMU_SFZ_OPCODE_SAMPLE,
+				       EMU_SFZ_OPCODE_NONE, NULL, NULL);
+  if (sample)
+    {
+      sample_path = g_strdup_printf ("%s/%s", esctx->sfz_dir, sample);
+      emu_replace_backslashes_in_path (sample_path);
+      sample_key = emu3_sfz_get_sample_key (esctx, sample_path);
+      sfz_sample = g_hash_table_lookup (esctx->samples, sample_key);
+      if (sfz_sample)
+	{
+	  g_free (sample_key);
+	  g_free (sample_path);
+	}
+      else
+	{
+	  sfz_sample = g_malloc0 (sizeof (struct emu3_sfz_sample));
+	  sfz_sample->path = sample_path;
+	  sfz_sample->index = esctx->sample_paths->len;
+	  g_hash_table_insert (esctx->samples, sample_key, sfz_sample);
+	  g_ptr_array_add (esctx->sample_paths, sample_path);
+	}
+    }
+
+  region = g_malloc (sizeof (struct emu3_sfz_region));
+  region->global_opcodes = emu_sfz_opcodes_ref (esctx->global_opcodes);
+  region->group_opcodes = emu_sfz_opcodes_ref (esctx->group_opcodes);
+  region->region_opcodes = emu_sfz_opcodes_ref (esctx->region_opcodes);
+  region->sample = sfz_sample;
+  g_ptr_array_add (esctx->regions, region);
+}
+
+static void
+emu3_sfz_commit_region (struct emu_sfz_context *esctx,
+			struct emu3_sfz_region *region)
 {
   gdouble f;
   const gchar *s;
-  gchar *sample_path;
+  const gchar *sample;
+  gboolean defined;
   struct emu_file *file;
-  struct emu3_bank *bank;
-  gboolean mono, defined;
   struct emu3_preset_zone *zone;
-  struct emu3_sample *emu3_sample;
   struct emu_zone_range zone_range;
-  const gchar *sample, *fil_type_def;
-  guint32 frames, loop_start, loop_end;
-  gint err, sample_num, actual_preset, i;
+  gint sample_num, actual_preset, i;
   gint lokey, hikey, pitch_keycenter, lovel, hivel;
 
-  sample = emu3_get_opcode_string_val (esctx, "sample", NULL, NULL, NULL);
+  sample = emu3_get_opcode_string_val (esctx, EMU_SFZ_OPCODE_SAMPLE,
+				       EMU_SFZ_OPCODE_NONE, NULL, NULL);
   if (!sample)
     {
       emu_error ("No 'sample' opcode found in region");
@@ -2330,21 +3650,25 @@ emu3_sfz_add_region (struct emu_sfz_context *esctx)
     }
 
   file = esctx->file;
-  bank = EMU3_BANK (file);
 
-  lokey = emu3_get_opcode_integer_val (esctx, "lokey", "key",
+  lokey = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_LOKEY,
+				       EMU_SFZ_OPCODE_KEY,
 				       EMU3_LOWEST_MIDI_NOTE,
 				       EMU3_HIGHEST_MIDI_NOTE,
 				       EMU3_LOWEST_MIDI_NOTE, NULL);
-  hikey = emu3_get_opcode_integer_val (esctx, "hikey", "key",
+  hikey = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_HIKEY,
+				       EMU_SFZ_OPCODE_KEY,
 				       EMU3_LOWEST_MIDI_NOTE,
 				       EMU3_HIGHEST_MIDI_NOTE,
 				       EMU3_HIGHEST_MIDI_NOTE, NULL);
-  pitch_keycenter = emu3_get_opcode_integer_val (esctx, "pitch_keycenter",
-						 "key", 0, 127, 60, NULL);
-  lovel = emu3_get_opcode_integer_val (esctx, "lovel", NULL, 1, 127, 1, NULL);
-  hivel = emu3_get_opcode_integer_val (esctx, "hivel", NULL, 1, 127, 127,
-				       NULL);
+  pitch_keycenter = emu3_get_opcode_integer_val (esctx,
+						 EMU_SFZ_OPCODE_PITCH_KEYCENTER,
+						 EMU_SFZ_OPCODE_KEY, 0, 127,
+						 60, NULL);
+  lovel = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_LOVEL,
+				       EMU_SFZ_OPCODE_NONE, 1, 127, 1, NULL);
+  hivel = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_HIVEL,
+				       EMU_SFZ_OPCODE_NONE, 1, 127, 127, NULL);
 
   emu_debug (1,
 	     "Processing region %02d for '%s' (pitch_keycenter: %d; lokey: %d; hikey: %d; lovel: %d, hivel: %d)...",
@@ -2381,12 +3705,7 @@ emu3_sfz_add_region (struct emu_sfz_context *esctx)
   zone_range.lower_key = lokey - EMU3_MIDI_NOTE_OFFSET;
   zone_range.higher_key = hikey - EMU3_MIDI_NOTE_OFFSET;
 
-  sample_path = g_strdup_printf ("%s/%s", esctx->sfz_dir, sample);
-  emu_replace_backslashes_in_path (sample_path);
-  err = emu3_add_sample (esctx->file, sample_path, &sample_num, &mono,
-			 &frames);
-  g_free (sample_path);
-  if (err)
+  if (emu3_sfz_add_sample (esctx, region->sample, &sample_num))
     {
       return;
     }
@@ -2399,104 +3718,90 @@ emu3_sfz_add_region (struct emu_sfz_context *esctx)
 
   // Region opcodes
 
-  // sample
-
-  err = emu3_get_sample (esctx->file, sample_num, &emu3_sample);
-  if (err)
-    {
-      return;
-    }
-  fil_type_def = emu3_sample->options & EMU3_SAMPLE_OPT_LOOP ?
-    "loop_continuous" : "no_loop";
-  s = emu3_get_opcode_string_val (esctx, "loop_mode", NULL, fil_type_def,
-				  NULL);
-  emu3_set_sample_options_from_sfz_loop_mode (emu3_sample, s);
-
-  loop_start = emu3_get_opcode_integer_val (esctx, "loop_start", NULL, 0,
-					    G_MAXUINT32, 0, &defined);
-  if (defined)
-    {
-      emu3_sample_set_loop_start (emu3_sample, mono, frames, loop_start);
-    }
-  loop_end = emu3_get_opcode_integer_val (esctx, "loop_end", NULL, 0,
-					  G_MAXUINT32, 0, &defined);
-  if (defined)
-    {
-      emu3_sample_set_loop_end (emu3_sample, mono, frames, loop_end);
-    }
-
-  f = emu3_get_opcode_integer_val (esctx, "tune", "pitch", -100, 100, 0,
-				   NULL);
+  f = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_TUNE,
+				   EMU_SFZ_OPCODE_PITCH, -100, 100, 0, NULL);
   zone->note_tuning = emu3_get_s8_from_note_tuning (f);
 
   // VCA and pan
 
-  f = emu3_get_opcode_float_val (esctx, "amp_veltrack", NULL, -100, 100,
-				 100, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_AMP_VELTRACK,
+				 EMU_SFZ_OPCODE_NONE, -100, 100, 100, NULL);
   zone->vel_to_vca_level = emu3_get_s8_from_percent (f);
 
-  emu3_sfz_set_envelope (esctx, &zone->vca_envelope, "ampeg_attack",
-			 "ampeg_hold", "ampeg_decay", "ampeg_sustain",
-			 "ampeg_release");
+  emu3_sfz_set_envelope (esctx, &zone->vca_envelope,
+			 EMU_SFZ_OPCODE_AMPEG_ATTACK,
+			 EMU_SFZ_OPCODE_AMPEG_HOLD, EMU_SFZ_OPCODE_AMPEG_DECAY,
+			 EMU_SFZ_OPCODE_AMPEG_SUSTAIN,
+			 EMU_SFZ_OPCODE_AMPEG_RELEASE);
 
-  f = emu3_get_opcode_float_val (esctx, "pan", NULL, -100, 100, 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_PAN,
+				 EMU_SFZ_OPCODE_NONE, -100, 100, 0, NULL);
   zone->vca_pan = emu3_get_s8_from_percent_signed (f);
 
-  f = emu3_get_opcode_float_val (esctx, "pan_veltrack", NULL, -100, 100, 0,
-				 NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_PAN_VELTRACK,
+				 EMU_SFZ_OPCODE_NONE, -100, 100, 0, NULL);
   zone->vel_to_pan = emu3_get_s8_from_percent (f);
 
   // VCF
 
-  s = emu3_get_opcode_string_val (esctx, "fil_type", NULL, "lpf_2p", NULL);
+  s = emu3_get_opcode_string_val (esctx, EMU_SFZ_OPCODE_FIL_TYPE,
+				  EMU_SFZ_OPCODE_NONE, "lpf_2p", NULL);
   i = emu3_get_filter_id_from_sfz_fil_type (s);
   emu3_set_preset_zone_filter (zone, i);
 
-  f = emu3_get_opcode_float_val (esctx, "cutoff", NULL,
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_CUTOFF,
+				 EMU_SFZ_OPCODE_NONE,
 				 TABLE_VCF_CUTOFF_FREQUENCY[0],
 				 TABLE_VCF_CUTOFF_FREQUENCY[255],
-				 emu3_get_vcf_cutoff_frequency_from_u8
-				 (DEFAULT_CUTOFF_U8), NULL);
+				 emu3_get_vcf_cutoff_frequency_from_u8 (DEFAULT_CUTOFF_U8),
+				 NULL);
   zone->vcf_cutoff = emu3_get_u8_from_vcf_cutoff_frequency (f);
 
   // Probably, the value mapping is not right as the whole SFZ range, which is
   // [ 0, 40 ] dB, is mapped to the whole output range, which is a percentage.
-  f = emu3_get_opcode_float_val (esctx, "resonance", NULL, 0, 40, 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_RESONANCE,
+				 EMU_SFZ_OPCODE_NONE, 0, 40, 0, NULL);
   zone->vcf_q = emu3_get_s8_from_percent (f * 2.5) |
-    (strcmp (ESI_32_V3_DEF, bank->format) == 0 ? 0x80 : 0);
+    EMU3_LAYOUT (file)->vcf_q_flags;
 
-  emu3_sfz_set_envelope (esctx, &zone->vcf_envelope, "fileg_attack",
-			 "fileg_hold", "fileg_decay", "fileg_sustain",
-			 "fileg_release");
+  emu3_sfz_set_envelope (esctx, &zone->vcf_envelope,
+			 EMU_SFZ_OPCODE_FILEG_ATTACK,
+			 EMU_SFZ_OPCODE_FILEG_HOLD, EMU_SFZ_OPCODE_FILEG_DECAY,
+			 EMU_SFZ_OPCODE_FILEG_SUSTAIN,
+			 EMU_SFZ_OPCODE_FILEG_RELEASE);
 
   // The value mapping is just an approximation as the device uses a percentage.
-  f = emu3_get_opcode_float_val (esctx, "fileg_depth", NULL, -12000, 12000, 0,
-				 NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_FILEG_DEPTH,
+				 EMU_SFZ_OPCODE_NONE, -12000, 12000, 0, NULL);
   zone->vcf_envelope_amount = emu3_get_s8_from_percent (f / 120);
 
   // The value mapping is just an approximation as the device uses a percentage.
-  f = emu3_get_opcode_float_val (esctx, "fil_veltrack", NULL, -9600, 9600, 0,
-				 NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_FIL_VELTRACK,
+				 EMU_SFZ_OPCODE_NONE, -9600, 9600, 0, NULL);
   zone->vel_to_vcf_cutoff = emu3_get_s8_from_percent (f / 96.0);
 
   // The range in the specification is smaller than the one one in the device,
   // which is [ -2.0, 2.0 ] or [ -2400, 2400 ].
-  f = emu3_get_opcode_float_val (esctx, "fil_keytrack", NULL, 0, 1200,
-				 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_FIL_KEYTRACK,
+				 EMU_SFZ_OPCODE_NONE, 0, 1200, 0, NULL);
   zone->vcf_tracking = emu3_get_s8_from_vcf_tracking (f / 1200.0);
 
   // Pitch
   // This makes use of the pitcheg envelope to set the auxiliary envelope.
   // As there is no auxiliary envelope in the SFZ, using this is compatible.
 
-  emu3_sfz_set_envelope (esctx, &zone->aux_envelope, "pitcheg_attack",
-			 "pitcheg_hold", "pitcheg_decay", "pitcheg_sustain",
-			 "pitcheg_release");
+  emu3_sfz_set_envelope (esctx, &zone->aux_envelope,
+			 EMU_SFZ_OPCODE_PITCHEG_ATTACK,
+			 EMU_SFZ_OPCODE_PITCHEG_HOLD,
+			 EMU_SFZ_OPCODE_PITCHEG_DECAY,
+			 EMU_SFZ_OPCODE_PITCHEG_SUSTAIN,
+			 EMU_SFZ_OPCODE_PITCHEG_RELEASE);
 
   // The SFZ range is [ -12000, 12000] (10 octaves) but this is truncated 31 semitores
   // to better match the device range.
-  f = emu3_get_opcode_float_val (esctx, "pitcheg_depth", NULL, -3100, 3100,
-				 0, &defined);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_PITCHEG_DEPTH,
+				 EMU_SFZ_OPCODE_NONE, -3100, 3100, 0,
+				 &defined);
   if (defined)
     {
       zone->aux_envelope_amount = emu3_get_s8_from_percent (f / 120);
@@ -2505,33 +3810,35 @@ emu3_sfz_add_region (struct emu_sfz_context *esctx)
 
   // LFO
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_rate", "lfo01_rate", 0.08,
-				 18.14, 4.25, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_RATE,
+				 EMU_SFZ_OPCODE_LFO01_RATE, 0.08, 18.14, 4.25,
+				 NULL);
   zone->lfo_rate = emu3_get_u8_from_lfo_rate (f);
 
-  i = emu3_get_opcode_integer_val (esctx, "lfo1_wave", "lfo01_wave", 0, 7,
-				   0, NULL);
+  i = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_LFO1_WAVE,
+				   EMU_SFZ_OPCODE_LFO01_WAVE, 0, 7, 0, NULL);
   zone->vcf_type_lfo_shape = (zone->vcf_type_lfo_shape & 0xf8) |
     emu3_get_lfo_shape_id_from_sfz_lfo_wave (i);
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_pitch", "lfo01_pitch", 0, 100,
-				 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_PITCH,
+				 EMU_SFZ_OPCODE_LFO01_PITCH, 0, 100, 0, NULL);
   zone->lfo_to_pitch = emu3_get_s8_from_percent (f);
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_volume", "lfo01_volume", 0, 100,
-				 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_VOLUME,
+				 EMU_SFZ_OPCODE_LFO01_VOLUME, 0, 100, 0, NULL);
   zone->lfo_to_vca = emu3_get_s8_from_percent (f);
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_cutoff", "lfo01_cutoff", 0, 100,
-				 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_CUTOFF,
+				 EMU_SFZ_OPCODE_LFO01_CUTOFF, 0, 100, 0, NULL);
   zone->lfo_to_cutoff = emu3_get_s8_from_percent (f);
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_pan", "lfo01_pan", 0, 100,
-				 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_PAN,
+				 EMU_SFZ_OPCODE_LFO01_PAN, 0, 100, 0, NULL);
   zone->lfo_to_pan = emu3_get_s8_from_percent (f);
 
-  f = emu3_get_opcode_float_val (esctx, "lfo1_delay", "lfo01_delay", 0,
-				 21.69, 0, NULL);
+  f = emu3_get_opcode_float_val (esctx, EMU_SFZ_OPCODE_LFO1_DELAY,
+				 EMU_SFZ_OPCODE_LFO01_DELAY, 0, 21.69, 0,
+				 NULL);
   zone->lfo_delay = emu3_get_u8_from_time_21_69 (f);
 
   esctx->region_num++;
@@ -2547,10 +3854,12 @@ emu3_sfz_set_preset_opcodes (struct emu_sfz_context *esctx)
   struct emu_velocity_range_map *vr;
 
   // This is required to not ignore the opcodes from the last read region.
-  g_hash_table_remove_all (esctx->region_opcodes);
+  emu_sfz_opcodes_unref (esctx->region_opcodes);
+  esctx->region_opcodes = emu_sfz_opcodes_new ();
 
-  bend_up = emu3_get_opcode_integer_val (esctx, "bend_up", "bendup",
-					 -9600, 9600, 200, NULL);
+  bend_up = emu3_get_opcode_integer_val (esctx, EMU_SFZ_OPCODE_BEND_UP,
+					 EMU_SFZ_OPCODE_BENDUP, -9600, 9600,
+					 200, NULL);
   v = bend_up / 100;
 
   for (gint i = 0; i < EMU3_NOTES; i++)
@@ -2572,8 +3881,11 @@ emu3_add_sfz (struct emu_file *file, const gchar *sfz_path)
   FILE *sfz;
   const gchar *ext;
   struct emu_sfz_context esctx;
+  struct emu_sfz_opcodes *global_opcodes, *group_opcodes, *region_opcodes;
   gchar *sfz_name, *bnsfz, *preset_name, *sfz_dir, *bdsfz;
 
+  emu_set_context (file->ctx);
+
   bdsfz = strdup (sfz_path);
   sfz_dir = dirname (bdsfz);
   bnsfz = strdup (sfz_path);
@@ -2592,43 +3904,82 @@ emu3_add_sfz (struct emu_file *file, const gchar *sfz_path)
       goto end;
     }
 
-  yyset_in (sfz);
+  //Presets and zones are created so the layout changes anyway.
+  emu_file_set_all_dirty (file);
 
   esctx.file = file;
   esctx.velocity_layer_num = 0;
   esctx.preset_name = preset_name;
   esctx.region_num = 0;
   esctx.sfz_dir = sfz_dir;
-  esctx.global_opcodes = g_hash_table_new_full (g_str_hash, g_str_equal,
-						g_free, g_free);
-  esctx.group_opcodes = g_hash_table_new_full (g_str_hash, g_str_equal,
-					       g_free, g_free);
-  esctx.region_opcodes = g_hash_table_new_full (g_str_hash, g_str_equal,
-						g_free, g_free);
+  esctx.global_opcodes = emu_sfz_opcodes_new ();
+  esctx.group_opcodes = emu_sfz_opcodes_new ();
+  esctx.region_opcodes = emu_sfz_opcodes_new ();
+  esctx.header_opcodes = NULL;
+  esctx.samples = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					 emu3_sfz_sample_free);
+  esctx.regions = g_ptr_array_new_with_free_func (emu3_sfz_region_free);
+  esctx.sample_paths = g_ptr_array_new ();
+  esctx.queue = NULL;
+  esctx.next_sample = 0;
   for (gint i = 0; i < EMU3_NOTES; i++)
     {
       struct emu_velocity_range_map *vr = &esctx.emu_velocity_range_maps[i];
       emu_velocity_range_map_set (vr, 0xff, 0xff, -1);
     }
 
-  sfz_parser_set_context (&esctx);
+  // Read regions
+  err = emu_sfz_parse (sfz, &esctx);
+
+  //Decoding only overlaps with the processing if there are several jobs.
+  if (!err && file->ctx->sample_jobs > 1 && esctx.sample_paths->len > 1)
+    {
+      esctx.queue = emu3_sample_queue_new (esctx.sample_paths);
+    }
 
   // Process regions
-  yyparse ();
+  global_opcodes = esctx.global_opcodes;
+  group_opcodes = esctx.group_opcodes;
+  region_opcodes = esctx.region_opcodes;
+  for (guint i = 0; !err && i < esctx.regions->len; i++)
+    {
+      struct emu3_sfz_region *region = g_ptr_array_index (esctx.regions, i);
+      esctx.global_opcodes = region->global_opcodes;
+      esctx.group_opcodes = region->group_opcodes;
+      esctx.region_opcodes = region->region_opcodes;
+      emu3_sfz_commit_region (&esctx, region);
+    }
+  esctx.global_opcodes = global_opcodes;
+  esctx.group_opcodes = group_opcodes;
+  esctx.region_opcodes = region_opcodes;
+
+  if (esctx.queue)
+    {
+      emu3_sample_queue_free (esctx.queue);
+    }
 
-  emu3_sfz_set_velocity_range_on (&esctx);
+  if (!err)
+    {
+      emu3_sfz_set_velocity_range_on (&esctx);
 
-  // Preset opcodes
+      // Preset opcodes
 
-  emu3_sfz_set_preset_opcodes (&esctx);
+      emu3_sfz_set_preset_opcodes (&esctx);
+    }
 
-  g_hash_table_unref (esctx.global_opcodes);
-  g_hash_table_unref (esctx.group_opcodes);
-  g_hash_table_unref (esctx.region_opcodes);
+  emu_sfz_opcodes_unref (esctx.global_opcodes);
+  emu_sfz_opcodes_unref (esctx.group_opcodes);
+  emu_sfz_opcodes_unref (esctx.region_opcodes);
+  g_ptr_array_free (esctx.regions, TRUE);
+  g_ptr_array_free (esctx.sample_paths, TRUE);
+  g_hash_table_unref (esctx.samples);
 
   fclose (sfz);
 
-  err = emu3_write_file (file);
+  if (!err)
+    {
+      err = emu3_write_file (file);
+    }
 
 end:
   free (bdsfz);
@@ -18,23 +18,16 @@
  *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef EMU3BM_H
+#define EMU3BM_H
+
+#include "libemu3bm.h"
 #include "sample.h"
 #include "utils.h"
-#include "../config.h"
 
 #define DEVICE_ESI2000 "esi2000"
 #define DEVICE_EMU3X "emu3x"
 
-// This does not represent a native structure.
-
-struct emu_zone_range
-{
-  guint8 layer;
-  guint8 original_key;
-  guint8 lower_key;
-  guint8 higher_key;
-};
-
 struct emu3_envelope
 {
   guint8 attack;
@@ -127,28 +120,6 @@ struct emu3_preset_zone
 // 1 0010
 // env mode gate, solo on
 
-gint emu3_add_sample (struct emu_file *file, gchar * sample_path,
-		      gint * sample_num, gboolean * mono, guint32 * frames);
-
-gint emu3_add_preset (struct emu_file *file, gchar * preset_name,
-		      gint * preset_num);
-
-gint
-emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
-		      struct emu_zone_range *zone_range,
-		      struct emu3_preset_zone **zone);
-
-gint emu3_del_preset_zone (struct emu_file *, gint, gint);
-
-gint emu3_process_bank (struct emu_file *, gint, gint, gchar *, gint, gint,
-			gint, gint, gint);
-
-gint emu3_create_bank (const gchar *, const gchar *);
-
 const gchar *emu3_get_err (gint);
 
-struct emu_file *emu3_open_file (const gchar * filename);
-
-gint emu3_write_file (struct emu_file *file);
-
-gint emu3_add_sfz (struct emu_file *file, const gchar * sfz_path);
+#endif
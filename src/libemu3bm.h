@@ -0,0 +1,177 @@
+/*
+ *   libemu3bm.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Public API of libemu3bm. Only the context and the bank calls are here.
+
+#ifndef LIBEMU3BM_H
+#define LIBEMU3BM_H
+
+#include <stdio.h>
+#include <glib.h>
+
+#define EMU3_SCRIPT_NO_VALUE -1
+
+typedef enum emu3_ext_mode
+{
+  EMU3_EXT_MODE_NONE = 0,
+  EMU3_EXT_MODE_NAME,
+  EMU3_EXT_MODE_NAME_NUMBER
+} emu3_ext_mode_t;
+
+typedef enum emu3_resample_quality
+{
+  EMU3_RESAMPLE_QUALITY_BEST = 0,
+  EMU3_RESAMPLE_QUALITY_MEDIUM,
+  EMU3_RESAMPLE_QUALITY_FASTEST,
+  EMU3_RESAMPLE_QUALITY_ZERO_ORDER_HOLD,
+  EMU3_RESAMPLE_QUALITY_LINEAR,
+  EMU3_RESAMPLE_QUALITY_POLYPHASE
+} emu3_resample_quality_t;
+
+//Settings and state of the library calls. A context must not be used by two
+//calls at the same time but any number of contexts can be used concurrently.
+struct emu_context;
+
+// This does not represent a native structure.
+
+struct emu_zone_range
+{
+  guint8 layer;
+  guint8 original_key;
+  guint8 lower_key;
+  guint8 higher_key;
+};
+
+struct emu_file;
+
+struct emu3_preset_zone;
+
+struct emu3_transaction;
+
+struct emu_context *emu_context_new (void);
+
+struct emu_context *emu_context_copy (struct emu_context *ctx);
+
+void emu_context_free (struct emu_context *ctx);
+
+void emu_context_set_verbosity (struct emu_context *ctx, gint verbosity);
+
+void emu_context_set_max_sample_rate (struct emu_context *ctx,
+				      gint max_sample_rate);
+
+void emu_context_set_bit_depth (struct emu_context *ctx, gint bit_depth);
+
+void emu_context_set_sample_jobs (struct emu_context *ctx, gint sample_jobs);
+
+void emu_context_set_resample_quality (struct emu_context *ctx,
+				       emu3_resample_quality_t quality);
+
+//Samples are extracted to the current directory if dir is NULL.
+void emu_context_set_extraction_dir (struct emu_context *ctx,
+				     const gchar * dir);
+
+//Listings are printed to stdout if output is NULL.
+void emu_context_set_output (struct emu_context *ctx, FILE * output);
+
+//Messages are printed to stderr if log is NULL.
+void emu_context_set_log (struct emu_context *ctx, FILE * log);
+
+void emu_context_clear_error (struct emu_context *ctx);
+
+gchar *emu_context_get_error (struct emu_context *ctx);
+
+gint emu3_create_bank (struct emu_context *ctx, const gchar * path,
+		       const gchar * type);
+
+gint emu3_print_bank_info (struct emu_context *ctx, const gchar * name);
+
+struct emu_file *emu3_open_file (struct emu_context *ctx,
+				  const gchar * filename, gboolean read_only);
+
+gint emu3_write_file (struct emu_file *file);
+
+void emu_close_file (struct emu_file *file);
+
+void emu3_list_bank (struct emu_context *ctx, struct emu_file *file,
+		     GString * list);
+
+gint emu3_process_bank (struct emu_file *file, gint ext_mode,
+			gint edit_preset, gchar * rt_controls, gint pbr,
+			gint level, gint cutoff, gint q, gint filter);
+
+gint emu3_add_sample (struct emu_file *file, gchar * sample_path,
+		      gint * sample_num, gboolean * mono, guint32 * frames);
+
+gint emu3_add_samples (struct emu_file *file, GPtrArray * paths);
+
+gint emu3_add_preset (struct emu_file *file, gchar * preset_name,
+		      gint * preset_num);
+
+gint
+emu3_add_preset_zone (struct emu_file *file, gint preset_num, gint sample_num,
+		      struct emu_zone_range *zone_range,
+		      struct emu3_preset_zone **zone);
+
+gint emu3_del_preset_zone (struct emu_file *file, gint preset_num,
+			   gint zone_num);
+
+gint emu3_parse_zone_params (gchar * zone_params, gint * sample_num,
+			     struct emu_zone_range *zone_range,
+			     gboolean is_num);
+
+gint emu3_edit_preset (struct emu_file *file, gint preset_num,
+		       gchar * rt_controls, gint pbr, gint level, gint cutoff,
+		       gint q, gint filter);
+
+gint emu3_dedup_samples (struct emu_file *file);
+
+gint emu3_compact_samples (struct emu_file *file);
+
+GArray *emu3_get_sample_presets (struct emu_file *file, gint sample_num);
+
+gint emu3_add_sfz (struct emu_file *file, const gchar * sfz_path);
+
+struct emu3_transaction *emu3_transaction_begin (struct emu_file *file);
+
+gint emu3_transaction_add_sample (struct emu3_transaction *tx,
+				  const gchar * sample_path,
+				  gint * sample_num);
+
+gint emu3_transaction_add_preset (struct emu3_transaction *tx,
+				  const gchar * preset_name,
+				  gint * preset_num);
+
+gint emu3_transaction_add_preset_zone (struct emu3_transaction *tx,
+				       gint preset_num, gint sample_num,
+				       struct emu_zone_range *zone_range);
+
+gint emu3_transaction_del_preset_zone (struct emu3_transaction *tx,
+				       gint preset_num, gint zone_num);
+
+gint emu3_transaction_commit (struct emu3_transaction *tx);
+
+void emu3_transaction_free (struct emu3_transaction *tx);
+
+gint emu3_run_script_command (struct emu_file *file, gint argc,
+			      gchar ** argv, gint * value);
+
+gint emu3_run_script (struct emu_file *file, FILE * script);
+
+#endif
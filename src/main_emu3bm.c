@@ -21,24 +21,35 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include "../config.h"
 #include "emu3bm.h"
+#include "batch.h"
+#include "server.h"
 
 static const struct option options[] = {
+  {"batch", 0, NULL, 'a'},
   {"pitch-bend-range", 1, NULL, 'b'},
   {"bit-depth", 1, NULL, 'B'},
   {"filter-cutoff", 1, NULL, 'c'},
   {"device-type", 1, NULL, 'd'},
+  {"dedup", 0, NULL, 'D'},
   {"preset-to-edit", 1, NULL, 'e'},
   {"filter-type", 1, NULL, 'f'},
   {"help", 0, NULL, 'h'},
+  {"info", 0, NULL, 'i'},
+  {"jobs", 1, NULL, 'j'},
+  {"compact", 0, NULL, 'k'},
   {"level", 1, NULL, 'l'},
+  {"script", 1, NULL, 'm'},
   {"new-bank", 1, NULL, 'n'},
   {"add-preset", 1, NULL, 'p'},
   {"filter-q", 1, NULL, 'q'},
+  {"resample-quality", 1, NULL, 'Q'},
   {"real-time-controls", 1, NULL, 'r'},
   {"max-sample-rate", 1, NULL, 'R'},
   {"add-sample", 1, NULL, 's'},
   {"import-sfz", 1, NULL, 'S'},
+  {"serve", 1, NULL, 'u'},
   {"verbosity", 0, NULL, 'v'},
   {"extract-samples", 0, NULL, 'x'},
   {"extract-samples-with-num", 0, NULL, 'X'},
@@ -48,86 +59,22 @@ static const struct option options[] = {
   {NULL, 0, NULL, 0}
 };
 
-static gint
-parse_zone_params (gchar *zone_params, gint *sample_num,
-		   struct emu_zone_range *zone_range, gint is_num)
-{
-  gchar *sample_str = strsep (&zone_params, ",");
-  gchar *layer = strsep (&zone_params, ",");
-  gchar *original_key = strsep (&zone_params, ",");
-  gchar *lower_key = strsep (&zone_params, ",");
-  gchar *higher_key = strsep (&zone_params, ",");
-  gchar *endtoken;
-
-  *sample_num = strtol (sample_str, &endtoken, 10);
-  if (*endtoken != '\0' || sample_num <= 0)
-    {
-      emu_error ("Invalid sample %d", *sample_num);
-      return EXIT_FAILURE;
-    }
-
-  gint orig_key_int;
-  if (is_num)
-    orig_key_int = strtol (original_key, &endtoken, 10);
-  else
-    orig_key_int = emu_reverse_note_search (original_key);
-  if (orig_key_int == -1 || orig_key_int < 0 || orig_key_int >= EMU3_NOTES)
-    {
-      emu_error ("Invalid original key %s", original_key);
-      return EXIT_FAILURE;
-    }
-  zone_range->original_key = orig_key_int;
-
-  gint lower_key_int;
-  if (is_num)
-    lower_key_int = strtol (lower_key, &endtoken, 10);
-  else
-    lower_key_int = emu_reverse_note_search (lower_key);
-  if (lower_key_int == -1 || lower_key_int < 0 || lower_key_int >= EMU3_NOTES)
-    {
-      emu_error ("Invalid lower key %s", lower_key);
-      return EXIT_FAILURE;
-    }
-  zone_range->lower_key = lower_key_int;
-
-  gint higher_key_int;
-  if (is_num)
-    higher_key_int = strtol (higher_key, &endtoken, 10);
-  else
-    higher_key_int = emu_reverse_note_search (higher_key);
-  if (higher_key_int == -1 || higher_key_int < 0 ||
-      higher_key_int >= EMU3_NOTES)
-    {
-      emu_error ("Invalid higher key %s", higher_key);
-      return EXIT_FAILURE;
-    }
-  zone_range->higher_key = higher_key_int;
-
-  if (!strcmp ("pri", layer))
-    zone_range->layer = 1;
-  else if (!strcmp ("sec", layer))
-    zone_range->layer = 2;
-  else
-    {
-      emu_error ("Invalid layer %s", layer);
-      return EXIT_FAILURE;
-    }
-
-  return 0;
-}
-
 gint
 main (gint argc, gchar *argv[])
 {
   gint opt;
   gint long_index = 0;
   gint xflg = 0, dflg = 0, sflg = 0, nflg = 0, sfzflg = 0, errflg =
-    0, modflg = 0, pflg = 0, zflg = 0, yflg = 0, ext_mode =
+    0, modflg = 0, pflg = 0, zflg = 0, yflg = 0, dedupflg = 0, compactflg =
+    0, infoflg = 0, scriptflg = 0, serveflg = 0, batchflg = 0, ext_mode =
     EMU3_EXT_MODE_NONE;
   gchar *device = NULL;
   gchar *bank_name = NULL;
-  gchar *sample_name;
+  GPtrArray *sample_paths = g_ptr_array_new_with_free_func (g_free);
   gchar *sfz_filename;
+  gchar *script_name = NULL;
+  gchar *socket_name = NULL;
+  FILE *script;
   gchar *preset_name;
   gchar *rt_controls = NULL;
   gchar *zone_params = NULL;
@@ -143,48 +90,76 @@ main (gint argc, gchar *argv[])
   gint sample_num;
   struct emu_zone_range zone_range;
   gint zone_num;
+  struct emu_context *ctx = emu_context_new ();
+
+  emu_set_context (ctx);
 
   while ((opt = getopt_long (argc, argv,
-			     "b:B:c:d:e:f:hl:np:q:r:R:s:S:vxXy:z:Z:", options,
+			     "ab:B:c:d:De:f:hij:kl:m:np:q:Q:r:R:s:S:u:vxXy:z:Z:", options,
 			     &long_index)) != -1)
     {
       switch (opt)
 	{
+	case 'a':
+	  batchflg++;
+	  break;
 	case 'b':
-	  pbr = get_positive_int (optarg);
+	  pbr = emu_get_positive_int (optarg);
 	  modflg++;
 	  break;
 	case 'B':
-	  bit_depth = get_positive_int_in_range (optarg,
-						 MIN_BIT_DEPTH,
-						 MAX_BIT_DEPTH);
-	  if (bit_depth < 0)
+	  ctx->bit_depth = emu_get_positive_int_in_range (optarg,
+							  MIN_BIT_DEPTH,
+							  MAX_BIT_DEPTH);
+	  if (ctx->bit_depth < 0)
 	    {
 	      exit (err);
 	    }
 	  break;
 	case 'c':
-	  cutoff = get_positive_int (optarg);
+	  cutoff = emu_get_positive_int (optarg);
 	  modflg++;
 	  break;
 	case 'd':
 	  dflg++;
 	  device = optarg;
 	  break;
+	case 'D':
+	  dedupflg++;
+	  break;
 	case 'e':
-	  preset_num = get_positive_int (optarg);
+	  preset_num = emu_get_positive_int (optarg);
 	  break;
 	case 'f':
-	  filter = get_positive_int (optarg);
+	  filter = emu_get_positive_int (optarg);
 	  modflg++;
 	  break;
 	case 'h':
 	  emu_print_help (argv[0], PACKAGE_STRING, options);
 	  exit (EXIT_SUCCESS);
+	case 'i':
+	  infoflg++;
+	  break;
+	case 'j':
+	  ctx->sample_jobs = emu_get_positive_int_in_range (optarg,
+							    MIN_SAMPLE_JOBS,
+							    MAX_SAMPLE_JOBS);
+	  if (ctx->sample_jobs < 0)
+	    {
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'k':
+	  compactflg++;
+	  break;
 	case 'l':
-	  level = get_positive_int (optarg);
+	  level = emu_get_positive_int (optarg);
 	  modflg++;
 	  break;
+	case 'm':
+	  scriptflg++;
+	  script_name = optarg;
+	  break;
 	case 'n':
 	  nflg++;
 	  break;
@@ -193,32 +168,46 @@ main (gint argc, gchar *argv[])
 	  pflg++;
 	  break;
 	case 'q':
-	  q = get_positive_int (optarg);
+	  q = emu_get_positive_int (optarg);
 	  modflg++;
 	  break;
+	case 'Q':
+	  ctx->resample_quality = emu3_resampler_get_quality (optarg);
+	  if (ctx->resample_quality < 0)
+	    {
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
 	case 'r':
 	  rt_controls = optarg;
 	  modflg++;
 	  break;
 	case 'R':
-	  max_sample_rate = get_positive_int_in_range (optarg,
-						       MIN_SAMPLE_RATE,
-						       MAX_SAMPLE_RATE);
-	  if (max_sample_rate < 0)
+	  ctx->max_sample_rate =
+	    emu_get_positive_int_in_range (optarg, MIN_SAMPLE_RATE,
+					   MAX_SAMPLE_RATE);
+	  if (ctx->max_sample_rate < 0)
 	    {
 	      exit (err);
 	    }
 	  break;
 	case 's':
-	  sflg++;
-	  sample_name = optarg;
+	  sflg = 1;
+	  if (emu3_add_sample_paths (optarg, sample_paths))
+	    {
+	      exit (EXIT_FAILURE);
+	    }
 	  break;
 	case 'S':
 	  sfzflg++;
 	  sfz_filename = optarg;
 	  break;
+	case 'u':
+	  serveflg++;
+	  socket_name = optarg;
+	  break;
 	case 'v':
-	  verbosity++;
+	  ctx->verbosity++;
 	  break;
 	case 'x':
 	  xflg++;
@@ -229,14 +218,14 @@ main (gint argc, gchar *argv[])
 	  ext_mode = EMU3_EXT_MODE_NAME_NUMBER;
 	  break;
 	case 'y':
-	  zone_num = get_positive_int (optarg);
+	  zone_num = emu_get_positive_int (optarg);
 	  yflg++;
 	  break;
 	case 'z':
 	case 'Z':
 	  zone_params = optarg;
-	  gint err = parse_zone_params (zone_params, &sample_num, &zone_range,
-					opt == 'Z');
+	  gint err = emu3_parse_zone_params (zone_params, &sample_num,
+					      &zone_range, opt == 'Z');
 	  if (err)
 	    exit (err);
 	  zflg++;
@@ -246,9 +235,17 @@ main (gint argc, gchar *argv[])
 	}
     }
 
-  if (optind + 1 == argc)
+  if (batchflg)
+    {
+      if (optind == argc)
+	errflg++;
+    }
+  else if (optind + 1 == argc)
     bank_name = argv[optind];
-  else
+  else if (!serveflg || optind != argc)
+    errflg++;
+
+  if (serveflg && bank_name)
     errflg++;
 
   if (!device)
@@ -265,9 +262,6 @@ main (gint argc, gchar *argv[])
   if (nflg > 1)
     errflg++;
 
-  if (sflg > 1)
-    errflg++;
-
   if (pflg > 1)
     errflg++;
 
@@ -280,10 +274,33 @@ main (gint argc, gchar *argv[])
   if (sfzflg > 1)
     errflg++;
 
-  if (nflg + sflg + pflg + zflg + yflg + sfzflg > 1)
+  if (dedupflg > 1)
     errflg++;
 
-  if ((nflg || sflg || pflg || zflg || yflg || sfzflg) && modflg)
+  if (compactflg > 1)
+    errflg++;
+
+  if (infoflg > 1)
+    errflg++;
+
+  if (scriptflg > 1)
+    errflg++;
+
+  if (serveflg > 1)
+    errflg++;
+
+  if (batchflg > 1)
+    errflg++;
+
+  if (nflg + sflg + pflg + zflg + yflg + sfzflg + dedupflg + compactflg +
+      infoflg + scriptflg + serveflg + batchflg > 1)
+    errflg++;
+
+  if ((nflg || sflg || pflg || zflg || yflg || sfzflg || dedupflg
+       || compactflg || infoflg || scriptflg || serveflg) && modflg)
+    errflg++;
+
+  if ((infoflg || serveflg) && xflg)
     errflg++;
 
   if (errflg > 0)
@@ -294,17 +311,50 @@ main (gint argc, gchar *argv[])
 
   if (nflg)
     {
-      err = emu3_create_bank (bank_name, device);
+      err = emu3_create_bank (ctx, bank_name, device);
+      exit (err);
+    }
+
+  if (infoflg)
+    {
+      err = emu3_print_bank_info (ctx, bank_name);
       exit (err);
     }
 
-  struct emu_file *file = emu3_open_file (bank_name);
+  if (serveflg)
+    {
+      err = emu3_serve (ctx, socket_name);
+      exit (err);
+    }
+
+  if (batchflg)
+    {
+      struct emu3_batch_params params = {
+	.ext_mode = ext_mode,
+	.preset_num = preset_num,
+	.rt_controls = rt_controls,
+	.pbr = pbr,
+	.level = level,
+	.cutoff = cutoff,
+	.q = q,
+	.filter = filter,
+	.write = modflg > 0
+      };
+      err = emu3_run_batch (ctx, &argv[optind], argc - optind, &params);
+      exit (err);
+    }
+
+  struct emu_file *file = emu3_open_file (ctx, bank_name,
+					   !(sflg || pflg || zflg || yflg
+					     || sfzflg || dedupflg
+					     || compactflg || scriptflg
+					     || modflg));
   if (!file)
     exit (EXIT_FAILURE);
 
   if (sflg)
     {
-      err = emu3_add_sample (file, sample_name, NULL, NULL, NULL);
+      err = emu3_add_samples (file, sample_paths);
       goto end;
     }
 
@@ -333,6 +383,35 @@ main (gint argc, gchar *argv[])
       goto end;
     }
 
+  if (dedupflg)
+    {
+      err = emu3_dedup_samples (file);
+      goto end;
+    }
+
+  if (compactflg)
+    {
+      err = emu3_compact_samples (file);
+      goto end;
+    }
+
+  if (scriptflg)
+    {
+      script = strcmp (script_name, "-") ? fopen (script_name, "r") : stdin;
+      if (!script)
+	{
+	  emu_error ("Error while opening %s for input", script_name);
+	  err = EXIT_FAILURE;
+	  goto end;
+	}
+      err = emu3_run_script (file, script);
+      if (script != stdin)
+	{
+	  fclose (script);
+	}
+      goto end;
+    }
+
   err = emu3_process_bank (file, ext_mode, preset_num, rt_controls, pbr,
 			   level, cutoff, q, filter);
 
@@ -342,12 +421,15 @@ end:
       goto close;
     }
 
-  if (sflg || pflg || zflg || yflg || modflg)
+  if (sflg || pflg || zflg || yflg || dedupflg || compactflg || scriptflg
+      || modflg)
     {
       err = emu3_write_file (file);
     }
 
 close:
   emu_close_file (file);
+  g_ptr_array_free (sample_paths, TRUE);
+  emu_context_free (ctx);
   exit (err);
 }
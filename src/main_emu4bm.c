@@ -60,7 +60,9 @@ struct emu4_chunk
 static const struct option options[] = {
   {"bit-depth", 1, NULL, 'B'},
   {"help", 0, NULL, 'h'},
+  {"jobs", 1, NULL, 'j'},
   {"new-bank", 1, NULL, 'n'},
+  {"resample-quality", 1, NULL, 'Q'},
   {"max-sample-rate", 1, NULL, 'R'},
   {"add-sample", 1, NULL, 's'},
   {"verbosity", 0, NULL, 'v'},
@@ -112,8 +114,16 @@ static struct emu_file *
 emu4_new_file (const gchar *name)
 {
   struct emu_file *file = emu_init_file (name);
-  struct emu4_chunk *chunk = (struct emu4_chunk *) file->raw;
+  struct emu4_chunk *chunk;
 
+  if (emu_file_reserve (file, sizeof (struct emu4_chunk) +
+			strlen (EMU4_E4_FORMAT)))
+    {
+      emu_close_file (file);
+      return NULL;
+    }
+
+  chunk = (struct emu4_chunk *) file->raw;
   emu4_chunk_set_name (chunk, EMU4_FORM_TAG);
   emu4_chunk_set_size (chunk, 0);
   memcpy (chunk->data, EMU4_E4_FORMAT, strlen (EMU4_E4_FORMAT));
@@ -123,28 +133,47 @@ emu4_new_file (const gchar *name)
   return file;
 }
 
+//The sample at path is decoded into the bank if it is not already decoded.
 static gint
-emu4_add_sample (struct emu_file *file, struct emu4_chunk *next_chunk,
-		 const gchar *sample_name)
+emu4_add_sample (struct emu_file *file, guint32 *chunk_addr,
+		 const gchar *path, const struct emu3_sample *decoded,
+		 gint decoded_size)
 {
   gint size;
   gboolean mono;
   guint32 chunk_size, frames;
-  struct emu4_chunk *form_chunk;
-  struct emu3_sample *sample;
+  struct emu4_chunk *form_chunk, *chunk;
+  guint32 sample_addr = *chunk_addr + sizeof (struct emu4_chunk) +
+    EMU4_E3S1_OFFSET;
 
-  emu4_chunk_set_name (next_chunk, EMU4_E3S1_TAG);
-  next_chunk->data[0] = 0;
-  next_chunk->data[1] = 0;
+  if (emu_file_reserve (file, sample_addr))
+    {
+      return 1;
+    }
 
-  sample = (struct emu3_sample *) &next_chunk->data[EMU4_E3S1_OFFSET];
-  size = emu3_append_sample (file, sample, sample_name, 0, &mono, &frames);
+  chunk = (struct emu4_chunk *) &file->raw[*chunk_addr];
+  emu4_chunk_set_name (chunk, EMU4_E3S1_TAG);
+  chunk->data[0] = 0;
+  chunk->data[1] = 0;
+
+  if (decoded)
+    {
+      size = emu3_append_decoded_sample (file, sample_addr, decoded,
+					 decoded_size, 0);
+    }
+  else
+    {
+      size = emu3_append_sample (file, sample_addr, path, 0, &mono, &frames);
+    }
   if (size < 0)
     {
       return 1;
     }
 
-  emu4_chunk_set_size (next_chunk, EMU4_E3S1_OFFSET + size);
+  //The buffer might have been reallocated.
+  chunk = (struct emu4_chunk *) &file->raw[*chunk_addr];
+
+  emu4_chunk_set_size (chunk, EMU4_E3S1_OFFSET + size);
   chunk_size = sizeof (struct emu4_chunk) + EMU4_E3S1_OFFSET + size;
 
   file->size += chunk_size;
@@ -153,19 +182,86 @@ emu4_add_sample (struct emu_file *file, struct emu4_chunk *next_chunk,
   emu4_chunk_set_size (form_chunk,
 		       emu4_chunk_get_size (form_chunk) + chunk_size);
 
+  emu_file_set_dirty (file, 0, sizeof (struct emu4_chunk));
+  emu_file_set_dirty (file, *chunk_addr, chunk_size);
+
+  *chunk_addr += chunk_size;
+
   return 0;
 }
 
+//Samples are decoded in parallel while the ones already decoded are appended
+//in the order of paths. With a single sample or job, they are decoded straight
+//into the bank.
+static gint
+emu4_add_samples (struct emu_file *file, struct emu4_chunk *next_chunk,
+		  gint sample_index, GPtrArray *paths)
+{
+  gint size = 0;
+  const gchar *path;
+  struct emu3_sample *decoded = NULL;
+  struct emu3_sample_queue *queue = NULL;
+  gint err = EXIT_SUCCESS;
+  guint32 chunk_addr = (gchar *) next_chunk - file->raw;
+
+  if (paths->len > 1 && file->ctx->sample_jobs > 1)
+    {
+      queue = emu3_sample_queue_new (paths);
+    }
+
+  for (guint i = 0; !err && i < paths->len; i++, sample_index++)
+    {
+      if (sample_index >= EMU4_MAX_SAMPLES)
+	{
+	  emu_error ("No space for more samples");
+	  err = EXIT_FAILURE;
+	  break;
+	}
+
+      if (queue)
+	{
+	  decoded = emu3_sample_queue_pop (queue, &path, &size);
+	  if (!decoded)
+	    {
+	      emu_error ("Error while adding sample '%s'", path);
+	      err = EXIT_FAILURE;
+	      break;
+	    }
+	}
+      else
+	{
+	  path = g_ptr_array_index (paths, i);
+	}
+
+      err = emu4_add_sample (file, &chunk_addr, path, decoded, size);
+      if (err)
+	{
+	  emu_error ("Error while adding sample '%s'", path);
+	}
+      g_free (decoded);
+      decoded = NULL;
+    }
+
+  if (queue)
+    {
+      emu3_sample_queue_free (queue);
+    }
+
+  return err;
+}
+
 static gint
 emu4_process_file (struct emu_file *file, gint ext_mode,
 		   struct emu4_chunk **next_chunk, gint *sample_index)
 {
+  gint err = EXIT_SUCCESS;
   guint32 size, total_size, chunk_size;
   struct emu4_chunk *chunk;
   struct emu3_sample *sample;
 
   chunk = (struct emu4_chunk *) file->raw;
-  if (!CHUNK_NAME_IS (chunk, EMU4_FORM_TAG))
+  if (file->size < sizeof (struct emu4_chunk) + strlen (EMU4_E4_FORMAT)
+      || !CHUNK_NAME_IS (chunk, EMU4_FORM_TAG))
     {
       emu_error ("Unexpected format");
       return EXIT_FAILURE;
@@ -186,7 +282,9 @@ emu4_process_file (struct emu_file *file, gint ext_mode,
   *sample_index = 1;
   while (1)
     {
-      if (size == total_size)
+      //Mapped files end at the last byte so nothing can be read past it.
+      if (size == total_size
+	  || (gchar *) chunk->data > file->raw + file->size)
 	{
 	  if (next_chunk)
 	    {
@@ -217,7 +315,10 @@ emu4_process_file (struct emu_file *file, gint ext_mode,
 	{
 	  emu4_chunk_print_named (chunk);
 	  sample = (struct emu3_sample *) &chunk->data[EMU4_E3S1_OFFSET];
-	  emu3_process_sample (sample, *sample_index, ext_mode, 0, 0);
+	  if (emu3_process_sample (sample, *sample_index, ext_mode, 0, 0))
+	    {
+	      err = EXIT_FAILURE;
+	    }
 	  (*sample_index)++;
 	}
       else if (CHUNK_NAME_IS (chunk, EMU4_E4P1_TAG))
@@ -247,7 +348,12 @@ emu4_process_file (struct emu_file *file, gint ext_mode,
       chunk = (struct emu4_chunk *) &chunk->data[chunk_size];
     }
 
-  return 0;
+  if (emu3_finish_sample_extraction ())
+    {
+      err = EXIT_FAILURE;
+    }
+
+  return err;
 }
 
 gint
@@ -256,24 +362,27 @@ main (gint argc, gchar *argv[])
   gint opt;
   gint nflg = 0, sflg = 0, xflg = 0, errflg = 0, totalflg;
   gint ext_mode = 0;
-  gchar *sample_name = NULL;
+  GPtrArray *sample_paths = g_ptr_array_new_with_free_func (g_free);
   gint long_index = 0;
   gint sample_index;
   gint err = EXIT_SUCCESS;
   struct emu4_chunk *next_chunk;
   const gchar *bank_name = NULL;
   struct emu_file *file;
+  struct emu_context *ctx = emu_context_new ();
+
+  emu_set_context (ctx);
 
-  while ((opt = getopt_long (argc, argv, "B:hnR:s:vxX", options,
+  while ((opt = getopt_long (argc, argv, "B:hj:nQ:R:s:vxX", options,
 			     &long_index)) != -1)
     {
       switch (opt)
 	{
 	case 'B':
-	  bit_depth = get_positive_int_in_range (optarg,
-						 MIN_BIT_DEPTH,
-						 MAX_BIT_DEPTH);
-	  if (bit_depth < 0)
+	  ctx->bit_depth = emu_get_positive_int_in_range (optarg,
+							  MIN_BIT_DEPTH,
+							  MAX_BIT_DEPTH);
+	  if (ctx->bit_depth < 0)
 	    {
 	      exit (err);
 	    }
@@ -281,24 +390,43 @@ main (gint argc, gchar *argv[])
 	case 'h':
 	  emu_print_help (argv[0], EMU4BM_PACKAGE_STRING, options);
 	  exit (EXIT_SUCCESS);
+	case 'j':
+	  ctx->sample_jobs = emu_get_positive_int_in_range (optarg,
+							    MIN_SAMPLE_JOBS,
+							    MAX_SAMPLE_JOBS);
+	  if (ctx->sample_jobs < 0)
+	    {
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
 	case 'n':
 	  nflg++;
 	  break;
+	case 'Q':
+	  ctx->resample_quality = emu3_resampler_get_quality (optarg);
+	  if (ctx->resample_quality < 0)
+	    {
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
 	case 'R':
-	  max_sample_rate = get_positive_int_in_range (optarg,
-						       MIN_SAMPLE_RATE,
-						       MAX_SAMPLE_RATE);
-	  if (max_sample_rate < 0)
+	  ctx->max_sample_rate =
+	    emu_get_positive_int_in_range (optarg, MIN_SAMPLE_RATE,
+					   MAX_SAMPLE_RATE);
+	  if (ctx->max_sample_rate < 0)
 	    {
 	      exit (err);
 	    }
 	  break;
 	case 's':
-	  sflg++;
-	  sample_name = optarg;
+	  sflg = 1;
+	  if (emu3_add_sample_paths (optarg, sample_paths))
+	    {
+	      exit (EXIT_FAILURE);
+	    }
 	  break;
 	case 'v':
-	  verbosity++;
+	  ctx->verbosity++;
 	  break;
 	case 'x':
 	  xflg++;
@@ -338,10 +466,15 @@ main (gint argc, gchar *argv[])
   if (nflg)
     {
       file = emu4_new_file (bank_name);
+      if (!file)
+	{
+	  exit (EXIT_FAILURE);
+	}
       emu_write_file (file);
+      emu_close_file (file);
     }
 
-  file = emu_open_file (bank_name);
+  file = emu_open_file (bank_name, !sflg);
   if (!file)
     {
       exit (EXIT_FAILURE);
@@ -355,9 +488,10 @@ main (gint argc, gchar *argv[])
 
   if (sflg)
     {
-      if (next_chunk && sample_index < EMU4_MAX_SAMPLES)
+      if (next_chunk)
 	{
-	  err = emu4_add_sample (file, next_chunk, sample_name);
+	  err = emu4_add_samples (file, next_chunk, sample_index,
+				  sample_paths);
 	  if (!err)
 	    {
 	      emu_write_file (file);
@@ -372,6 +506,8 @@ main (gint argc, gchar *argv[])
 
 end:
   emu_close_file (file);
+  g_ptr_array_free (sample_paths, TRUE);
+  emu_context_free (ctx);
 
   exit (err);
 }
@@ -0,0 +1,487 @@
+/*
+ *   resampler.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <samplerate.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "resampler.h"
+
+#define POLYPHASE_MAX_PHASES 1024
+#define POLYPHASE_ZERO_CROSSINGS 32
+#define POLYPHASE_ROLLOFF 0.92
+#define POLYPHASE_KAISER_BETA 8.6
+
+static const gchar *RESAMPLE_QUALITY_NAMES[] = {
+  "best", "medium", "fastest", "zero-order-hold", "linear", "polyphase"
+};
+
+static const gint RESAMPLE_QUALITY_CONVERTERS[] = {
+  SRC_SINC_BEST_QUALITY, SRC_SINC_MEDIUM_QUALITY, SRC_SINC_FASTEST,
+  SRC_ZERO_ORDER_HOLD, SRC_LINEAR, SRC_SINC_FASTEST
+};
+
+// The filter bank of a ratio is shared by all the resamplers using it.
+struct emu3_polyphase_bank
+{
+  guint phases;			//Interpolation factor
+  guint step;			//Decimation factor
+  guint taps;			//Taps per phase
+  gfloat *coefs;		//Reversed taps of every phase
+};
+
+struct emu3_polyphase
+{
+  const struct emu3_polyphase_bank *bank;
+  gint channels;
+  gfloat **buffers;		//Input history of every channel
+  glong capacity;
+  glong len;
+  gint64 start;			//Input frame at the buffer start
+  gint64 next_output;
+  gint64 input_frames;		//Input frames received so far
+  gboolean padded;
+};
+
+struct emu3_resampler
+{
+  gdouble ratio;
+  SRC_STATE *state;
+  struct emu3_polyphase *polyphase;
+};
+
+gint
+emu3_resampler_get_quality (const gchar *name)
+{
+  for (gint i = 0; i < G_N_ELEMENTS (RESAMPLE_QUALITY_NAMES); i++)
+    {
+      if (!strcmp (name, RESAMPLE_QUALITY_NAMES[i]))
+	{
+	  return i;
+	}
+    }
+
+  emu_error ("Invalid resample quality '%s'", name);
+  return -1;
+}
+
+static guint
+emu3_gcd (guint a, guint b)
+{
+  while (b)
+    {
+      guint t = a % b;
+      a = b;
+      b = t;
+    }
+  return a;
+}
+
+static gdouble
+emu3_bessel_i0 (gdouble x)
+{
+  gdouble sum = 1, term = 1;
+
+  for (gint k = 1; k < 50; k++)
+    {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+      if (term < sum * 1e-12)
+	{
+	  break;
+	}
+    }
+
+  return sum;
+}
+
+// Kaiser windowed sinc low-pass filter designed at the interpolated rate and
+// split into as many phases as the interpolation factor.
+static struct emu3_polyphase_bank *
+emu3_polyphase_bank_new (guint phases, guint step)
+{
+  gdouble fc, x, w, sum;
+  gdouble *prototype;
+  guint len, center;
+  struct emu3_polyphase_bank *bank;
+
+  bank = g_malloc (sizeof (struct emu3_polyphase_bank));
+  bank->phases = phases;
+  bank->step = step;
+  //Enough taps to keep the zero crossings when decimating.
+  bank->taps = POLYPHASE_ZERO_CROSSINGS * MAX (step, phases) / phases;
+  bank->taps = (bank->taps + 3) & ~3;
+
+  len = bank->taps * phases;
+  center = len / 2;
+  fc = POLYPHASE_ROLLOFF * 0.5 / MAX (step, phases);
+
+  prototype = g_malloc (sizeof (gdouble) * len);
+  sum = 0;
+  for (guint i = 0; i < len; i++)
+    {
+      x = (gdouble) i - center;
+      w = 2.0 * x / len;
+      w = emu3_bessel_i0 (POLYPHASE_KAISER_BETA * sqrt (MAX (0, 1 - w * w)))
+	/ emu3_bessel_i0 (POLYPHASE_KAISER_BETA);
+      prototype[i] = x == 0 ? 2 * fc : sin (2 * M_PI * fc * x) / (M_PI * x);
+      prototype[i] *= w;
+      sum += prototype[i];
+    }
+
+  bank->coefs = g_malloc (sizeof (gfloat) * len);
+  for (guint p = 0; p < phases; p++)
+    {
+      for (guint k = 0; k < bank->taps; k++)
+	{
+	  bank->coefs[p * bank->taps + bank->taps - 1 - k] =
+	    prototype[p + k * phases] * phases / sum;
+	}
+    }
+
+  g_free (prototype);
+
+  emu_debug (2, "Polyphase filter bank created (%d phases, %d taps)",
+	     phases, bank->taps);
+
+  return bank;
+}
+
+static void
+emu3_polyphase_bank_free (gpointer data)
+{
+  struct emu3_polyphase_bank *bank = data;
+
+  g_free (bank->coefs);
+  g_free (bank);
+}
+
+//The filter banks are kept in the context, which might be used by several
+//threads decoding samples, and freed with it.
+static const struct emu3_polyphase_bank *
+emu3_polyphase_get_bank (guint phases, guint step)
+{
+  struct emu3_polyphase_bank *bank = NULL;
+  struct emu_context *ctx = emu_get_context ();
+  GPtrArray *banks;
+
+  g_mutex_lock (&ctx->mutex);
+
+  if (!ctx->polyphase_banks)
+    {
+      ctx->polyphase_banks =
+	g_ptr_array_new_with_free_func (emu3_polyphase_bank_free);
+    }
+  banks = ctx->polyphase_banks;
+
+  for (guint i = 0; i < banks->len; i++)
+    {
+      struct emu3_polyphase_bank *b = g_ptr_array_index (banks, i);
+      if (b->phases == phases && b->step == step)
+	{
+	  bank = b;
+	  break;
+	}
+    }
+
+  if (!bank)
+    {
+      bank = emu3_polyphase_bank_new (phases, step);
+      g_ptr_array_add (banks, bank);
+    }
+
+  g_mutex_unlock (&ctx->mutex);
+
+  return bank;
+}
+
+static struct emu3_polyphase *
+emu3_polyphase_new (gint channels, gint input_rate, gint output_rate)
+{
+  struct emu3_polyphase *polyphase;
+  guint gcd = emu3_gcd (input_rate, output_rate);
+  guint phases = output_rate / gcd;
+  guint step = input_rate / gcd;
+
+  if (phases > POLYPHASE_MAX_PHASES)
+    {
+      return NULL;
+    }
+
+  polyphase = g_malloc (sizeof (struct emu3_polyphase));
+  polyphase->bank = emu3_polyphase_get_bank (phases, step);
+  polyphase->channels = channels;
+  polyphase->buffers = g_malloc (sizeof (gfloat *) * channels);
+  //The history starts with silence so the first outputs are centered.
+  for (gint i = 0; i < channels; i++)
+    {
+      polyphase->buffers[i] = g_malloc0 (sizeof (gfloat) *
+					 polyphase->bank->taps);
+    }
+  polyphase->capacity = polyphase->bank->taps;
+  polyphase->len = polyphase->bank->taps;
+  polyphase->start = -(gint64) polyphase->bank->taps;
+  polyphase->next_output = 0;
+  polyphase->input_frames = 0;
+  polyphase->padded = FALSE;
+
+  return polyphase;
+}
+
+static void
+emu3_polyphase_free (struct emu3_polyphase *polyphase)
+{
+  for (gint i = 0; i < polyphase->channels; i++)
+    {
+      g_free (polyphase->buffers[i]);
+    }
+  g_free (polyphase->buffers);
+  g_free (polyphase);
+}
+
+static void
+emu3_polyphase_append (struct emu3_polyphase *polyphase,
+		       const gfloat *input, glong frames)
+{
+  glong len = polyphase->len + frames;
+
+  if (len > polyphase->capacity)
+    {
+      polyphase->capacity = MAX (len, polyphase->capacity * 2);
+      for (gint i = 0; i < polyphase->channels; i++)
+	{
+	  polyphase->buffers[i] = g_realloc (polyphase->buffers[i],
+					     sizeof (gfloat) *
+					     polyphase->capacity);
+	}
+    }
+
+  for (gint i = 0; i < polyphase->channels; i++)
+    {
+      gfloat *dst = &polyphase->buffers[i][polyphase->len];
+      if (input)
+	{
+	  for (glong j = 0; j < frames; j++)
+	    {
+	      dst[j] = input[j * polyphase->channels + i];
+	    }
+	}
+      else
+	{
+	  memset (dst, 0, sizeof (gfloat) * frames);
+	}
+    }
+
+  polyphase->len = len;
+}
+
+static inline gfloat
+emu3_dot_product (const gfloat *a, const gfloat *b, guint len)
+{
+  guint i = 0;
+  gfloat sum = 0;
+
+#if defined(__SSE2__)
+  __m128 acc0 = _mm_setzero_ps ();
+  __m128 acc1 = _mm_setzero_ps ();
+  gfloat partial[4];
+
+  for (; i + 8 <= len; i += 8)
+    {
+      acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (&a[i]),
+					   _mm_loadu_ps (&b[i])));
+      acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (&a[i + 4]),
+					   _mm_loadu_ps (&b[i + 4])));
+    }
+  _mm_storeu_ps (partial, _mm_add_ps (acc0, acc1));
+  sum = partial[0] + partial[1] + partial[2] + partial[3];
+#endif
+
+  for (; i < len; i++)
+    {
+      sum += a[i] * b[i];
+    }
+
+  return sum;
+}
+
+static void
+emu3_polyphase_process (struct emu3_polyphase *polyphase,
+			const gfloat *input, glong input_frames,
+			gboolean end_of_input, gfloat *output,
+			glong output_frames, glong *generated)
+{
+  gint64 pos, first, last;
+  guint phase;
+  glong offset, discard;
+  const struct emu3_polyphase_bank *bank = polyphase->bank;
+  gint64 center = bank->taps * bank->phases / 2;
+
+  emu3_polyphase_append (polyphase, input, input_frames);
+  polyphase->input_frames += input_frames;
+
+  //The filter needs some silence after the last input frame.
+  if (end_of_input && !polyphase->padded)
+    {
+      emu3_polyphase_append (polyphase, NULL, bank->taps);
+      polyphase->padded = TRUE;
+    }
+
+  *generated = 0;
+  while (*generated < output_frames)
+    {
+      pos = polyphase->next_output * bank->step + center;
+      last = pos / bank->phases;
+      phase = pos % bank->phases;
+      first = last - bank->taps + 1;
+
+      if (last >= polyphase->start + polyphase->len)
+	{
+	  break;
+	}
+
+      //The output ends with the input and not with the padding.
+      if (polyphase->padded &&
+	  polyphase->next_output * bank->step >=
+	  polyphase->input_frames * bank->phases)
+	{
+	  break;
+	}
+
+      offset = first - polyphase->start;
+      for (gint i = 0; i < polyphase->channels; i++)
+	{
+	  output[*generated * polyphase->channels + i] =
+	    emu3_dot_product (&bank->coefs[phase * bank->taps],
+			      &polyphase->buffers[i][offset], bank->taps);
+	}
+
+      polyphase->next_output++;
+      (*generated)++;
+    }
+
+  //Only the history needed by the next output is kept.
+  pos = polyphase->next_output * bank->step + center;
+  first = pos / bank->phases - bank->taps + 1;
+  discard = MIN (first - polyphase->start, polyphase->len);
+  if (discard > 0)
+    {
+      for (gint i = 0; i < polyphase->channels; i++)
+	{
+	  memmove (polyphase->buffers[i], &polyphase->buffers[i][discard],
+		   sizeof (gfloat) * (polyphase->len - discard));
+	}
+      polyphase->len -= discard;
+      polyphase->start += discard;
+    }
+}
+
+struct emu3_resampler *
+emu3_resampler_new (emu3_resample_quality_t quality, gint channels,
+		    gint input_rate, gint output_rate)
+{
+  gint err;
+  struct emu3_resampler *resampler;
+
+  resampler = g_malloc0 (sizeof (struct emu3_resampler));
+  resampler->ratio = output_rate / (gdouble) input_rate;
+
+  if (quality == EMU3_RESAMPLE_QUALITY_POLYPHASE)
+    {
+      resampler->polyphase = emu3_polyphase_new (channels, input_rate,
+						 output_rate);
+      if (resampler->polyphase)
+	{
+	  return resampler;
+	}
+
+      emu_debug (1, "Ratio %d/%d not supported by the polyphase resampler",
+		 output_rate, input_rate);
+    }
+
+  emu_debug (1, "Using %s resampler",
+	     src_get_name (RESAMPLE_QUALITY_CONVERTERS[quality]));
+
+  resampler->state = src_new (RESAMPLE_QUALITY_CONVERTERS[quality], channels,
+			      &err);
+  if (!resampler->state)
+    {
+      emu_error ("Error while resampling: %s", src_strerror (err));
+      g_free (resampler);
+      return NULL;
+    }
+
+  return resampler;
+}
+
+// All the input is always consumed when using the polyphase resampler.
+gint
+emu3_resampler_process (struct emu3_resampler *resampler,
+			const gfloat *input, glong input_frames,
+			gboolean end_of_input, gfloat *output,
+			glong output_frames, glong *used, glong *generated)
+{
+  gint err;
+  SRC_DATA srcdata;
+
+  if (resampler->polyphase)
+    {
+      emu3_polyphase_process (resampler->polyphase, input, input_frames,
+			      end_of_input, output, output_frames,
+			      generated);
+      *used = input_frames;
+      return EXIT_SUCCESS;
+    }
+
+  srcdata.data_in = input;
+  srcdata.input_frames = input_frames;
+  srcdata.data_out = output;
+  srcdata.output_frames = output_frames;
+  srcdata.end_of_input = end_of_input;
+  srcdata.src_ratio = resampler->ratio;
+
+  err = src_process (resampler->state, &srcdata);
+  if (err)
+    {
+      emu_error ("Error while resampling: %s", src_strerror (err));
+      return EXIT_FAILURE;
+    }
+
+  *used = srcdata.input_frames_used;
+  *generated = srcdata.output_frames_gen;
+
+  return EXIT_SUCCESS;
+}
+
+void
+emu3_resampler_free (struct emu3_resampler *resampler)
+{
+  if (resampler->polyphase)
+    {
+      emu3_polyphase_free (resampler->polyphase);
+    }
+  if (resampler->state)
+    {
+      src_delete (resampler->state);
+    }
+  g_free (resampler);
+}
@@ -0,0 +1,42 @@
+/*
+ *   resampler.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "utils.h"
+
+struct emu3_resampler;
+
+gint emu3_resampler_get_quality (const gchar * name);
+
+struct emu3_resampler *emu3_resampler_new (emu3_resample_quality_t quality,
+					   gint channels, gint input_rate,
+					   gint output_rate);
+
+gint emu3_resampler_process (struct emu3_resampler *resampler,
+			     const gfloat * input, glong input_frames,
+			     gboolean end_of_input, gfloat * output,
+			     glong output_frames, glong * used,
+			     glong * generated);
+
+void emu3_resampler_free (struct emu3_resampler *resampler);
+
+#endif
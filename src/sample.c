@@ -18,22 +18,30 @@
  *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <glob.h>
 #include <libgen.h>
 #include <math.h>
 #include <samplerate.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "sample.h"
 
 #define MINIMUM_LOOP_LEN 10
+#define SAMPLE_QUEUE_JOBS_AHEAD 2
+
+#define EMU3_WRITE_BLOCK_FRAMES 4096
+#define EMU3_READ_BLOCK_FRAMES 4096
+#define EMU3_RESAMPLE_BLOCK_FRAMES 4096
 
 #define JUNK_CHUNK_ID "JUNK"
 #define SMPL_CHUNK_ID "smpl"
 
-gint max_sample_rate = MAX_SAMPLE_RATE;
-gint bit_depth = MAX_BIT_DEPTH;
-
 static const uint8_t JUNK_CHUNK_DATA[] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -41,11 +49,17 @@ static const uint8_t JUNK_CHUNK_DATA[] = {
   0, 0, 0, 0
 };
 
-struct emu3_sample_descriptor
+struct emu3_extraction
 {
-  gint16 *l_channel;
-  gint16 *r_channel;
   struct emu3_sample *sample;
+  gint channels;
+  guint32 frames;
+  guint32 loop_start;
+  guint32 loop_end;
+  guint8 original_key;
+  gfloat tuning;
+  gchar *wav_file;
+  gint err;
 };
 
 static gchar *
@@ -77,10 +91,12 @@ emu3_emu3name_to_name (const gchar *objname)
 }
 
 static gchar *
-emu3_emu3name_to_wav_name (const gchar *emu3name, gint num, gint ext_mode)
+emu3_emu3name_to_wav_name (const gchar *emu3name, gint num, gint ext_mode,
+			   const gchar *dir)
 {
+  gchar *path;
   gchar *fname = emu3_emu3name_to_name (emu3name);
-  gchar *wname = malloc (strlen (fname) + 9);
+  gchar *wname = g_malloc (strlen (fname) + 9);
 
   if (ext_mode == EMU3_EXT_MODE_NAME_NUMBER)
     sprintf (wname, "%03d-%s%s", num, fname, SAMPLE_EXT);
@@ -89,6 +105,13 @@ emu3_emu3name_to_wav_name (const gchar *emu3name, gint num, gint ext_mode)
 
   free (fname);
 
+  if (dir)
+    {
+      path = g_build_filename (dir, wname, NULL);
+      g_free (wname);
+      wname = path;
+    }
+
   return wname;
 }
 
@@ -131,7 +154,7 @@ emu3_playback_rate_from_bin (guint16 playback_rate, gint sample_rate)
 }
 
 static void
-emu3_print_sample_info (struct emu3_sample *sample, gint num,
+emu3_print_sample_info (struct emu3_sample *sample, gint num, gint level,
 			guint32 *frames, guint32 *loop_start,
 			guint32 *loop_end)
 {
@@ -168,70 +191,105 @@ emu3_print_sample_info (struct emu3_sample *sample, gint num,
     (sample_loop_end - sizeof (struct emu3_sample)) / sizeof (gint16);
 
   emu_print (0, 0, "Sample %03d: %.*s\n", num, EMU3_NAME_SIZE, sample->name);
-  emu_print (1, 1, "Frames: %d\n", *frames);
-  emu_print (1, 1, "Loop start: %d\n", *loop_start);
-  emu_print (1, 1, "Loop end: %d\n", *loop_end);
-  emu_print (1, 1, "Channels: %d\n", emu3_get_sample_channels (sample));
-  emu_print (2, 1, "Start L: %d\n", sample->start_l);
-  emu_print (2, 1, "Start R: %d\n", sample->start_r);
-  emu_print (2, 1, "End   L: %d\n", sample->end_l);
-  emu_print (2, 1, "End   R: %d\n", sample->end_r);
-  emu_print (2, 1, "Loop start L: %d\n", sample->loop_start_l);
-  emu_print (2, 1, "Loop start R: %d\n", sample->loop_start_r);
-  emu_print (2, 1, "Loop end   L: %d\n", sample->loop_end_l);
-  emu_print (2, 1, "Loop end   R: %d\n", sample->loop_end_r);
-  emu_print (1, 1, "Sample   rate: %d Hz\n", sample->sample_rate);
-  emu_print (1, 1, "Playback rate: %d Hz\n",
+  emu_print (level, 1, "Frames: %d\n", *frames);
+  emu_print (level, 1, "Loop start: %d\n", *loop_start);
+  emu_print (level, 1, "Loop end: %d\n", *loop_end);
+  emu_print (level, 1, "Channels: %d\n", emu3_get_sample_channels (sample));
+  emu_print (level + 1, 1, "Start L: %d\n", sample->start_l);
+  emu_print (level + 1, 1, "Start R: %d\n", sample->start_r);
+  emu_print (level + 1, 1, "End   L: %d\n", sample->end_l);
+  emu_print (level + 1, 1, "End   R: %d\n", sample->end_r);
+  emu_print (level + 1, 1, "Loop start L: %d\n", sample->loop_start_l);
+  emu_print (level + 1, 1, "Loop start R: %d\n", sample->loop_start_r);
+  emu_print (level + 1, 1, "Loop end   L: %d\n", sample->loop_end_l);
+  emu_print (level + 1, 1, "Loop end   R: %d\n", sample->loop_end_r);
+  emu_print (level, 1, "Sample   rate: %d Hz\n", sample->sample_rate);
+  emu_print (level, 1, "Playback rate: %d Hz\n",
 	     emu3_playback_rate_from_bin (sample->playback_rate,
 					  sample->sample_rate));
-  emu_print (1, 1, "Options: 0x%04x\n", sample->options);
-  emu_print (1, 2, "Loop enabled: %s\n",
+  emu_print (level, 1, "Options: 0x%04x\n", sample->options);
+  emu_print (level, 2, "Loop enabled: %s\n",
 	     sample->options & EMU3_SAMPLE_OPT_LOOP ? "on" : "off");
-  emu_print (1, 2, "Loop in release: %s\n",
+  emu_print (level, 2, "Loop in release: %s\n",
 	     sample->options & EMU3_SAMPLE_OPT_LOOP_RELEASE ? "on" : "off");
-  emu_print (2, 1, "Header: 0x%08x\n", sample->header);
-  emu_print (2, 1, "Sample data offset L: %d\n",
+  emu_print (level + 1, 1, "Header: 0x%08x\n", sample->header);
+  emu_print (level + 1, 1, "Sample data offset L: %d\n",
 	     sample->sample_data_offset_l);
-  emu_print (2, 1, "Sample data offset R: %d\n",
+  emu_print (level + 1, 1, "Sample data offset R: %d\n",
 	     sample->sample_data_offset_r);
 
-  emu_print (2, 1, "Sample parameters:\n");
+  emu_print (level + 1, 1, "Sample parameters:\n");
   for (gint i = 0; i < SAMPLE_PARAMETERS; i++)
-    emu_print (2, 2, "0x%08x (%d)\n", sample->parameters[i],
+    emu_print (level + 1, 2, "0x%08x (%d)\n", sample->parameters[i],
 	       sample->parameters[i]);
 }
 
+//Prints the sample metadata from the given verbosity level.
 void
-emu3_process_sample (struct emu3_sample *sample, gint num,
-		     emu3_ext_mode_t ext_mode, guint8 original_key,
-		     gfloat tuning)
+emu3_print_sample (struct emu3_sample *sample, gint num, gint level)
+{
+  guint32 frames, loop_start, loop_end;
+
+  emu3_print_sample_info (sample, num, level, &frames, &loop_start,
+			  &loop_end);
+}
+
+// Converts the planar channels of a bank sample into interleaved frames.
+static void
+emu3_interleave (gint16 *dst, const gint16 *l_channel,
+		 const gint16 *r_channel, guint32 frames)
 {
+  guint32 i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 8 <= frames; i += 8)
+    {
+      __m128i l = _mm_loadu_si128 ((const __m128i *) &l_channel[i]);
+      __m128i r = _mm_loadu_si128 ((const __m128i *) &r_channel[i]);
+      _mm_storeu_si128 ((__m128i *) & dst[i * 2], _mm_unpacklo_epi16 (l, r));
+      _mm_storeu_si128 ((__m128i *) & dst[i * 2 + 8],
+			_mm_unpackhi_epi16 (l, r));
+    }
+#endif
+
+  for (; i < frames; i++)
+    {
+      dst[i * 2] = l_channel[i];
+      dst[i * 2 + 1] = r_channel[i];
+    }
+}
+
+static gint
+emu3_extract_sample (struct emu3_extraction *extraction)
+{
+  gint err = EXIT_SUCCESS;
   SF_INFO sfinfo;
   SNDFILE *output;
-  gchar *wav_file;
   gint16 *l_channel, *r_channel;
-  gint16 frame[2];
-  uint32_t frames, loop_start, loop_end;
-  gint channels = emu3_get_sample_channels (sample);
+  gint16 buffer[EMU3_WRITE_BLOCK_FRAMES * 2];
+  struct emu3_sample *sample = extraction->sample;
+  gint channels = extraction->channels;
+  guint32 frames = extraction->frames;
+  guint8 original_key = extraction->original_key;
+  gfloat tuning = extraction->tuning;
   struct SF_CHUNK_INFO smpl_chunk_info;
   struct SF_CHUNK_INFO junk_chunk_info;
   struct smpl_chunk_data smpl_chunk_data;
 
-  emu3_print_sample_info (sample, num, &frames, &loop_start, &loop_end);
-
-  if (!ext_mode)
-    return;
-
-  wav_file = emu3_emu3name_to_wav_name (sample->name, num, ext_mode);
-
-  emu_debug (1, "Extracting sample '%s'...", wav_file);
+  emu_debug (1, "Extracting sample '%s'...", extraction->wav_file);
 
   sfinfo.frames = frames;
   sfinfo.samplerate = sample->sample_rate;
   sfinfo.channels = channels;
   sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
 
-  output = sf_open (wav_file, SFM_WRITE, &sfinfo);
+  output = sf_open (extraction->wav_file, SFM_WRITE, &sfinfo);
+  if (!output)
+    {
+      emu_error ("Error while opening '%s': %s", extraction->wav_file,
+		 sf_strerror (NULL));
+      return EXIT_FAILURE;
+    }
 
   //The reason for writing this chunk is to make WAV files similar to the ones exported by Elektron Transfer.
   strcpy (junk_chunk_info.id, JUNK_CHUNK_ID);
@@ -268,8 +326,8 @@ emu3_process_sample (struct emu3_sample *sample, gint num,
 
   smpl_chunk_data.sample_loop.cue_point_id = 0;
   smpl_chunk_data.sample_loop.type = htole32 (sample->options & EMU3_SAMPLE_OPT_LOOP ? 0 : 0x7f);	// as in midi sds, 0x00 = forward loop, 0x7F = no loop
-  smpl_chunk_data.sample_loop.start = htole32 (loop_start);
-  smpl_chunk_data.sample_loop.end = htole32 (loop_end);
+  smpl_chunk_data.sample_loop.start = htole32 (extraction->loop_start);
+  smpl_chunk_data.sample_loop.end = htole32 (extraction->loop_end);
   smpl_chunk_data.sample_loop.fraction = 0;
   smpl_chunk_data.sample_loop.play_count = 0;
 
@@ -282,29 +340,170 @@ emu3_process_sample (struct emu3_sample *sample, gint num,
       emu_error ("%s", sf_strerror (output));
     }
 
-  l_channel = sample->frames;
-  if (channels == 2)
-    r_channel = sample->frames + frames;
-  else
-    r_channel = l_channel;
-  for (gint i = 0; i < frames; i++)
+  if (channels == 1)
     {
-      frame[0] = *l_channel;
-      l_channel++;
-      if (channels == 2)
+      if (sf_writef_short (output, sample->frames, frames) != frames)
 	{
-	  frame[1] = *r_channel;
-	  r_channel++;
+	  emu_error ("%s", sf_strerror (output));
+	  err = EXIT_FAILURE;
 	}
-      if (!sf_writef_short (output, frame, 1))
+    }
+  else
+    {
+      l_channel = sample->frames;
+      r_channel = sample->frames + frames;
+      for (guint32 i = 0; i < frames; i += EMU3_WRITE_BLOCK_FRAMES)
 	{
-	  emu_error ("%s", sf_strerror (output));
-	  break;
+	  guint32 block = MIN (frames - i, EMU3_WRITE_BLOCK_FRAMES);
+	  emu3_interleave (buffer, &l_channel[i], &r_channel[i], block);
+	  if (sf_writef_short (output, buffer, block) != block)
+	    {
+	      emu_error ("%s", sf_strerror (output));
+	      err = EXIT_FAILURE;
+	      break;
+	    }
 	}
     }
 
-  free (wav_file);
   sf_close (output);
+
+  return err;
+}
+
+static void
+emu3_free_extraction (gpointer data)
+{
+  struct emu3_extraction *extraction = data;
+  g_free (extraction->wav_file);
+  g_free (extraction);
+}
+
+static void
+emu3_run_extraction (gpointer data, gpointer user_data)
+{
+  struct emu3_extraction *extraction = data;
+
+  emu_set_context (user_data);
+  extraction->err = emu3_extract_sample (extraction);
+}
+
+gint
+emu3_process_sample (struct emu3_sample *sample, gint num,
+		     emu3_ext_mode_t ext_mode, guint8 original_key,
+		     gfloat tuning)
+{
+  gint err;
+  struct emu3_extraction *extraction;
+  struct emu_context *ctx = emu_get_context ();
+
+  extraction = g_malloc (sizeof (struct emu3_extraction));
+  emu3_print_sample_info (sample, num, 1, &extraction->frames,
+			  &extraction->loop_start, &extraction->loop_end);
+
+  if (!ext_mode)
+    {
+      g_free (extraction);
+      return EXIT_SUCCESS;
+    }
+
+  extraction->sample = sample;
+  extraction->channels = emu3_get_sample_channels (sample);
+  extraction->original_key = original_key;
+  extraction->tuning = tuning;
+  extraction->wav_file = emu3_emu3name_to_wav_name (sample->name, num,
+						     ext_mode,
+						     ctx->extraction_dir);
+  extraction->err = EXIT_SUCCESS;
+
+  if (ctx->sample_jobs > 1)
+    {
+      if (!ctx->pending_extractions)
+	{
+	  ctx->pending_extractions =
+	    g_ptr_array_new_with_free_func (emu3_free_extraction);
+	}
+      g_ptr_array_add (ctx->pending_extractions, extraction);
+      return EXIT_SUCCESS;
+    }
+
+  err = emu3_extract_sample (extraction);
+  emu3_free_extraction (extraction);
+
+  return err;
+}
+
+// Runs the queued extractions in a thread pool and waits for all of them.
+// As the samples could share the same name, only the last extraction of every
+// WAV file is run, which produces the same files than a serial extraction.
+gint
+emu3_finish_sample_extraction (void)
+{
+  gint err = EXIT_SUCCESS;
+  GError *error = NULL;
+  GThreadPool *pool;
+  GHashTable *last_extractions;
+  struct emu3_extraction *extraction;
+  struct emu_context *ctx = emu_get_context ();
+  GPtrArray *pending_extractions = ctx->pending_extractions;
+
+  if (!pending_extractions)
+    {
+      return EXIT_SUCCESS;
+    }
+
+  last_extractions = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < pending_extractions->len; i++)
+    {
+      extraction = g_ptr_array_index (pending_extractions, i);
+      g_hash_table_insert (last_extractions, extraction->wav_file,
+			   extraction);
+    }
+
+  pool = g_thread_pool_new (emu3_run_extraction, ctx, ctx->sample_jobs, TRUE,
+			    &error);
+  for (guint i = 0; i < pending_extractions->len; i++)
+    {
+      extraction = g_ptr_array_index (pending_extractions, i);
+      if (g_hash_table_lookup (last_extractions, extraction->wav_file) !=
+	  extraction)
+	{
+	  continue;
+	}
+
+      if (pool)
+	{
+	  g_thread_pool_push (pool, extraction, NULL);
+	}
+      else
+	{
+	  extraction->err = emu3_extract_sample (extraction);
+	}
+    }
+
+  if (pool)
+    {
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+  else
+    {
+      emu_error ("Error while creating thread pool: %s", error->message);
+      g_error_free (error);
+    }
+
+  for (guint i = 0; i < pending_extractions->len; i++)
+    {
+      extraction = g_ptr_array_index (pending_extractions, i);
+      if (extraction->err)
+	{
+	  err = EXIT_FAILURE;
+	}
+    }
+
+  g_hash_table_destroy (last_extractions);
+  g_ptr_array_free (pending_extractions, TRUE);
+  ctx->pending_extractions = NULL;
+
+  return err;
 }
 
 gint
@@ -339,33 +538,115 @@ emu3_sample_get_smpl_chunk (SNDFILE *input,
   return loop;
 }
 
+// Splits interleaved stereo frames into the planar channels used in banks.
 static void
-emu3_sample_init_descriptor (struct emu3_sample_descriptor *sd,
-			     struct emu3_sample *sample, gint frames)
+emu3_deinterleave (gint16 *l_channel, gint16 *r_channel, const gint16 *src,
+		   guint32 frames)
 {
-  sd->sample = sample;
-  sd->l_channel = sample->frames;
-  if ((sample->options & EMU3_SAMPLE_OPT_STEREO) == EMU3_SAMPLE_OPT_STEREO)
+  guint32 i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 16 <= frames; i += 16)
     {
-      sd->r_channel = sample->frames + frames;
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) &src[i * 2]);
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) &src[i * 2 + 16]);
+      __m256i l = _mm256_packs_epi32 (_mm256_srai_epi32
+				      (_mm256_slli_epi32 (a, 16), 16),
+				      _mm256_srai_epi32 (_mm256_slli_epi32
+							 (b, 16), 16));
+      __m256i r = _mm256_packs_epi32 (_mm256_srai_epi32 (a, 16),
+				      _mm256_srai_epi32 (b, 16));
+      //Packing works on 128 bits lanes so the 64 bits blocks are reordered.
+      _mm256_storeu_si256 ((__m256i *) & l_channel[i],
+			   _mm256_permute4x64_epi64 (l, 0xd8));
+      _mm256_storeu_si256 ((__m256i *) & r_channel[i],
+			   _mm256_permute4x64_epi64 (r, 0xd8));
     }
-  else
+#endif
+
+#if defined(__SSE2__)
+  for (; i + 8 <= frames; i += 8)
     {
-      // The initialization is required to avoid a warning.
-      sd->r_channel = sample->frames;
+      __m128i a = _mm_loadu_si128 ((const __m128i *) &src[i * 2]);
+      __m128i b = _mm_loadu_si128 ((const __m128i *) &src[i * 2 + 8]);
+      //Sign extension makes the saturation in the packing a no-op.
+      __m128i l = _mm_packs_epi32 (_mm_srai_epi32 (_mm_slli_epi32 (a, 16),
+						   16),
+				   _mm_srai_epi32 (_mm_slli_epi32 (b, 16),
+						   16));
+      __m128i r = _mm_packs_epi32 (_mm_srai_epi32 (a, 16),
+				   _mm_srai_epi32 (b, 16));
+      _mm_storeu_si128 ((__m128i *) & l_channel[i], l);
+      _mm_storeu_si128 ((__m128i *) & r_channel[i], r);
+    }
+#endif
+
+  for (; i < frames; i++)
+    {
+      l_channel[i] = src[i * 2];
+      r_channel[i] = src[i * 2 + 1];
     }
 }
 
+// First 2 and last 2 frames must be set to 0.
+// Without this, the sampler will complain with a "Mono Start Zero!!!001" error message.
+// As indicated in the manual, running the sample integrity in the digital tools menu would fix the error and it'll fix it by doing this.
+// In previous versions of emu3bm, the pairs of 0 samples were appended automatically but this broke SDS compatibility frame count.
 static void
-emu3_write_frame (struct emu3_sample_descriptor *sd, gint16 frame[])
+emu3_sample_clear_edges (struct emu3_sample *sample, gint channels,
+			 guint32 frames)
 {
-  struct emu3_sample *sample = sd->sample;
-  *sd->l_channel = frame[0];
-  sd->l_channel++;
-  if ((sample->options & EMU3_SAMPLE_OPT_STEREO) == EMU3_SAMPLE_OPT_STEREO)
+  guint32 start = MIN (2, frames);
+  guint32 end = frames > 4 ? frames - 2 : start;
+
+  for (gint i = 0; i < channels; i++)
     {
-      *sd->r_channel = frame[1];
-      sd->r_channel++;
+      gint16 *channel = &sample->frames[i * frames];
+      memset (channel, 0, sizeof (gint16) * start);
+      memset (&channel[end], 0, sizeof (gint16) * (frames - end));
+    }
+}
+
+// Reads the input in blocks and stores it directly in the bank channels.
+static void
+emu3_append_sample_read (SNDFILE *sndfile, gint channels, gint16 *l_channel,
+			 gint16 *r_channel, guint32 frames)
+{
+  sf_count_t read;
+  gint16 buffer[EMU3_READ_BLOCK_FRAMES * 2];
+  guint32 i = 0;
+
+  while (i < frames)
+    {
+      guint32 block = MIN (frames - i, EMU3_READ_BLOCK_FRAMES);
+
+      if (channels == 1)
+	{
+	  read = sf_readf_short (sndfile, &l_channel[i], block);
+	}
+      else
+	{
+	  read = sf_readf_short (sndfile, buffer, block);
+	  emu3_deinterleave (&l_channel[i], &r_channel[i], buffer, read);
+	}
+
+      i += read;
+
+      if (read < block)
+	{
+	  break;
+	}
+    }
+
+  //The frames declared by the file but not read are left silent.
+  if (i < frames)
+    {
+      emu_error ("Unexpected end of sample. Only %d frames read", i);
+      for (gint j = 0; j < channels; j++)
+	{
+	  memset (&l_channel[j * frames + i], 0, sizeof (gint16) *
+		  (frames - i));
+	}
     }
 }
 
@@ -461,125 +742,157 @@ emu3_sample_init (struct emu3_sample *sample, gint offset, gint samplerate,
   return size;
 }
 
-static gint16 *
-emu3_append_sample_get_data (SNDFILE *sndfile, SF_INFO *sfinfo,
-			     gint *samplerate, guint32 *frames,
-			     guint32 *loop_start, guint32 *loop_end,
-			     gint *loop)
+static guint16
+emu3_get_bit_depth_mask (gint bit_depth)
 {
-  gdouble ratio;
-  gint direct_read;
-  gint16 *output;
-  gint smpl_chunk;
-  gint total_gen_frames;
-  struct smpl_chunk_data smpl_chunk_data;
+  guint16 mask = 0x8000;
 
-  if (sfinfo->samplerate <= max_sample_rate)
-    {
-      direct_read = 1;
-      *samplerate = sfinfo->samplerate;
-      ratio = 1;
-    }
-  else
+  for (gint i = 1; i < bit_depth; i++)
     {
-      direct_read = 0;		//Requires resampling
-      *samplerate = max_sample_rate;
-      ratio = max_sample_rate / (gdouble) sfinfo->samplerate;
+      mask = 0x8000 | (mask >> 1);
     }
 
-  //Set scale factor. See http://www.mega-nerd.com/libsndfile/api.html#note2
-  if ((sfinfo->format & SF_FORMAT_FLOAT) == SF_FORMAT_FLOAT ||
-      (sfinfo->format & SF_FORMAT_DOUBLE) == SF_FORMAT_DOUBLE)
+  return mask;
+}
+
+// Resamples the input in blocks and stores the result directly in the bank
+// channels so the memory used does not depend on the sample length.
+static gint
+emu3_append_sample_resample (SNDFILE *sndfile, SF_INFO *sfinfo,
+			     gint samplerate, gint16 *l_channel,
+			     gint16 *r_channel, guint32 max_frames,
+			     guint32 *frames)
+{
+  gint err;
+  guint16 mask;
+  gboolean end_of_input;
+  struct emu3_resampler *resampler;
+  sf_count_t read, requested;
+  glong pending, used, generated, total_used;
+  gint channels = sfinfo->channels;
+  gfloat *input, *output;
+  gint16 *quantized;
+  struct emu_context *ctx = emu_get_context ();
+  gint bit_depth = ctx->bit_depth;
+
+  resampler = emu3_resampler_new (ctx->resample_quality, channels,
+				  sfinfo->samplerate, samplerate);
+  if (!resampler)
     {
-      emu_debug (2,
-		 "Setting scale factor to ensure correct integer readings...");
-      sf_command (sndfile, SFC_SET_SCALE_FLOAT_INT_READ, NULL, SF_TRUE);
+      return EXIT_FAILURE;
     }
 
-  if (direct_read)
+  emu_debug (1, "Resampling...");
+
+  mask = emu3_get_bit_depth_mask (bit_depth);
+  if (bit_depth < MAX_BIT_DEPTH)
     {
-      output = malloc (sizeof (gint16) * sfinfo->channels * sfinfo->frames);
-      sf_readf_short (sndfile, output, sfinfo->frames);
-      *frames = sfinfo->frames;
+      emu_debug (1, "Using bit mask '0x%4x'", mask);
     }
-  else
-    {
-      SRC_DATA srcdata;
 
-      emu_debug (1, "Resampling...");
+  input = g_malloc (sizeof (gfloat) * channels * EMU3_RESAMPLE_BLOCK_FRAMES);
+  output = g_malloc (sizeof (gfloat) * channels *
+		     EMU3_RESAMPLE_BLOCK_FRAMES);
+  quantized = g_malloc (sizeof (gint16) * channels *
+			EMU3_RESAMPLE_BLOCK_FRAMES);
 
-      srcdata.src_ratio = ratio;
-      srcdata.input_frames = sfinfo->frames;
-      srcdata.output_frames = ceil (ratio * sfinfo->frames);
-      srcdata.data_in =
-	malloc (sizeof (gfloat) * sfinfo->channels * sfinfo->frames);
-      srcdata.data_out =
-	malloc (sizeof (gfloat) * sfinfo->channels * srcdata.output_frames);
+  end_of_input = FALSE;
+  pending = 0;
+  total_used = 0;
+  *frames = 0;
+  err = EXIT_SUCCESS;
 
-      sf_readf_float (sndfile, (gfloat *) srcdata.data_in, sfinfo->frames);
+  while (*frames < max_frames)
+    {
+      if (!end_of_input && pending < EMU3_RESAMPLE_BLOCK_FRAMES)
+	{
+	  requested = EMU3_RESAMPLE_BLOCK_FRAMES - pending;
+	  read = sf_readf_float (sndfile, &input[pending * channels],
+				 requested);
+	  pending += read;
+	  end_of_input = read < requested;
+	}
 
-      gint err = src_simple (&srcdata, SRC_SINC_BEST_QUALITY,
-			     sfinfo->channels);
+      err = emu3_resampler_process (resampler, input, pending, end_of_input,
+				    output, MIN (EMU3_RESAMPLE_BLOCK_FRAMES,
+						 max_frames - *frames),
+				    &used, &generated);
       if (err)
 	{
-	  emu_error ("Error while resampling: %s", src_strerror (err));
-	  free ((gfloat *) srcdata.data_in);
-	  free (srcdata.data_out);
-	  return NULL;
+	  break;
 	}
 
-      emu_debug (1,
-		 "Resampling done. Used frames: %ld; generated frames: %ld",
-		 srcdata.input_frames_used, srcdata.output_frames_gen);
+      //Nothing else will be generated once the input is exhausted.
+      if (!generated && !used && end_of_input)
+	{
+	  break;
+	}
+
+      pending -= used;
+      total_used += used;
+      memmove (input, &input[used * channels],
+	       sizeof (gfloat) * channels * pending);
 
-      total_gen_frames = sfinfo->channels * srcdata.output_frames_gen;
-      output = malloc (sizeof (gint16) * total_gen_frames);
-      src_float_to_short_array (srcdata.data_out, output, total_gen_frames);
+      src_float_to_short_array (output, quantized, channels * generated);
 
       if (bit_depth < MAX_BIT_DEPTH)
 	{
-	  guint16 *v = (guint16 *) output;
-	  guint16 mask = 0x8000;
-	  for (gint i = 1; i < bit_depth; i++)
-	    {
-	      mask = 0x8000 | (mask >> 1);
-	    }
-
-	  emu_debug (1, "Using bit mask '0x%4x'", mask);
-
-	  for (gint i = 0; i < total_gen_frames; i++, v++)
+	  guint16 *v = (guint16 *) quantized;
+	  for (gint i = 0; i < channels * generated; i++, v++)
 	    {
 	      *v = (*v & mask);
 	    }
 	}
 
-      free ((gfloat *) srcdata.data_in);
-      free (srcdata.data_out);
-
-      *frames = srcdata.output_frames_gen;
+      if (channels == 1)
+	{
+	  memcpy (&l_channel[*frames], quantized, sizeof (gint16) * generated);
+	}
+      else
+	{
+	  emu3_deinterleave (&l_channel[*frames], &r_channel[*frames],
+			     quantized, generated);
+	}
 
-      // Sometimes libsamplerate returns less frames less than expected.
-      // This fixes the ratio, which is used to calculate the loop points.
-      ratio = srcdata.output_frames_gen / (gdouble) sfinfo->frames;
+      *frames += generated;
     }
 
+  emu_debug (1, "Resampling done. Used frames: %ld; generated frames: %d",
+	     total_used, *frames);
+
+  g_free (input);
+  g_free (output);
+  g_free (quantized);
+  emu3_resampler_free (resampler);
+
+  return err;
+}
+
+static void
+emu3_append_sample_get_loop (SNDFILE *sndfile, gdouble ratio, guint32 frames,
+			     guint32 *loop_start, guint32 *loop_end,
+			     gint *loop)
+{
+  gint smpl_chunk;
+  struct smpl_chunk_data smpl_chunk_data;
+
   smpl_chunk = emu3_sample_get_smpl_chunk (sndfile, &smpl_chunk_data);
   if (smpl_chunk)
     {
       *loop = smpl_chunk_data.sample_loop.type == htole32 (0x7f) ? 0 : 1;
 
       *loop_start = smpl_chunk_data.sample_loop.start * ratio;
-      if (*loop_start >= *frames)
+      if (*loop_start >= frames)
 	{
 	  emu_error ("Bad loop start. Using sample start...");
 	  *loop_start = 0;
 	}
 
       *loop_end = smpl_chunk_data.sample_loop.end * ratio;
-      if (*loop_end >= *frames)
+      if (*loop_end >= frames)
 	{
 	  emu_error ("Bad loop end. Using sample end...");
-	  *loop_end = *frames - 1;
+	  *loop_end = frames - 1;
 	}
 
       // As loops can't be less than MINIMUM_LOOP_LEN samples, it's better to ignore the loop.
@@ -597,7 +910,7 @@ emu3_append_sample_get_data (SNDFILE *sndfile, SF_INFO *sfinfo,
       // different compared to the aforementioned tools.
       *loop = 0;
       *loop_start = 0;
-      *loop_end = *frames - 1;
+      *loop_end = frames - 1;
     }
 
   //This fixes some "Mono End Loop!!!  0006" errors when editing the loop points in the sampler.
@@ -608,24 +921,23 @@ emu3_append_sample_get_data (SNDFILE *sndfile, SF_INFO *sfinfo,
 
   emu_debug (1, "Loop: %s; loop start at %d; loop end at %d",
 	     *loop ? "on" : "off", *loop_start, *loop_end);
-
-  return output;
 }
 
-//returns the sample size in bytes that the the sample takes in the bank
-gint
-emu3_append_sample (struct emu_file *file, struct emu3_sample *sample,
-		    const gchar *path, gint offset, gboolean *mono,
-		    guint32 *frames)
+struct emu3_sample_source
 {
-  SF_INFO sfinfo;
   SNDFILE *sndfile;
-  gint16 *f, *data = NULL;
-  gint16 zero[2] = { 0, 0 };
-  const gchar *filename;
-  gint loop, size, samplerate;
-  guint32 loop_start, loop_end;
-  struct emu3_sample_descriptor sd;
+  SF_INFO sfinfo;
+  gboolean resample;
+  gint samplerate;
+  guint32 max_frames;
+};
+
+// Returns the maximum amount of bytes the sample might need in the bank.
+static gint
+emu3_sample_source_open (struct emu3_sample_source *source, const gchar *path)
+{
+  SF_INFO *sfinfo = &source->sfinfo;
+  gint max_sample_rate = emu_get_context ()->max_sample_rate;
 
   if (access (path, R_OK) != 0)
     {
@@ -633,37 +945,118 @@ emu3_append_sample (struct emu_file *file, struct emu3_sample *sample,
       return -1;
     }
 
-  size = -1;
-  sfinfo.format = 0;
-  sndfile = sf_open (path, SFM_READ, &sfinfo);
+  sfinfo->format = 0;
+  source->sndfile = sf_open (path, SFM_READ, sfinfo);
+  if (!source->sndfile)
+    {
+      emu_error ("Error while opening sample '%s': %s", path,
+		 sf_strerror (NULL));
+      return -1;
+    }
 
-  if (sfinfo.channels > 2)
+  if (sfinfo->channels > 2)
     {
       emu_error ("Sample neither mono nor stereo");
-      goto close;
+      sf_close (source->sndfile);
+      return -1;
     }
 
-  data = emu3_append_sample_get_data (sndfile, &sfinfo, &samplerate, frames,
-				      &loop_start, &loop_end, &loop);
-  if (!data)
+  //Set scale factor. See http://www.mega-nerd.com/libsndfile/api.html#note2
+  if ((sfinfo->format & SF_FORMAT_FLOAT) == SF_FORMAT_FLOAT ||
+      (sfinfo->format & SF_FORMAT_DOUBLE) == SF_FORMAT_DOUBLE)
     {
-      goto close;
+      emu_debug (2,
+		 "Setting scale factor to ensure correct integer readings...");
+      sf_command (source->sndfile, SFC_SET_SCALE_FLOAT_INT_READ, NULL,
+		  SF_TRUE);
     }
 
-  *mono = sfinfo.channels == 1;
-  size = emu3_sample_init (sample, offset, samplerate, *mono, *frames,
-			   loop_start, loop_end, loop);
-  if (file->size + size > EMU3_MEM_SIZE)
+  if (sfinfo->samplerate <= max_sample_rate)
     {
-      emu_error ("Bank is full");
-      size = -1;
-      goto close;
+      source->resample = FALSE;
+      source->samplerate = sfinfo->samplerate;
+      source->max_frames = sfinfo->frames;
+    }
+  else
+    {
+      source->resample = TRUE;
+      source->samplerate = max_sample_rate;
+      source->max_frames = ceil (max_sample_rate /
+				 (gdouble) sfinfo->samplerate *
+				 sfinfo->frames);
     }
 
+  // The final amount of frames is only known after resampling so the space
+  // for the longest possible result is reserved.
+  return sizeof (struct emu3_sample) +
+    sizeof (gint16) * sfinfo->channels * source->max_frames;
+}
+
+static gint
+emu3_sample_source_load (struct emu3_sample_source *source,
+			 struct emu3_sample *sample, const gchar *path,
+			 gint offset, gboolean *mono, guint32 *frames)
+{
+  gint loop, size;
+  gdouble ratio;
+  const gchar *filename;
+  guint32 loop_start, loop_end;
+  SF_INFO *sfinfo = &source->sfinfo;
+  guint32 max_frames = source->max_frames;
+
+  *mono = sfinfo->channels == 1;
+
+  memset (sample, 0, sizeof (struct emu3_sample));
+
+  if (!source->resample)
+    {
+      ratio = 1;
+      *frames = sfinfo->frames;
+      emu3_append_sample_read (source->sndfile, sfinfo->channels,
+			       sample->frames, &sample->frames[*frames],
+			       *frames);
+    }
+  else
+    {
+      gint16 *r_channel = &sample->frames[max_frames];
+      if (emu3_append_sample_resample (source->sndfile, sfinfo,
+				       source->samplerate, sample->frames,
+				       r_channel, max_frames, frames))
+	{
+	  return -1;
+	}
+
+      //The right channel was stored after the longest possible left channel.
+      if (!*mono)
+	{
+	  memmove (&sample->frames[*frames], r_channel,
+		   sizeof (gint16) * *frames);
+	  memset (&sample->frames[*frames * 2], 0,
+		  sizeof (gint16) * (max_frames - *frames) * 2);
+	}
+      else
+	{
+	  memset (&sample->frames[*frames], 0,
+		  sizeof (gint16) * (max_frames - *frames));
+	}
+
+      // Sometimes libsamplerate returns less frames less than expected.
+      // This fixes the ratio, which is used to calculate the loop points.
+      ratio = *frames / (gdouble) sfinfo->frames;
+    }
+
+  emu3_sample_clear_edges (sample, sfinfo->channels, *frames);
+
+  emu3_append_sample_get_loop (source->sndfile, ratio, *frames, &loop_start,
+			       &loop_end, &loop);
+
+  size = emu3_sample_init (sample, offset, source->samplerate, *mono,
+			   *frames, loop_start, loop_end, loop);
+
   gchar *basec = strdup (path);
   filename = basename (basec);
   emu_debug (1, "Appending sample '%s' (%d frames, %d channels)...",
-	     filename, *frames, sfinfo.channels);
+	     filename, *frames, sfinfo->channels);
   //Sample header initialization
   gchar *name = emu_filename_to_filename_wo_ext (filename, NULL);
   gchar *emu3name = emu3_str_to_emu3name (name);
@@ -673,30 +1066,345 @@ emu3_append_sample (struct emu_file *file, struct emu3_sample *sample,
   free (name);
   free (emu3name);
 
-  emu3_sample_init_descriptor (&sd, sample, *frames);
+  emu_debug (1, "Appended %d B (0x%08x B)", size, size);
 
-  f = data;
-  for (gint i = 0; i < *frames; i++, f += sfinfo.channels)
+  return size;
+}
+
+gint
+emu3_append_sample (struct emu_file *file, guint32 addr,
+		    const gchar *path, gint offset, gboolean *mono,
+		    guint32 *frames)
+{
+  gint size;
+  struct emu3_sample_source source;
+
+  size = emu3_sample_source_open (&source, path);
+  if (size < 0)
+    {
+      return -1;
+    }
+
+  if (emu_file_reserve (file, addr + size))
+    {
+      size = -1;
+      goto close;
+    }
+
+  size = emu3_sample_source_load (&source,
+				  (struct emu3_sample *) &file->raw[addr],
+				  path, offset, mono, frames);
+
+close:
+  sf_close (source.sndfile);
+
+  return size;
+}
+
+// Copies a sample decoded by emu3_decode_sample into the file at addr.
+gint
+emu3_append_decoded_sample (struct emu_file *file, guint32 addr,
+			    const struct emu3_sample *decoded, gint size,
+			    gint offset)
+{
+  struct emu3_sample *sample;
+
+  if (emu_file_reserve (file, addr + size))
+    {
+      return -1;
+    }
+
+  sample = (struct emu3_sample *) &file->raw[addr];
+  memcpy (sample, decoded, size);
+  emu3_sample_set_data_offset (sample, offset);
+
+  return size;
+}
+
+// Loads a sample outside of any bank as if it were the first sample so that
+// it can be decoded in a different thread than the one editing the bank.
+struct emu3_sample *
+emu3_decode_sample (const gchar *path, gint *size, gboolean *mono,
+		    guint32 *frames)
+{
+  struct emu3_sample *sample;
+  struct emu3_sample_source source;
+
+  *size = emu3_sample_source_open (&source, path);
+  if (*size < 0)
     {
-      // First 2 and last 2 frames must be set to 0.
-      // Without this, the sampler will complain with a "Mono Start Zero!!!001" error message.
-      // As indicated in the manual, running the sample integrity in the digital tools menu would fix the error and it'll fix it by doing this.
-      // In previous versions of emu3bm, the pairs of 0 samples were appended automatically but this broke SDS compatibility frame count.
-      if (i < 2 || i >= *frames - 2)
+      return NULL;
+    }
+
+  sample = g_malloc (*size);
+  *size = emu3_sample_source_load (&source, sample, path, 0, mono, frames);
+  if (*size < 0)
+    {
+      g_free (sample);
+      sample = NULL;
+    }
+
+  sf_close (source.sndfile);
+
+  return sample;
+}
+
+// Moves the sample data offsets of a decoded sample to its position in the bank.
+void
+emu3_sample_set_data_offset (struct emu3_sample *sample, gint offset)
+{
+  sample->sample_data_offset_l += offset;
+  if (sample->sample_data_offset_r)
+    {
+      sample->sample_data_offset_r += offset;
+    }
+}
+
+struct emu3_sample_job
+{
+  const gchar *path;
+  struct emu3_sample *decoded;	//NULL if decoding failed
+  gint size;
+  gboolean done;
+};
+
+struct emu3_sample_queue
+{
+  struct emu_context *ctx;
+  struct emu3_sample_job *jobs;
+  guint len;
+  guint pushed;
+  guint popped;
+  GThreadPool *pool;		//NULL if samples are decoded when popped
+  GMutex mutex;
+  GCond cond;
+};
+
+static void
+emu3_sample_queue_decode (gpointer data, gpointer user_data)
+{
+  gboolean mono;
+  guint32 frames;
+  struct emu3_sample_job *job = data;
+  struct emu3_sample_queue *queue = user_data;
+
+  emu_set_context (queue->ctx);
+  job->decoded = emu3_decode_sample (job->path, &job->size, &mono, &frames);
+
+  g_mutex_lock (&queue->mutex);
+  job->done = TRUE;
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->mutex);
+}
+
+// Only a few samples per job are decoded ahead of the ones already popped so
+// that the memory used does not depend on the amount of samples.
+static void
+emu3_sample_queue_push (struct emu3_sample_queue *queue)
+{
+  guint ahead = queue->ctx->sample_jobs * SAMPLE_QUEUE_JOBS_AHEAD;
+
+  while (queue->pushed < queue->len && queue->pushed - queue->popped < ahead)
+    {
+      g_thread_pool_push (queue->pool, &queue->jobs[queue->pushed], NULL);
+      queue->pushed++;
+    }
+}
+
+// Starts decoding the samples at paths, which must outlive the queue.
+struct emu3_sample_queue *
+emu3_sample_queue_new (GPtrArray *paths)
+{
+  GError *error = NULL;
+  struct emu3_sample_queue *queue =
+    g_malloc0 (sizeof (struct emu3_sample_queue));
+
+  queue->ctx = emu_get_context ();
+  queue->len = paths->len;
+  queue->jobs = g_malloc0 (sizeof (struct emu3_sample_job) * paths->len);
+  for (guint i = 0; i < paths->len; i++)
+    {
+      queue->jobs[i].path = g_ptr_array_index (paths, i);
+    }
+
+  g_mutex_init (&queue->mutex);
+  g_cond_init (&queue->cond);
+  queue->pool = g_thread_pool_new (emu3_sample_queue_decode, queue,
+				   queue->ctx->sample_jobs, TRUE, &error);
+  if (queue->pool)
+    {
+      emu3_sample_queue_push (queue);
+    }
+  else
+    {
+      emu_error ("Error while creating thread pool: %s", error->message);
+      g_error_free (error);
+    }
+
+  return queue;
+}
+
+// Returns the next sample in the order of the paths once it is decoded or
+// NULL if decoding failed. The sample must be freed with g_free.
+struct emu3_sample *
+emu3_sample_queue_pop (struct emu3_sample_queue *queue, const gchar **path,
+		       gint *size)
+{
+  gboolean mono;
+  guint32 frames;
+  struct emu3_sample *decoded;
+  struct emu3_sample_job *job = &queue->jobs[queue->popped];
+
+  queue->popped++;
+
+  if (queue->pool)
+    {
+      emu3_sample_queue_push (queue);
+
+      g_mutex_lock (&queue->mutex);
+      while (!job->done)
+	{
+	  g_cond_wait (&queue->cond, &queue->mutex);
+	}
+      g_mutex_unlock (&queue->mutex);
+    }
+  else
+    {
+      job->decoded = emu3_decode_sample (job->path, &job->size, &mono,
+					 &frames);
+    }
+
+  *path = job->path;
+  *size = job->size;
+  decoded = job->decoded;
+  job->decoded = NULL;
+
+  return decoded;
+}
+
+// Waits for the samples being decoded and frees the ones not popped.
+void
+emu3_sample_queue_free (struct emu3_sample_queue *queue)
+{
+  if (queue->pool)
+    {
+      g_thread_pool_free (queue->pool, FALSE, TRUE);
+    }
+
+  for (guint i = 0; i < queue->len; i++)
+    {
+      g_free (queue->jobs[i].decoded);
+    }
+
+  g_mutex_clear (&queue->mutex);
+  g_cond_clear (&queue->cond);
+  g_free (queue->jobs);
+  g_free (queue);
+}
+
+static gint
+emu3_sample_path_compare (const void *a, const void *b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+static gboolean
+emu3_is_wav_name (const gchar *name)
+{
+  const gchar *ext = strrchr (name, '.');
+
+  return ext && !strcasecmp (ext, ".wav");
+}
+
+static gint
+emu3_add_dir_sample_paths (const gchar *dir_path, GPtrArray *paths)
+{
+  GDir *dir;
+  gchar *path;
+  const gchar *name;
+  GError *error = NULL;
+  guint first = paths->len;
+
+  dir = g_dir_open (dir_path, 0, &error);
+  if (!dir)
+    {
+      emu_error ("Error while opening directory '%s': %s", dir_path,
+		 error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+
+  while ((name = g_dir_read_name (dir)))
+    {
+      if (*name == '.' || !emu3_is_wav_name (name))
+	{
+	  continue;
+	}
+
+      path = g_build_filename (dir_path, name, NULL);
+      if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
 	{
-	  emu3_write_frame (&sd, zero);
+	  g_ptr_array_add (paths, path);
 	}
       else
 	{
-	  emu3_write_frame (&sd, f);
+	  g_free (path);
 	}
     }
+  g_dir_close (dir);
 
-  emu_debug (1, "Appended %d B (0x%08x B)", size, size);
+  if (paths->len == first)
+    {
+      emu_error ("No WAV files found in '%s'", dir_path);
+      return EXIT_FAILURE;
+    }
 
-close:
-  free (data);
-  sf_close (sndfile);
+  //Only the paths just added are sorted.
+  qsort (&paths->pdata[first], paths->len - first, sizeof (gpointer),
+	 emu3_sample_path_compare);
 
-  return size;
+  return EXIT_SUCCESS;
+}
+
+// Adds to paths the sample at path, the WAV files inside it if it is a
+// directory or the files matching it if it is a glob pattern. The paths are
+// added sorted by name and must be freed with g_free.
+gint
+emu3_add_sample_paths (const gchar *path, GPtrArray *paths)
+{
+  gint err;
+  glob_t glob_paths;
+
+  if (g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      return emu3_add_dir_sample_paths (path, paths);
+    }
+
+  if (g_file_test (path, G_FILE_TEST_EXISTS) || !strpbrk (path, "*?["))
+    {
+      g_ptr_array_add (paths, g_strdup (path));
+      return EXIT_SUCCESS;
+    }
+
+  err = glob (path, 0, NULL, &glob_paths);
+  if (err)
+    {
+      if (err == GLOB_NOMATCH)
+	{
+	  emu_error ("No files match '%s'", path);
+	}
+      else
+	{
+	  emu_error ("Error while expanding '%s'", path);
+	}
+      return EXIT_FAILURE;
+    }
+
+  for (gsize i = 0; i < glob_paths.gl_pathc; i++)
+    {
+      g_ptr_array_add (paths, g_strdup (glob_paths.gl_pathv[i]));
+    }
+  globfree (&glob_paths);
+
+  return EXIT_SUCCESS;
 }
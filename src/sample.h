@@ -19,6 +19,7 @@
  */
 
 #include <sndfile.h>
+#include "resampler.h"
 #include "utils.h"
 
 #ifndef SAMPLE_H
@@ -29,6 +30,8 @@
 #define MAX_SAMPLE_RATE 44100
 #define MIN_BIT_DEPTH 2
 #define MAX_BIT_DEPTH 16
+#define MIN_SAMPLE_JOBS 1
+#define MAX_SAMPLE_JOBS 64
 
 #define EMU3_SAMPLE_OPT_LOOP_MASK    0x000f
 #define EMU3_SAMPLE_OPT_LOOP         0x0001
@@ -60,13 +63,6 @@ struct emu3_sample
   gint16 frames[];
 };
 
-typedef enum emu3_ext_mode
-{
-  EMU3_EXT_MODE_NONE = 0,
-  EMU3_EXT_MODE_NAME,
-  EMU3_EXT_MODE_NAME_NUMBER
-} emu3_ext_mode_t;
-
 struct smpl_chunk_data
 {
   guint32 manufacturer;
@@ -89,24 +85,43 @@ struct smpl_chunk_data
   } sample_loop;
 };
 
-void emu3_process_sample (struct emu3_sample *sample, gint num,
+gint emu3_process_sample (struct emu3_sample *sample, gint num,
 			  emu3_ext_mode_t ext_mode, guint8 note,
 			  gfloat fraction);
 
+gint emu3_finish_sample_extraction (void);
+
+void emu3_print_sample (struct emu3_sample *sample, gint num, gint level);
+
 gint emu3_sample_get_smpl_chunk (SNDFILE * output,
 				 struct smpl_chunk_data *smpl_chunk_data);
 
-gint emu3_append_sample (struct emu_file *file, struct emu3_sample *sample,
+gint emu3_append_sample (struct emu_file *file, guint32 addr,
 			 const gchar * path, gint offset, gboolean * mono,
 			 guint32 * frames);
 
+gint emu3_append_decoded_sample (struct emu_file *file, guint32 addr,
+				 const struct emu3_sample *decoded, gint size,
+				 gint offset);
+
+struct emu3_sample *emu3_decode_sample (const gchar * path, gint * size,
+					gboolean * mono, guint32 * frames);
+
+void emu3_sample_set_data_offset (struct emu3_sample *sample, gint offset);
+
+struct emu3_sample_queue *emu3_sample_queue_new (GPtrArray * paths);
+
+struct emu3_sample *emu3_sample_queue_pop (struct emu3_sample_queue *queue,
+					   const gchar ** path, gint * size);
+
+void emu3_sample_queue_free (struct emu3_sample_queue *queue);
+
+gint emu3_add_sample_paths (const gchar * path, GPtrArray * paths);
+
 void emu3_sample_set_loop_start (struct emu3_sample *sample, gboolean mono,
 				 guint32 frames, guint32 loop_start);
 
 void emu3_sample_set_loop_end (struct emu3_sample *sample, gboolean mono,
 			       guint32 frames, guint32 loop_end);
 
-extern gint max_sample_rate;
-extern gint bit_depth;
-
 #endif
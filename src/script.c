@@ -0,0 +1,370 @@
+/*
+ *   script.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu3bm.h"
+
+struct emu3_script_command
+{
+  const gchar *name;
+  gint args;
+  //value is set to the sample or preset number if the command creates one.
+  gint (*run) (struct emu_file * file, gchar ** args, gint * value);
+};
+
+static gint
+emu3_script_add_sample (struct emu_file *file, gchar **args, gint *value)
+{
+  return emu3_add_sample (file, args[0], value, NULL, NULL);
+}
+
+static gint
+emu3_script_add_preset (struct emu_file *file, gchar **args, gint *value)
+{
+  return emu3_add_preset (file, args[0], value);
+}
+
+static gint
+emu3_script_add_zone_common (struct emu_file *file, gchar **args,
+			     gboolean is_num)
+{
+  gint preset_num, sample_num;
+  struct emu_zone_range zone_range;
+
+  preset_num = emu_get_positive_int (args[0]);
+  if (preset_num < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+  if (emu3_parse_zone_params (args[1], &sample_num, &zone_range, is_num))
+    {
+      return EXIT_FAILURE;
+    }
+
+  return emu3_add_preset_zone (file, preset_num, sample_num, &zone_range,
+			       NULL);
+}
+
+static gint
+emu3_script_add_zone (struct emu_file *file, gchar **args, gint *value)
+{
+  return emu3_script_add_zone_common (file, args, FALSE);
+}
+
+static gint
+emu3_script_add_zone_with_num (struct emu_file *file, gchar **args,
+			       gint *value)
+{
+  return emu3_script_add_zone_common (file, args, TRUE);
+}
+
+static gint
+emu3_script_delete_zone (struct emu_file *file, gchar **args, gint *value)
+{
+  gint preset_num = emu_get_positive_int (args[0]);
+  gint zone_num = emu_get_positive_int (args[1]);
+
+  if (preset_num < 0 || zone_num < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+  return emu3_del_preset_zone (file, preset_num, zone_num);
+}
+
+//The parameters are named after the command line options.
+static gint
+emu3_script_edit (struct emu_file *file, gchar **args, gint *value)
+{
+  gint v;
+  gint pbr = -1, level = -1, cutoff = -1, q = -1, filter = -1;
+  gchar *rt_controls = NULL;
+  gint preset_num = emu_get_positive_int (args[0]);
+
+  if (preset_num < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+  if (!strcmp (args[1], "real-time-controls"))
+    {
+      rt_controls = args[2];
+    }
+  else
+    {
+      v = emu_get_positive_int (args[2]);
+      if (v < 0)
+	{
+	  return EXIT_FAILURE;
+	}
+
+      if (!strcmp (args[1], "pitch-bend-range"))
+	{
+	  pbr = v;
+	}
+      else if (!strcmp (args[1], "level"))
+	{
+	  level = v;
+	}
+      else if (!strcmp (args[1], "filter-cutoff"))
+	{
+	  cutoff = v;
+	}
+      else if (!strcmp (args[1], "filter-q"))
+	{
+	  q = v;
+	}
+      else if (!strcmp (args[1], "filter-type"))
+	{
+	  filter = v;
+	}
+      else
+	{
+	  emu_error ("Invalid parameter '%s'", args[1]);
+	  return EXIT_FAILURE;
+	}
+    }
+
+  return emu3_edit_preset (file, preset_num, rt_controls, pbr, level, cutoff,
+			   q, filter);
+}
+
+static const struct emu3_script_command EMU3_SCRIPT_COMMANDS[] = {
+  {"add-sample", 1, emu3_script_add_sample},
+  {"add-preset", 1, emu3_script_add_preset},
+  {"add-zone", 2, emu3_script_add_zone},
+  {"add-zone-with-num", 2, emu3_script_add_zone_with_num},
+  {"delete-zone", 2, emu3_script_delete_zone},
+  {"edit", 3, emu3_script_edit}
+};
+
+static gboolean
+emu3_script_is_var_char (gchar c)
+{
+  return g_ascii_isalnum (c) || c == '_';
+}
+
+//Replaces every $name with the number captured by name.
+static gchar *
+emu3_script_expand (const gchar *arg, GHashTable *vars)
+{
+  gchar *name;
+  gpointer value;
+  const gchar *end;
+  GString *expanded = g_string_new (NULL);
+
+  while (*arg)
+    {
+      if (*arg != '$')
+	{
+	  g_string_append_c (expanded, *arg);
+	  arg++;
+	  continue;
+	}
+
+      arg++;
+      end = arg;
+      while (emu3_script_is_var_char (*end))
+	{
+	  end++;
+	}
+
+      name = g_strndup (arg, end - arg);
+      if (!g_hash_table_lookup_extended (vars, name, NULL, &value))
+	{
+	  emu_error ("Undefined variable '%s'", name);
+	  g_free (name);
+	  g_string_free (expanded, TRUE);
+	  return NULL;
+	}
+      g_free (name);
+
+      g_string_append_printf (expanded, "%d", GPOINTER_TO_INT (value));
+      arg = end;
+    }
+
+  return g_string_free (expanded, FALSE);
+}
+
+static gboolean
+emu3_script_is_var_name (const gchar *name)
+{
+  if (!*name || g_ascii_isdigit (*name))
+    {
+      return FALSE;
+    }
+
+  for (; *name; name++)
+    {
+      if (!emu3_script_is_var_char (*name))
+	{
+	  return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+
+static const struct emu3_script_command *
+emu3_script_get_command (const gchar *name)
+{
+  for (gint i = 0; i < G_N_ELEMENTS (EMU3_SCRIPT_COMMANDS); i++)
+    {
+      if (!strcmp (name, EMU3_SCRIPT_COMMANDS[i].name))
+	{
+	  return &EMU3_SCRIPT_COMMANDS[i];
+	}
+    }
+
+  return NULL;
+}
+
+//Runs a single command, whose arguments follow its name in argv. value is set
+//to the sample or preset number if the command creates one.
+gint
+emu3_run_script_command (struct emu_file *file, gint argc, gchar **argv,
+			 gint *value)
+{
+  const struct emu3_script_command *command;
+
+  command = emu3_script_get_command (argv[0]);
+  if (!command)
+    {
+      emu_error ("Unknown command '%s'", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (argc - 1 != command->args)
+    {
+      emu_error ("Command '%s' takes %d arguments", command->name,
+		 command->args);
+      return EXIT_FAILURE;
+    }
+
+  emu_debug (1, "Running '%s'...", command->name);
+
+  *value = EMU3_SCRIPT_NO_VALUE;
+  return command->run (file, &argv[1], value);
+}
+
+//A command might be preceded by "name =" to capture the number it returns.
+static gint
+emu3_script_run_line (struct emu_file *file, GHashTable *vars, gint argc,
+		      gchar **argv)
+{
+  gint err, value;
+  gchar **args;
+  const gchar *var = NULL;
+
+  if (argc > 2 && !strcmp (argv[1], "="))
+    {
+      var = argv[0];
+      if (!emu3_script_is_var_name (var))
+	{
+	  emu_error ("Invalid variable name '%s'", var);
+	  return EXIT_FAILURE;
+	}
+      argv += 2;
+      argc -= 2;
+    }
+
+  args = g_malloc0 (sizeof (gchar *) * (argc + 1));
+  args[0] = g_strdup (argv[0]);
+  for (gint i = 1; i < argc; i++)
+    {
+      args[i] = emu3_script_expand (argv[i], vars);
+      if (!args[i])
+	{
+	  g_strfreev (args);
+	  return EXIT_FAILURE;
+	}
+    }
+
+  err = emu3_run_script_command (file, argc, args, &value);
+  g_strfreev (args);
+  if (err || !var)
+    {
+      return err;
+    }
+
+  if (value == EMU3_SCRIPT_NO_VALUE)
+    {
+      emu_error ("Command '%s' does not return a number", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  emu_debug (1, "Setting '%s' to %d...", var, value);
+  g_hash_table_insert (vars, g_strdup (var), GINT_TO_POINTER (value));
+
+  return EXIT_SUCCESS;
+}
+
+//Runs the script commands, one per line, against the bank in memory and stops
+//at the first error. Writing the bank is up to the caller.
+gint
+emu3_run_script (struct emu_file *file, FILE *script)
+{
+  gint argc;
+  gchar **argv;
+  GError *error = NULL;
+  gchar *line = NULL;
+  gsize len = 0;
+  gint line_num = 0;
+  gint err = EXIT_SUCCESS;
+  GHashTable *vars = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					    NULL);
+
+  emu_set_context (file->ctx);
+
+  while (!err && getline (&line, &len, script) != -1)
+    {
+      line_num++;
+
+      g_strstrip (line);
+      if (!*line || *line == '#')
+	{
+	  continue;
+	}
+
+      if (!g_shell_parse_argv (line, &argc, &argv, &error))
+	{
+	  emu_error ("Error while parsing line %d: %s", line_num,
+		     error->message);
+	  g_error_free (error);
+	  err = EXIT_FAILURE;
+	  break;
+	}
+
+      err = emu3_script_run_line (file, vars, argc, argv);
+      if (err)
+	{
+	  emu_error ("Error at line %d", line_num);
+	}
+
+      g_strfreev (argv);
+    }
+
+  free (line);
+  g_hash_table_destroy (vars);
+
+  return err;
+}
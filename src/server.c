@@ -0,0 +1,497 @@
+/*
+ *   server.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3bm.
+ *
+ *   emu3bm is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3bm is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3bm.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "emu3bm.h"
+#include "server.h"
+
+#define EMU3_SERVER_BACKLOG 16
+
+struct emu3_server
+{
+  struct emu_context *ctx;	//Settings used by every client
+  GHashTable *banks;		//Open banks by canonical path
+  GMutex mutex;
+};
+
+struct emu3_server_bank
+{
+  struct emu_file *file;
+  GRWLock lock;			//Write locked by the requests changing it
+};
+
+struct emu3_server_client
+{
+  struct emu3_server *server;
+  struct emu_context *ctx;
+  gint fd;
+};
+
+struct emu3_server_request
+{
+  const gchar *name;
+  gboolean write;
+  gint (*run) (struct emu_context * ctx, struct emu_file * file, gint argc,
+	       gchar ** argv, GString * response);
+};
+
+static gint
+emu3_server_list (struct emu_context *ctx, struct emu_file *file, gint argc,
+		  gchar **argv, GString *response)
+{
+  emu3_list_bank (ctx, file, response);
+  return EXIT_SUCCESS;
+}
+
+//The samples are extracted to the directory given after the bank, or to the
+//server working directory, and the listing is returned in the response.
+static gint
+emu3_server_extract_samples (struct emu_context *ctx, struct emu_file *file,
+			     gint argc, gchar **argv, GString *response,
+			     emu3_ext_mode_t ext_mode)
+{
+  gint err;
+  FILE *output;
+  gchar *listing;
+  gsize listing_len;
+  gchar *extraction_dir = ctx->extraction_dir;
+
+  if (argc > 2)
+    {
+      emu_error ("Too many arguments for '%s'", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (argc == 2 && g_mkdir_with_parents (argv[1], 0755))
+    {
+      emu_error ("Error while creating directory '%s': %s", argv[1],
+		 strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  output = open_memstream (&listing, &listing_len);
+  if (!output)
+    {
+      emu_error ("Error while creating output: %s", strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  if (argc == 2)
+    {
+      ctx->extraction_dir = argv[1];
+    }
+  ctx->output = output;
+
+  err = emu3_process_bank (file, ext_mode, -1, NULL, -1, -1, -1, -1, -1);
+
+  ctx->output = NULL;
+  ctx->extraction_dir = extraction_dir;
+
+  fclose (output);
+  g_string_append_len (response, listing, listing_len);
+  free (listing);
+
+  return err;
+}
+
+static gint
+emu3_server_extract (struct emu_context *ctx, struct emu_file *file,
+		     gint argc, gchar **argv, GString *response)
+{
+  return emu3_server_extract_samples (ctx, file, argc, argv, response,
+				      EMU3_EXT_MODE_NAME);
+}
+
+static gint
+emu3_server_extract_with_num (struct emu_context *ctx, struct emu_file *file,
+			      gint argc, gchar **argv, GString *response)
+{
+  return emu3_server_extract_samples (ctx, file, argc, argv, response,
+				      EMU3_EXT_MODE_NAME_NUMBER);
+}
+
+static gint
+emu3_server_flush (struct emu_context *ctx, struct emu_file *file, gint argc,
+		   gchar **argv, GString *response)
+{
+  return emu3_write_file (file);
+}
+
+//Any other request is run as a script command.
+static gint
+emu3_server_run_script_command (struct emu_context *ctx,
+				struct emu_file *file, gint argc,
+				gchar **argv, GString *response)
+{
+  gint err, value;
+
+  err = emu3_run_script_command (file, argc, argv, &value);
+  if (!err && value != EMU3_SCRIPT_NO_VALUE)
+    {
+      g_string_append_printf (response, "%d\n", value);
+    }
+
+  return err;
+}
+
+//Extractions use the context of the bank so they are serialized with writers.
+static const struct emu3_server_request EMU3_SERVER_REQUESTS[] = {
+  {"list", FALSE, emu3_server_list},
+  {"extract", TRUE, emu3_server_extract},
+  {"extract-with-num", TRUE, emu3_server_extract_with_num},
+  {"flush", TRUE, emu3_server_flush}
+};
+
+static const struct emu3_server_request EMU3_SERVER_SCRIPT_REQUEST = {
+  NULL, TRUE, emu3_server_run_script_command
+};
+
+static const struct emu3_server_request *
+emu3_server_get_request (const gchar *name)
+{
+  for (gint i = 0; i < G_N_ELEMENTS (EMU3_SERVER_REQUESTS); i++)
+    {
+      if (!strcmp (name, EMU3_SERVER_REQUESTS[i].name))
+	{
+	  return &EMU3_SERVER_REQUESTS[i];
+	}
+    }
+
+  return &EMU3_SERVER_SCRIPT_REQUEST;
+}
+
+static void
+emu3_server_bank_free (gpointer data)
+{
+  struct emu3_server_bank *bank = data;
+
+  emu_close_file (bank->file);
+  g_rw_lock_clear (&bank->lock);
+  g_free (bank);
+}
+
+//Banks are opened the first time they are requested and kept open until the
+//server finishes.
+static struct emu3_server_bank *
+emu3_server_get_bank (struct emu3_server_client *client, const gchar *path)
+{
+  struct emu_file *file;
+  struct emu3_server *server = client->server;
+  struct emu3_server_bank *bank;
+  gchar *canonical_path = g_canonicalize_filename (path, NULL);
+
+  g_mutex_lock (&server->mutex);
+  bank = g_hash_table_lookup (server->banks, canonical_path);
+  g_mutex_unlock (&server->mutex);
+
+  if (bank)
+    {
+      g_free (canonical_path);
+      return bank;
+    }
+
+  //The bank is read without the lock so that other clients are not blocked.
+  emu_debug (1, "Opening bank %s...", canonical_path);
+
+  file = emu3_open_file (client->ctx, canonical_path, FALSE);
+  emu_set_context (client->ctx);
+  if (!file)
+    {
+      g_free (canonical_path);
+      return NULL;
+    }
+
+  g_mutex_lock (&server->mutex);
+
+  //Another client might have opened the same bank in the meantime.
+  bank = g_hash_table_lookup (server->banks, canonical_path);
+  if (bank)
+    {
+      g_mutex_unlock (&server->mutex);
+      emu_debug (1, "Bank %s already opened", canonical_path);
+      emu_close_file (file);
+      g_free (canonical_path);
+      return bank;
+    }
+
+  file->ctx = server->ctx;
+
+  bank = g_malloc (sizeof (struct emu3_server_bank));
+  bank->file = file;
+  g_rw_lock_init (&bank->lock);
+  g_hash_table_insert (server->banks, canonical_path, bank);
+
+  g_mutex_unlock (&server->mutex);
+
+  return bank;
+}
+
+//A request is the request name followed by the bank path and its arguments.
+static gint
+emu3_server_run_request (struct emu3_server_client *client, gint argc,
+			 gchar **argv, GString *response)
+{
+  gint err;
+  gchar *bank_path;
+  struct emu3_server_bank *bank;
+  const struct emu3_server_request *request;
+
+  if (argc < 2)
+    {
+      emu_error ("Request '%s' without bank", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  bank = emu3_server_get_bank (client, argv[1]);
+  if (!bank)
+    {
+      return EXIT_FAILURE;
+    }
+
+  //The bank path is swapped with the request name so that the arguments
+  //follow it.
+  bank_path = argv[1];
+  argv[1] = argv[0];
+  argv[0] = bank_path;
+  argc--;
+  argv++;
+
+  request = emu3_server_get_request (argv[0]);
+  if (request->write)
+    {
+      //Only the writer uses the bank so its errors are the client ones.
+      g_rw_lock_writer_lock (&bank->lock);
+      bank->file->ctx = client->ctx;
+      err = request->run (client->ctx, bank->file, argc, argv, response);
+      bank->file->ctx = client->server->ctx;
+      g_rw_lock_writer_unlock (&bank->lock);
+    }
+  else
+    {
+      //Readers share the bank so they get the client context explicitly.
+      g_rw_lock_reader_lock (&bank->lock);
+      err = request->run (client->ctx, bank->file, argc, argv, response);
+      g_rw_lock_reader_unlock (&bank->lock);
+    }
+
+  emu_set_context (client->ctx);
+
+  return err;
+}
+
+//Every response ends with "OK" or "ERROR" followed by the error message.
+static void
+emu3_server_respond (struct emu3_server_client *client, gchar *line,
+		     FILE *output)
+{
+  gint err, argc;
+  gchar **argv;
+  gchar *error_msg;
+  GError *error = NULL;
+  GString *response = g_string_new (NULL);
+
+  emu_context_clear_error (client->ctx);
+
+  if (g_shell_parse_argv (line, &argc, &argv, &error))
+    {
+      err = emu3_server_run_request (client, argc, argv, response);
+      g_strfreev (argv);
+    }
+  else
+    {
+      emu_error ("Error while parsing request: %s", error->message);
+      g_error_free (error);
+      err = EXIT_FAILURE;
+    }
+
+  if (err)
+    {
+      error_msg = emu_context_get_error (client->ctx);
+      fprintf (output, "ERROR %s\n",
+	       error_msg ? error_msg : "Unknown error");
+      g_free (error_msg);
+    }
+  else
+    {
+      fprintf (output, "%sOK\n", response->str);
+    }
+  fflush (output);
+
+  g_string_free (response, TRUE);
+}
+
+static gpointer
+emu3_server_run_client (gpointer data)
+{
+  FILE *input, *output;
+  gchar *line = NULL;
+  gsize len = 0;
+  struct emu3_server_client *client = data;
+
+  emu_set_context (client->ctx);
+  emu_debug (1, "Client connected");
+
+  input = fdopen (client->fd, "r");
+  output = fdopen (dup (client->fd), "w");
+  if (!input || !output)
+    {
+      emu_error ("Error while opening connection: %s", strerror (errno));
+      goto end;
+    }
+
+  while (getline (&line, &len, input) != -1)
+    {
+      g_strstrip (line);
+      if (!*line)
+	{
+	  continue;
+	}
+
+      emu3_server_respond (client, line, output);
+    }
+
+  emu_debug (1, "Client disconnected");
+
+end:
+  free (line);
+  if (output)
+    {
+      fclose (output);
+    }
+  if (input)
+    {
+      fclose (input);
+    }
+  else
+    {
+      close (client->fd);
+    }
+  emu_context_free (client->ctx);
+  g_free (client);
+
+  return NULL;
+}
+
+static gint
+emu3_server_listen (const gchar *socket_path)
+{
+  gint fd;
+  struct stat info;
+  struct sockaddr_un addr;
+
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      emu_error ("Socket path '%s' too long", socket_path);
+      return -1;
+    }
+
+  //A socket left by a previous server is replaced but no other file is.
+  if (!stat (socket_path, &info) && S_ISSOCK (info.st_mode))
+    {
+      unlink (socket_path);
+    }
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      emu_error ("Error while creating socket: %s", strerror (errno));
+      return -1;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+      listen (fd, EMU3_SERVER_BACKLOG))
+    {
+      emu_error ("Error while listening on '%s': %s", socket_path,
+		 strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+//Serves requests on the Unix socket at socket_path until the process is
+//terminated. Every client runs in its own thread. Clients share the open banks
+//and changes are only written to disk with the "flush" request.
+gint
+emu3_serve (struct emu_context *ctx, const gchar *socket_path)
+{
+  gint fd, client_fd;
+  struct emu3_server server;
+  struct emu3_server_client *client;
+  GThread *thread;
+
+  emu_set_context (ctx);
+
+  fd = emu3_server_listen (socket_path);
+  if (fd < 0)
+    {
+      return EXIT_FAILURE;
+    }
+
+  //A client closing the connection must not terminate the server.
+  signal (SIGPIPE, SIG_IGN);
+
+  server.ctx = ctx;
+  server.banks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					emu3_server_bank_free);
+  g_mutex_init (&server.mutex);
+
+  emu_debug (1, "Listening on %s...", socket_path);
+
+  while (1)
+    {
+      client_fd = accept (fd, NULL, NULL);
+      if (client_fd < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  emu_error ("Error while accepting connection: %s",
+		     strerror (errno));
+	  break;
+	}
+
+      client = g_malloc (sizeof (struct emu3_server_client));
+      client->server = &server;
+      client->ctx = emu_context_copy (ctx);
+      client->fd = client_fd;
+      thread = g_thread_new ("client", emu3_server_run_client, client);
+      g_thread_unref (thread);
+    }
+
+  //Clients might still be using the banks so they are freed on exit.
+  close (fd);
+  unlink (socket_path);
+
+  return EXIT_FAILURE;
+}
@@ -18,6 +18,9 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef SFZ_H
+#define SFZ_H
+
 #include "utils.h"
 
 struct emu_velocity_range_map
@@ -27,6 +30,81 @@ struct emu_velocity_range_map
   gint preset_num;
 };
 
+//Known opcodes sorted by name.
+enum emu_sfz_opcode
+{
+  EMU_SFZ_OPCODE_NONE = -1,
+  EMU_SFZ_OPCODE_AMP_VELTRACK,
+  EMU_SFZ_OPCODE_AMPEG_ATTACK,
+  EMU_SFZ_OPCODE_AMPEG_DECAY,
+  EMU_SFZ_OPCODE_AMPEG_HOLD,
+  EMU_SFZ_OPCODE_AMPEG_RELEASE,
+  EMU_SFZ_OPCODE_AMPEG_SUSTAIN,
+  EMU_SFZ_OPCODE_BEND_UP,
+  EMU_SFZ_OPCODE_BENDUP,
+  EMU_SFZ_OPCODE_CUTOFF,
+  EMU_SFZ_OPCODE_FIL_KEYTRACK,
+  EMU_SFZ_OPCODE_FIL_TYPE,
+  EMU_SFZ_OPCODE_FIL_VELTRACK,
+  EMU_SFZ_OPCODE_FILEG_ATTACK,
+  EMU_SFZ_OPCODE_FILEG_DECAY,
+  EMU_SFZ_OPCODE_FILEG_DEPTH,
+  EMU_SFZ_OPCODE_FILEG_HOLD,
+  EMU_SFZ_OPCODE_FILEG_RELEASE,
+  EMU_SFZ_OPCODE_FILEG_SUSTAIN,
+  EMU_SFZ_OPCODE_HIKEY,
+  EMU_SFZ_OPCODE_HIVEL,
+  EMU_SFZ_OPCODE_KEY,
+  EMU_SFZ_OPCODE_LFO01_CUTOFF,
+  EMU_SFZ_OPCODE_LFO01_DELAY,
+  EMU_SFZ_OPCODE_LFO01_PAN,
+  EMU_SFZ_OPCODE_LFO01_PITCH,
+  EMU_SFZ_OPCODE_LFO01_RATE,
+  EMU_SFZ_OPCODE_LFO01_VOLUME,
+  EMU_SFZ_OPCODE_LFO01_WAVE,
+  EMU_SFZ_OPCODE_LFO1_CUTOFF,
+  EMU_SFZ_OPCODE_LFO1_DELAY,
+  EMU_SFZ_OPCODE_LFO1_PAN,
+  EMU_SFZ_OPCODE_LFO1_PITCH,
+  EMU_SFZ_OPCODE_LFO1_RATE,
+  EMU_SFZ_OPCODE_LFO1_VOLUME,
+  EMU_SFZ_OPCODE_LFO1_WAVE,
+  EMU_SFZ_OPCODE_LOKEY,
+  EMU_SFZ_OPCODE_LOOP_END,
+  EMU_SFZ_OPCODE_LOOP_MODE,
+  EMU_SFZ_OPCODE_LOOP_START,
+  EMU_SFZ_OPCODE_LOVEL,
+  EMU_SFZ_OPCODE_PAN,
+  EMU_SFZ_OPCODE_PAN_VELTRACK,
+  EMU_SFZ_OPCODE_PITCH,
+  EMU_SFZ_OPCODE_PITCH_KEYCENTER,
+  EMU_SFZ_OPCODE_PITCHEG_ATTACK,
+  EMU_SFZ_OPCODE_PITCHEG_DECAY,
+  EMU_SFZ_OPCODE_PITCHEG_DEPTH,
+  EMU_SFZ_OPCODE_PITCHEG_HOLD,
+  EMU_SFZ_OPCODE_PITCHEG_RELEASE,
+  EMU_SFZ_OPCODE_PITCHEG_SUSTAIN,
+  EMU_SFZ_OPCODE_RESONANCE,
+  EMU_SFZ_OPCODE_SAMPLE,
+  EMU_SFZ_OPCODE_TUNE,
+  EMU_SFZ_OPCODES
+};
+
+//Strings are only used by the opcodes defined as such.
+union emu_sfz_value
+{
+  gdouble number;
+  gchar *string;
+};
+
+//Values of the opcodes set in a header.
+struct emu_sfz_opcodes
+{
+  gint refs;
+  guint64 defined;		//Bitmap of the set values
+  union emu_sfz_value values[EMU_SFZ_OPCODES];
+};
+
 struct emu_sfz_context
 {
   struct emu_file *file;
@@ -35,11 +113,34 @@ struct emu_sfz_context
   gint region_num;
   const gchar *sfz_dir;
   struct emu_velocity_range_map emu_velocity_range_maps[EMU3_NOTES];
-  GHashTable *global_opcodes;
-  GHashTable *group_opcodes;
-  GHashTable *region_opcodes;
+  struct emu_sfz_opcodes *global_opcodes;
+  struct emu_sfz_opcodes *group_opcodes;
+  struct emu_sfz_opcodes *region_opcodes;
+  struct emu_sfz_opcodes *header_opcodes;	//Opcodes of the header being read
+  GHashTable *samples;		//Samples used by this import
+  GPtrArray *regions;
+  GPtrArray *sample_paths;	//Paths of the samples in order of first use
+  struct emu3_sample_queue *queue;	//NULL if decoded into the bank
+  guint next_sample;		//Index of the next sample in the queue
 };
 
+enum emu_sfz_opcode emu_sfz_get_opcode (const gchar * name);
+
+const gchar *emu_sfz_get_opcode_name (enum emu_sfz_opcode opcode);
+
+struct emu_sfz_opcodes *emu_sfz_opcodes_new (void);
+
+struct emu_sfz_opcodes *emu_sfz_opcodes_ref (struct emu_sfz_opcodes
+					     *opcodes);
+
+void emu_sfz_opcodes_unref (struct emu_sfz_opcodes *opcodes);
+
+const union emu_sfz_value *emu_sfz_opcodes_get (const struct emu_sfz_opcodes
+						*opcodes,
+						enum emu_sfz_opcode opcode);
+
 void emu3_sfz_add_region (struct emu_sfz_context *esctx);
 
-void sfz_parser_set_context (struct emu_sfz_context *esctx);
+gint emu_sfz_parse (FILE * sfz, struct emu_sfz_context *esctx);
+
+#endif
@@ -1,37 +1,66 @@
+%code requires {
+
+  #include "sfz.h"
+
+  #ifndef YY_TYPEDEF_YY_SCANNER_T
+  #define YY_TYPEDEF_YY_SCANNER_T
+  typedef void *yyscan_t;
+  #endif
+
+  //The string is NULL for numbers.
+  struct sfz_value {
+    gdouble number;
+    gchar *string;
+  };
+
+}
+
 %{
 
   #include <stdio.h>
   #include <math.h>
   #include <stdlib.h>
   #include <string.h>
-  #include "sfz.h"
 
-  extern gint yylineno;
-  extern gchar *yytext;
-  gint yyerror(const gchar *msg);
-  gint yylex (void);
+%}
 
-  gchar *header;
-  gchar *opcode;
-  gpointer value;
-  GHashTable *header_opcodes;
+%code {
 
-  struct emu_sfz_context *esctx;
+  gint sfz_lex (SFZ_STYPE *yylval, yyscan_t scanner);
+  gint sfz_lex_init (yyscan_t *scanner);
+  gint sfz_lex_destroy (yyscan_t scanner);
+  void sfz_set_in (FILE *in, yyscan_t scanner);
+  gint sfz_get_lineno (yyscan_t scanner);
 
-  void sfz_parser_set_context (struct emu_sfz_context *emu_sfz_context) {
-    esctx = emu_sfz_context;
-  }
+  static void sfz_error (yyscan_t scanner, struct emu_sfz_context *esctx, const gchar *msg);
 
-%}
+  static void sfz_set_opcode (struct emu_sfz_context *esctx, enum emu_sfz_opcode opcode, struct sfz_value value);
+
+}
 
+%define api.prefix {sfz_}
+%define api.pure full
 %define parse.error verbose
 
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {struct emu_sfz_context *esctx}
+
+%union {
+  gint opcode;
+  gdouble number;
+  gchar *string;
+  struct sfz_value value;
+}
+
 %token SFZ_EQUAL
-       SFZ_FLOAT
-       SFZ_INTEGER
-       SFZ_STRING
-       SFZ_HEADER
-       SFZ_OPCODE
+%token <number> SFZ_FLOAT SFZ_INTEGER
+%token <string> SFZ_STRING SFZ_HEADER SFZ_UNKNOWN_OPCODE
+%token <opcode> SFZ_OPCODE
+
+%type <value> opcode_val
+
+%destructor { g_free ($$); } <string>
+%destructor { g_free ($$.string); } <value>
 
 %%
 
@@ -41,64 +70,238 @@ headers: | header headers;
 
 header: SFZ_HEADER
         {
-          header = strdup (yytext);
-          if (!strcmp("<global>", header)) {
-            g_hash_table_remove_all (esctx->global_opcodes);
-            header_opcodes = esctx->global_opcodes;
-          } else if (!strcmp("<group>", header)) {
-            g_hash_table_remove_all (esctx->group_opcodes);
-            header_opcodes = esctx->group_opcodes;
-          } else if (!strcmp("<region>", header)) {
-            g_hash_table_remove_all (esctx->region_opcodes);
-            header_opcodes = esctx->region_opcodes;
+          if (!strcmp("<global>", $1)) {
+            emu_sfz_opcodes_unref (esctx->global_opcodes);
+            esctx->global_opcodes = emu_sfz_opcodes_new ();
+            esctx->header_opcodes = esctx->global_opcodes;
+          } else if (!strcmp("<group>", $1)) {
+            emu_sfz_opcodes_unref (esctx->group_opcodes);
+            esctx->group_opcodes = emu_sfz_opcodes_new ();
+            esctx->header_opcodes = esctx->group_opcodes;
+          } else if (!strcmp("<region>", $1)) {
+            emu_sfz_opcodes_unref (esctx->region_opcodes);
+            esctx->region_opcodes = emu_sfz_opcodes_new ();
+            esctx->header_opcodes = esctx->region_opcodes;
           } else {
-            emu_debug (1, "SFZ header %s not supported. Skipping...", header);
-            header_opcodes = NULL;
+            emu_debug (1, "SFZ header %s not supported. Skipping...", $1);
+            esctx->header_opcodes = NULL;
           }
         }
         opcode_expr_list
         {
-          if (!strcmp("<global>", header)) {
-            emu_debug (1, "SFZ header %s read", header);
-          } else if (!strcmp("<group>", header)) {
-            emu_debug (1, "SFZ header %s read", header);
-          } else if (!strcmp("<region>", header)) {
-            emu_debug (1, "SFZ header %s read", header);
+          if (!strcmp("<global>", $1)) {
+            emu_debug (1, "SFZ header %s read", $1);
+          } else if (!strcmp("<group>", $1)) {
+            emu_debug (1, "SFZ header %s read", $1);
+          } else if (!strcmp("<region>", $1)) {
+            emu_debug (1, "SFZ header %s read", $1);
             emu3_sfz_add_region (esctx);
           }
-          free (header);
+          g_free ($1);
         };
 
 opcode_expr_list: | opcode_expr opcode_expr_list;
 
-opcode_expr: SFZ_OPCODE
+opcode_expr: SFZ_OPCODE SFZ_EQUAL opcode_val
              {
-               opcode = strdup (yytext);
-             }
-             SFZ_EQUAL
-             opcode_val
+               sfz_set_opcode (esctx, $1, $3);
+             } |
+             SFZ_UNKNOWN_OPCODE SFZ_EQUAL opcode_val
              {
-               emu_debug (2, "SFZ opcode '%s' read", opcode);
-               if (header_opcodes) {
-                 g_hash_table_insert (header_opcodes, opcode, value);
-               }
+               emu_debug (2, "SFZ opcode '%s' not supported. Skipping...", $1);
+               g_free ($1);
+               g_free ($3.string);
              };
 
-opcode_val: SFZ_FLOAT   { value = g_malloc(sizeof(gdouble)); *(gdouble *)value = atof (yytext); emu_debug (2, "SFZ float '%f' read", *(gdouble *)value); } |
-            SFZ_INTEGER { value = g_malloc(sizeof(gdouble)); *(gdouble *)value = atoi (yytext); emu_debug (2, "SFZ integer '%d' read", (gint) *(gdouble *)value); } |
-            SFZ_STRING  { value = g_strdup (yytext); g_strchomp (value); emu_debug (2, "SFZ string '%s' read", (gchar *)value);
-                          if (!strcmp(opcode, "key") || !strcmp(opcode, "pitch_keycenter") || !strcmp(opcode, "lokey") || !strcmp(opcode, "hikey")) {
-                            gint note_num = emu_reverse_note_search (value) + 21; // Conversion of emu3 notes to MIDI notes
-                            g_free (value);
-                            gint *note_num_p = g_malloc(sizeof(gint));
-                            *note_num_p = note_num;
-                            value = note_num_p;
-                          }
-                        };
+opcode_val: SFZ_FLOAT   { $$.number = $1; $$.string = NULL; emu_debug (2, "SFZ float '%f' read", $1); } |
+            SFZ_INTEGER { $$.number = $1; $$.string = NULL; emu_debug (2, "SFZ integer '%d' read", (gint) $1); } |
+            SFZ_STRING  { $$.string = g_strchomp ($1); emu_debug (2, "SFZ string '%s' read", $1); };
 
 %%
 
-gint yyerror(const gchar *s)
+static void sfz_error (yyscan_t scanner, struct emu_sfz_context *esctx, const gchar *s)
+{
+  emu_error ("Error at line %d: %s", sfz_get_lineno (scanner), s);
+}
+
+gint emu_sfz_parse (FILE *sfz, struct emu_sfz_context *esctx)
+{
+  gint err;
+  yyscan_t scanner;
+
+  if (sfz_lex_init (&scanner)) {
+    return EXIT_FAILURE;
+  }
+
+  sfz_set_in (sfz, scanner);
+  err = sfz_parse (scanner, esctx) ? EXIT_FAILURE : EXIT_SUCCESS;
+  sfz_lex_destroy (scanner);
+
+  return err;
+}
+
+struct emu_sfz_opcode_info
+{
+  const gchar *name;
+  gboolean string;
+  gboolean note;		//Numbers that can be set as note names
+};
+
+static const struct emu_sfz_opcode_info EMU_SFZ_OPCODE_INFOS[EMU_SFZ_OPCODES] = {
+  {"amp_veltrack", FALSE, FALSE},
+  {"ampeg_attack", FALSE, FALSE},
+  {"ampeg_decay", FALSE, FALSE},
+  {"ampeg_hold", FALSE, FALSE},
+  {"ampeg_release", FALSE, FALSE},
+  {"ampeg_sustain", FALSE, FALSE},
+  {"bend_up", FALSE, FALSE},
+  {"bendup", FALSE, FALSE},
+  {"cutoff", FALSE, FALSE},
+  {"fil_keytrack", FALSE, FALSE},
+  {"fil_type", TRUE, FALSE},
+  {"fil_veltrack", FALSE, FALSE},
+  {"fileg_attack", FALSE, FALSE},
+  {"fileg_decay", FALSE, FALSE},
+  {"fileg_depth", FALSE, FALSE},
+  {"fileg_hold", FALSE, FALSE},
+  {"fileg_release", FALSE, FALSE},
+  {"fileg_sustain", FALSE, FALSE},
+  {"hikey", FALSE, TRUE},
+  {"hivel", FALSE, FALSE},
+  {"key", FALSE, TRUE},
+  {"lfo01_cutoff", FALSE, FALSE},
+  {"lfo01_delay", FALSE, FALSE},
+  {"lfo01_pan", FALSE, FALSE},
+  {"lfo01_pitch", FALSE, FALSE},
+  {"lfo01_rate", FALSE, FALSE},
+  {"lfo01_volume", FALSE, FALSE},
+  {"lfo01_wave", FALSE, FALSE},
+  {"lfo1_cutoff", FALSE, FALSE},
+  {"lfo1_delay", FALSE, FALSE},
+  {"lfo1_pan", FALSE, FALSE},
+  {"lfo1_pitch", FALSE, FALSE},
+  {"lfo1_rate", FALSE, FALSE},
+  {"lfo1_volume", FALSE, FALSE},
+  {"lfo1_wave", FALSE, FALSE},
+  {"lokey", FALSE, TRUE},
+  {"loop_end", FALSE, FALSE},
+  {"loop_mode", TRUE, FALSE},
+  {"loop_start", FALSE, FALSE},
+  {"lovel", FALSE, FALSE},
+  {"pan", FALSE, FALSE},
+  {"pan_veltrack", FALSE, FALSE},
+  {"pitch", FALSE, FALSE},
+  {"pitch_keycenter", FALSE, TRUE},
+  {"pitcheg_attack", FALSE, FALSE},
+  {"pitcheg_decay", FALSE, FALSE},
+  {"pitcheg_depth", FALSE, FALSE},
+  {"pitcheg_hold", FALSE, FALSE},
+  {"pitcheg_release", FALSE, FALSE},
+  {"pitcheg_sustain", FALSE, FALSE},
+  {"resonance", FALSE, FALSE},
+  {"sample", TRUE, FALSE},
+  {"tune", FALSE, FALSE}
+};
+
+G_STATIC_ASSERT (EMU_SFZ_OPCODES <= 64);
+
+static gint
+emu_sfz_opcode_info_compare (const void *a, const void *b)
 {
-  return fprintf (stderr, "line %d: %s\n", yylineno, s);
+  const gchar *name = a;
+  const struct emu_sfz_opcode_info *info = b;
+  return strcmp (name, info->name);
+}
+
+enum emu_sfz_opcode
+emu_sfz_get_opcode (const gchar *name)
+{
+  const struct emu_sfz_opcode_info *info = bsearch (name, EMU_SFZ_OPCODE_INFOS,
+                                                    EMU_SFZ_OPCODES,
+                                                    sizeof (struct emu_sfz_opcode_info),
+                                                    emu_sfz_opcode_info_compare);
+  return info ? info - EMU_SFZ_OPCODE_INFOS : EMU_SFZ_OPCODE_NONE;
+}
+
+const gchar *
+emu_sfz_get_opcode_name (enum emu_sfz_opcode opcode)
+{
+  return opcode == EMU_SFZ_OPCODE_NONE ? NULL : EMU_SFZ_OPCODE_INFOS[opcode].name;
+}
+
+struct emu_sfz_opcodes *
+emu_sfz_opcodes_new (void)
+{
+  struct emu_sfz_opcodes *opcodes = g_malloc0 (sizeof (struct emu_sfz_opcodes));
+  opcodes->refs = 1;
+  return opcodes;
+}
+
+struct emu_sfz_opcodes *
+emu_sfz_opcodes_ref (struct emu_sfz_opcodes *opcodes)
+{
+  opcodes->refs++;
+  return opcodes;
+}
+
+void
+emu_sfz_opcodes_unref (struct emu_sfz_opcodes *opcodes)
+{
+  opcodes->refs--;
+  if (opcodes->refs) {
+    return;
+  }
+
+  for (gint i = 0; i < EMU_SFZ_OPCODES; i++) {
+    if (EMU_SFZ_OPCODE_INFOS[i].string && opcodes->defined & (1ULL << i)) {
+      g_free (opcodes->values[i].string);
+    }
+  }
+  g_free (opcodes);
+}
+
+const union emu_sfz_value *
+emu_sfz_opcodes_get (const struct emu_sfz_opcodes *opcodes, enum emu_sfz_opcode opcode)
+{
+  return opcodes->defined & (1ULL << opcode) ? &opcodes->values[opcode] : NULL;
+}
+
+static void
+sfz_set_opcode (struct emu_sfz_context *esctx, enum emu_sfz_opcode opcode, struct sfz_value value)
+{
+  union emu_sfz_value *v;
+  struct emu_sfz_opcodes *opcodes = esctx->header_opcodes;
+  const struct emu_sfz_opcode_info *info = &EMU_SFZ_OPCODE_INFOS[opcode];
+
+  emu_debug (2, "SFZ opcode '%s' read", info->name);
+
+  if (!opcodes) {
+    g_free (value.string);
+    return;
+  }
+
+  v = &opcodes->values[opcode];
+
+  if (info->string) {
+    if (!value.string) {
+      emu_debug (1, "SFZ opcode '%s' requires a string. Skipping...", info->name);
+      return;
+    }
+    if (emu_sfz_opcodes_get (opcodes, opcode)) {
+      g_free (v->string);
+    }
+    v->string = value.string;
+  } else if (value.string) {
+    if (!info->note) {
+      emu_debug (1, "SFZ opcode '%s' requires a number. Skipping...", info->name);
+      g_free (value.string);
+      return;
+    }
+    v->number = emu_reverse_note_search (value.string) + 21; // Conversion of emu3 notes to MIDI notes
+    g_free (value.string);
+  } else {
+    v->number = value.number;
+  }
+
+  opcodes->defined |= 1ULL << opcode;
 }
@@ -19,9 +19,13 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sample.h"
 #include "utils.h"
 
 static const gchar *NOTE_NAMES[] = {
@@ -155,25 +159,266 @@ static const gchar *NOTE_NAMES[] = {
   "E10"				// Note 127
 };
 
-gint verbosity = 0;
+//Used by the calls made before setting any context.
+static struct emu_context default_context = {
+  .verbosity = 0,
+  .max_sample_rate = MAX_SAMPLE_RATE,
+  .bit_depth = MAX_BIT_DEPTH,
+  .sample_jobs = 1,
+  .resample_quality = EMU3_RESAMPLE_QUALITY_BEST
+};
+
+static GPrivate current_context = G_PRIVATE_INIT (NULL);
+
+struct emu_context *
+emu_context_new (void)
+{
+  struct emu_context *ctx = g_malloc0 (sizeof (struct emu_context));
+  ctx->max_sample_rate = MAX_SAMPLE_RATE;
+  ctx->bit_depth = MAX_BIT_DEPTH;
+  ctx->sample_jobs = 1;
+  ctx->resample_quality = EMU3_RESAMPLE_QUALITY_BEST;
+  g_mutex_init (&ctx->mutex);
+  return ctx;
+}
+
+//Returns a new context with the same settings than ctx.
+struct emu_context *
+emu_context_copy (struct emu_context *ctx)
+{
+  struct emu_context *copy = emu_context_new ();
+  copy->verbosity = ctx->verbosity;
+  copy->max_sample_rate = ctx->max_sample_rate;
+  copy->bit_depth = ctx->bit_depth;
+  copy->sample_jobs = ctx->sample_jobs;
+  copy->resample_quality = ctx->resample_quality;
+  copy->extraction_dir = g_strdup (ctx->extraction_dir);
+  return copy;
+}
+
+void
+emu_context_free (struct emu_context *ctx)
+{
+  if (g_private_get (&current_context) == ctx)
+    {
+      g_private_set (&current_context, NULL);
+    }
+  if (ctx->pending_extractions)
+    {
+      g_ptr_array_free (ctx->pending_extractions, TRUE);
+    }
+  if (ctx->polyphase_banks)
+    {
+      g_ptr_array_free (ctx->polyphase_banks, TRUE);
+    }
+  g_mutex_clear (&ctx->mutex);
+  g_free (ctx->extraction_dir);
+  g_free (ctx->error);
+  g_free (ctx);
+}
+
+void
+emu_context_set_verbosity (struct emu_context *ctx, gint verbosity)
+{
+  ctx->verbosity = verbosity;
+}
+
+void
+emu_context_set_max_sample_rate (struct emu_context *ctx,
+				 gint max_sample_rate)
+{
+  ctx->max_sample_rate = max_sample_rate;
+}
+
+void
+emu_context_set_bit_depth (struct emu_context *ctx, gint bit_depth)
+{
+  ctx->bit_depth = bit_depth;
+}
+
+void
+emu_context_set_sample_jobs (struct emu_context *ctx, gint sample_jobs)
+{
+  ctx->sample_jobs = sample_jobs;
+}
+
+void
+emu_context_set_resample_quality (struct emu_context *ctx,
+				  emu3_resample_quality_t quality)
+{
+  ctx->resample_quality = quality;
+}
+
+void
+emu_context_set_extraction_dir (struct emu_context *ctx, const gchar *dir)
+{
+  g_free (ctx->extraction_dir);
+  ctx->extraction_dir = g_strdup (dir);
+}
+
+void
+emu_context_set_output (struct emu_context *ctx, FILE *output)
+{
+  ctx->output = output;
+}
+
+void
+emu_context_set_log (struct emu_context *ctx, FILE *log)
+{
+  ctx->log = log;
+}
+
+void
+emu_context_set_error (struct emu_context *ctx, const gchar *format, ...)
+{
+  va_list args;
+  gchar *error;
+
+  va_start (args, format);
+  error = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  g_mutex_lock (&ctx->mutex);
+  g_free (ctx->error);
+  ctx->error = error;
+  g_mutex_unlock (&ctx->mutex);
+}
+
+void
+emu_context_clear_error (struct emu_context *ctx)
+{
+  g_mutex_lock (&ctx->mutex);
+  g_free (ctx->error);
+  ctx->error = NULL;
+  g_mutex_unlock (&ctx->mutex);
+}
+
+//Returns a copy of the last error message or NULL if there was none.
+gchar *
+emu_context_get_error (struct emu_context *ctx)
+{
+  gchar *error;
+
+  g_mutex_lock (&ctx->mutex);
+  error = g_strdup (ctx->error);
+  g_mutex_unlock (&ctx->mutex);
+
+  return error;
+}
+
+//Sets the context used by the calling thread.
+void
+emu_set_context (struct emu_context *ctx)
+{
+  g_private_set (&current_context, ctx);
+}
+
+struct emu_context *
+emu_get_context (void)
+{
+  struct emu_context *ctx = g_private_get (&current_context);
+  return ctx ? ctx : &default_context;
+}
+
+FILE *
+emu_get_output (void)
+{
+  FILE *output = emu_get_context ()->output;
+  return output ? output : stdout;
+}
+
+FILE *
+emu_get_log (void)
+{
+  FILE *log = emu_get_context ()->log;
+  return log ? log : stderr;
+}
+
+//Maps the file in place. Used by the commands that never modify the bank so that they only read the pages they need.
+static struct emu_file *
+emu_map_file (const gchar *name)
+{
+  struct stat st;
+  struct emu_file *file;
+  gchar *raw;
+  gsize size;
+  gint fd = open (name, O_RDONLY);
+
+  if (fd < 0)
+    {
+      emu_error ("Error while opening %s for input", name);
+      return NULL;
+    }
+
+  if (fstat (fd, &st))
+    {
+      emu_error ("Error while getting %s size", name);
+      close (fd);
+      return NULL;
+    }
+
+  size = st.st_size > EMU3_MEM_SIZE ? EMU3_MEM_SIZE : st.st_size;
+  raw = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (raw == MAP_FAILED)
+    {
+      emu_error ("Error while mapping %s", name);
+      return NULL;
+    }
+
+  file = (struct emu_file *) malloc (sizeof (struct emu_file));
+  file->ctx = emu_get_context ();
+  file->name = name;
+  file->raw = raw;
+  file->size = size;
+  file->capacity = size;
+  file->mapped = TRUE;
+  file->layout = NULL;
+  file->gap = 0;
+  file->dirty_all = FALSE;
+  file->dirty = NULL;
+
+  return file;
+}
 
 struct emu_file *
-emu_open_file (const gchar *name)
+emu_open_file (const gchar *name, gboolean read_only)
 {
+  struct stat st;
   struct emu_file *file;
-  FILE *fd = fopen (name, "r");
+  FILE *fd;
+
+  //Empty files can not be mapped so they are read as usual.
+  if (read_only && !stat (name, &st) && st.st_size > 0)
+    {
+      return emu_map_file (name);
+    }
 
+  fd = fopen (name, "r");
   if (!fd)
     {
       emu_error ("Error while opening %s for input", name);
       return NULL;
     }
 
-  file = (struct emu_file *) malloc (sizeof (struct emu_file));
+  if (fstat (fileno (fd), &st))
+    {
+      emu_error ("Error while getting %s size", name);
+      fclose (fd);
+      return NULL;
+    }
 
-  file->name = name;
-  file->raw = malloc (EMU3_MEM_SIZE);
-  file->size = fread (file->raw, 1, EMU3_MEM_SIZE, fd);
+  file = emu_init_file (name);
+  if (emu_file_reserve (file, st.st_size > EMU3_MEM_SIZE ? EMU3_MEM_SIZE :
+			st.st_size))
+    {
+      emu_close_file (file);
+      fclose (fd);
+      return NULL;
+    }
+
+  file->size = fread (file->raw, 1, file->capacity, fd);
+  file->dirty_all = FALSE;
   fclose (fd);
 
   return file;
@@ -182,12 +427,31 @@ emu_open_file (const gchar *name)
 void
 emu_close_file (struct emu_file *file)
 {
-  free (file->raw);
+  if (file->mapped)
+    munmap (file->raw, file->size);
+  else
+    free (file->raw);
+  if (file->dirty)
+    g_array_free (file->dirty, TRUE);
   free (file);
 }
 
-gint
-emu_write_file (struct emu_file *file)
+static gint
+emu_file_range_compare (gconstpointer a, gconstpointer b)
+{
+  const struct emu_file_range *ra = a;
+  const struct emu_file_range *rb = b;
+  return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static inline gsize
+emu_block_round_up (gsize offset)
+{
+  return (offset + EMU3_BLOCK_SIZE - 1) / EMU3_BLOCK_SIZE * EMU3_BLOCK_SIZE;
+}
+
+static gint
+emu_write_file_all (struct emu_file *file)
 {
   gint err = 0;
   FILE *fd = fopen (file->name, "w");
@@ -207,16 +471,196 @@ emu_write_file (struct emu_file *file)
   return err;
 }
 
+//Only the blocks containing modified bytes are written.
+static gint
+emu_write_file_dirty (struct emu_file *file)
+{
+  struct stat st;
+  struct emu_file_range *r;
+  gsize start, end, written;
+  gint err = 0;
+  gint fd = open (file->name, O_WRONLY);
+
+  if (fd < 0 || fstat (fd, &st))
+    {
+      emu_error ("Can't write file");
+      if (fd >= 0)
+	close (fd);
+      return EXIT_FAILURE;
+    }
+
+  //Whatever is beyond the end of the file on disk must be written too.
+  if (st.st_size < file->size)
+    emu_file_set_dirty (file, st.st_size, file->size - st.st_size);
+
+  g_array_sort (file->dirty, emu_file_range_compare);
+
+  written = 0;
+  for (guint i = 0; i < file->dirty->len && !err;)
+    {
+      r = &g_array_index (file->dirty, struct emu_file_range, i);
+      start = r->start - r->start % EMU3_BLOCK_SIZE;
+      end = r->end;
+      i++;
+
+      //Ranges in the same or in contiguous blocks are written at once.
+      end = emu_block_round_up (end);
+      while (i < file->dirty->len)
+	{
+	  r = &g_array_index (file->dirty, struct emu_file_range, i);
+	  if (r->start > end)
+	    break;
+	  if (r->end > end)
+	    end = emu_block_round_up (r->end);
+	  i++;
+	}
+
+      if (end > file->size)
+	end = file->size;
+
+      while (start < end)
+	{
+	  ssize_t ret = pwrite (fd, &file->raw[start], end - start, start);
+	  if (ret <= 0)
+	    {
+	      emu_error ("Unexpected written bytes amount");
+	      err = EXIT_FAILURE;
+	      break;
+	    }
+	  start += ret;
+	  written += ret;
+	}
+    }
+
+  if (!err && st.st_size > file->size && ftruncate (fd, file->size))
+    {
+      emu_error ("Error while truncating file");
+      err = EXIT_FAILURE;
+    }
+
+  emu_debug (2, "%zu B written", written);
+
+  close (fd);
+  return err;
+}
+
+gint
+emu_write_file (struct emu_file *file)
+{
+  gint err;
+
+  if (file->mapped)
+    {
+      emu_error ("File %s was opened read-only", file->name);
+      return EXIT_FAILURE;
+    }
+
+  if (file->dirty_all)
+    err = emu_write_file_all (file);
+  else
+    err = emu_write_file_dirty (file);
+
+  if (!err)
+    {
+      file->dirty_all = FALSE;
+      g_array_set_size (file->dirty, 0);
+    }
+
+  return err;
+}
+
 struct emu_file *
 emu_init_file (const gchar *name)
 {
   struct emu_file *file = malloc (sizeof (struct emu_file));
+  file->ctx = emu_get_context ();
   file->name = name;
   file->size = 0;
-  file->raw = malloc (EMU3_MEM_SIZE);
+  file->capacity = 0;
+  file->raw = NULL;
+  file->mapped = FALSE;
+  file->layout = NULL;
+  file->gap = 0;
+  file->dirty_all = TRUE;
+  file->dirty = g_array_new (FALSE, FALSE, sizeof (struct emu_file_range));
   return file;
 }
 
+void
+emu_file_set_dirty (struct emu_file *file, gsize offset, gsize len)
+{
+  struct emu_file_range range;
+
+  if (file->dirty_all || !len)
+    return;
+
+  range.start = offset;
+  range.end = offset + len;
+  g_array_append_val (file->dirty, range);
+}
+
+//Used by the operations that change the layout of the file.
+void
+emu_file_set_all_dirty (struct emu_file *file)
+{
+  file->dirty_all = TRUE;
+  g_array_set_size (file->dirty, 0);
+}
+
+//Grows the buffer to hold at least size bytes. The capacity doubles to keep
+//consecutive appends cheap but it never goes beyond EMU3_MEM_SIZE.
+gint
+emu_file_reserve (struct emu_file *file, gsize size)
+{
+  gchar *raw;
+  gsize capacity;
+
+  if (size <= file->capacity)
+    {
+      return EXIT_SUCCESS;
+    }
+
+  if (file->mapped)
+    {
+      emu_error ("File %s was opened read-only", file->name);
+      return EXIT_FAILURE;
+    }
+
+  if (size > EMU3_MEM_SIZE)
+    {
+      emu_error ("Bank is full");
+      return EXIT_FAILURE;
+    }
+
+  capacity = file->capacity ? file->capacity * 2 : EMU_FILE_MIN_CAPACITY;
+  if (capacity < size)
+    {
+      capacity = size;
+    }
+  if (capacity > EMU3_MEM_SIZE)
+    {
+      capacity = EMU3_MEM_SIZE;
+    }
+
+  raw = realloc (file->raw, capacity);
+  if (!raw)
+    {
+      emu_error ("Error while allocating %zu B", capacity);
+      return EXIT_FAILURE;
+    }
+
+  //Some sample fields are OR'ed when initialized so new memory must be clean.
+  memset (&raw[file->capacity], 0, capacity - file->capacity);
+
+  emu_debug (3, "Bank buffer grown from %zu B to %zu B", file->capacity,
+	     capacity);
+
+  file->raw = raw;
+  file->capacity = capacity;
+
+  return EXIT_SUCCESS;
+}
+
 gint
 emu_reverse_note_search (gchar *note_name)
 {
@@ -305,7 +749,7 @@ emu_filename_to_filename_wo_ext (const gchar *filename_, const gchar **ext)
 }
 
 gint
-get_positive_int (gchar *str)
+emu_get_positive_int (gchar *str)
 {
   gchar *endstr;
   gint value = (gint) strtol (str, &endstr, 10);
@@ -327,9 +771,9 @@ get_positive_int (gchar *str)
 }
 
 gint
-get_positive_int_in_range (gchar *str, gint min, gint max)
+emu_get_positive_int_in_range (gchar *str, gint min, gint max)
 {
-  gint v = get_positive_int (str);
+  gint v = emu_get_positive_int (str);
 
   if (v < 0)
     {
@@ -26,8 +26,11 @@
 #include <libgen.h>
 #include <stdint.h>
 #include <unistd.h>
+#include "libemu3bm.h"
 
-#define EMU3_MEM_SIZE 0x08000000	//128 MiB
+#define EMU3_MEM_SIZE 0x08000000	//128 MiB. Maximum bank size.
+#define EMU_FILE_MIN_CAPACITY 0x10000	//64 KiB
+#define EMU3_BLOCK_SIZE 512
 #define EMU3_NAME_SIZE 16
 #define SAMPLE_EXT ".wav"
 #define EMU3_NOTES 88		// 0x58
@@ -36,51 +39,94 @@
 #define EMU3_LOWEST_MIDI_NOTE EMU3_MIDI_NOTE_OFFSET
 #define EMU3_HIGHEST_MIDI_NOTE (EMU3_NOTES - 1 + EMU3_MIDI_NOTE_OFFSET)
 
+struct emu_context
+{
+  gint verbosity;
+  gint max_sample_rate;
+  gint bit_depth;
+  gint sample_jobs;
+  gint resample_quality;
+  gchar *extraction_dir;	//Where samples are extracted, the current one if NULL
+  FILE *output;			//Where listings are printed, stdout if NULL
+  FILE *log;			//Where messages are printed, stderr if NULL
+  GPtrArray *pending_extractions;	//Extractions to be run in parallel
+  GPtrArray *polyphase_banks;	//Filter banks shared by the resamplers
+  GMutex mutex;
+  gchar *error;			//Last error message
+};
+
 struct emu_file
 {
+  struct emu_context *ctx;	//Context the file was opened with
   const gchar *name;
   gchar *raw;
   gsize size;
+  gsize capacity;
+  gboolean mapped;
+  gconstpointer layout;		//Format specific data
+  gsize gap;			//Free bytes between presets and samples
+  gboolean dirty_all;		//The whole file must be rewritten.
+  GArray *dirty;		//Modified byte ranges as struct emu_file_range.
+};
+
+struct emu_file_range
+{
+  gsize start;
+  gsize end;
 };
 
 #define emu_print(level, indent, ...) { \
-		if (level <= verbosity) { \
+		if (level <= emu_get_context ()->verbosity) { \
 			for (gint i = 0; i < indent; i++) \
-				fprintf(stdout, "  "); \
-			fprintf(stdout, __VA_ARGS__); \
+				fprintf(emu_get_output (), "  "); \
+			fprintf(emu_get_output (), __VA_ARGS__); \
 		} \
 	}
 
 #define emu_debug(level, format, ...) { \
-                if (level <= verbosity) { \
-                        fprintf(stderr, "DEBUG:" __FILE__ ":%d:(%s): " format "\n", __LINE__, __FUNCTION__, ## __VA_ARGS__); \
+                if (level <= emu_get_context ()->verbosity) { \
+                        fprintf(emu_get_log (), "DEBUG:" __FILE__ ":%d:(%s): " format "\n", __LINE__, __FUNCTION__, ## __VA_ARGS__); \
                 } \
         }
 
 #define emu_error(format, ...) { \
-                gint tty = isatty(fileno(stderr)); \
+                gint tty = emu_get_log () == stderr && isatty(fileno(stderr)); \
                 const gchar * color_start = tty ? "\x1b[31m" : ""; \
                 const gchar * color_end = tty ? "\x1b[m" : ""; \
-                fprintf(stderr, "%sERROR:" __FILE__ ":%d:(%s): " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
+                fprintf(emu_get_log (), "%sERROR:" __FILE__ ":%d:(%s): " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
+                emu_context_set_error (emu_get_context (), format, ## __VA_ARGS__); \
         }
 
 #define emu_warn(format, ...) { \
-                gint tty = isatty(fileno(stderr)); \
+                gint tty = emu_get_log () == stderr && isatty(fileno(stderr)); \
                 const gchar * color_start = tty ? "\x1b[33m" : ""; \
                 const gchar * color_end = tty ? "\x1b[m" : ""; \
-                fprintf(stderr, "%sWARN :" __FILE__ ":%d:(%s): " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
+                fprintf(emu_get_log (), "%sWARN :" __FILE__ ":%d:(%s): " format "%s\n", color_start, __LINE__, __FUNCTION__, ## __VA_ARGS__, color_end); \
         }
 
-extern gint verbosity;
+void emu_context_set_error (struct emu_context *ctx, const gchar * format,
+			    ...);
 
-const gchar *emu_get_err (gint);
+void emu_set_context (struct emu_context *ctx);
 
-struct emu_file *emu_open_file (const gchar *);
+struct emu_context *emu_get_context (void);
 
-void emu_close_file (struct emu_file *);
+FILE *emu_get_output (void);
+
+FILE *emu_get_log (void);
+
+const gchar *emu_get_err (gint);
+
+struct emu_file *emu_open_file (const gchar *, gboolean);
 
 gint emu_write_file (struct emu_file *);
 
+gint emu_file_reserve (struct emu_file *, gsize);
+
+void emu_file_set_dirty (struct emu_file *, gsize, gsize);
+
+void emu_file_set_all_dirty (struct emu_file *);
+
 struct emu_file *emu_init_file ();
 
 gint emu_reverse_note_search (gchar *);
@@ -97,8 +143,8 @@ void emu3_cpystr (gchar * dst, const gchar * src);
 gchar *emu_filename_to_filename_wo_ext (const gchar * file,
 					const gchar ** ext);
 
-gint get_positive_int (gchar * str);
+gint emu_get_positive_int (gchar * str);
 
-gint get_positive_int_in_range (gchar * str, gint min, gint max);
+gint emu_get_positive_int_in_range (gchar * str, gint min, gint max);
 
 #endif
@@ -3,6 +3,7 @@
 . $srcdir/test_common.sh
 
 TEST_BANK_NAME=$srcdir/emu3_test_add_sample
+TEST_SAMPLE_DIR=$srcdir/emu3_test_add_sample_dir
 
 cleanUp
 
@@ -35,6 +36,39 @@ test
 logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_4'
 test
 
+# Several samples written at once
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -j 2 -s data/s1.wav -s data/s2.wav -s data/s1_loop.wav -s data/s2_loop.wav $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_4'
+test
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s "data/s[12].wav" $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_2'
+test
+
+logAndRun 'mkdir $TEST_SAMPLE_DIR && cp data/s1.wav data/s2.wav $TEST_SAMPLE_DIR'
+test
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s $TEST_SAMPLE_DIR $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_2'
+test
+rm -r $TEST_SAMPLE_DIR
+
+logAndRun '$srcdir/../src/emu3bm -s "data/foo*.wav" $TEST_BANK_NAME'
+testError
+
+logAndRun '$srcdir/../src/emu3bm -s data/s1.wav -s foo $TEST_BANK_NAME'
+testError
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_2'
+test
+
 logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
 test
 for s in $(seq 1 999); do
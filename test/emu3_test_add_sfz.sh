@@ -56,6 +56,19 @@ test
 logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sfz_9'
 test
 
+# Samples decoded in parallel are added in the same order.
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+logAndRun '$srcdir/../src/emu3bm -j 4 -S data/test1.sfz $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sfz_1'
+test
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+logAndRun '$srcdir/../src/emu3bm -j 4 -S data/test8.sfz $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sfz_8'
+test
+
 rm $TEST_BANK_NAME_PRISTINE
 
 cleanUp
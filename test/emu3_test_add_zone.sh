@@ -69,9 +69,19 @@ test
 
 logAndRun '$srcdir/../src/emu3bm -e 0 --delete-zone 0 $TEST_BANK_NAME'
 test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_zone_6'
+test
 logAndRun '$srcdir/../src/emu3bm -e 0 --delete-zone 0 $TEST_BANK_NAME'
 test
 logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_zone_2'
 test
 
+# The second note zone shares the secondary zone of the first one.
+logAndRun 'cp data/emu3_test_add_zone_7 $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -e 0 --delete-zone 0 $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_zone_8'
+test
+
 cleanUp
@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_batch
+
+function cleanUp() {
+  echo "Cleaning up..."
+  rm -f $TEST_BANK_NAME.1 $TEST_BANK_NAME.2
+  rm -rf emu3_test_add_sample_2_samples emu3_test_add_sample_4_samples
+}
+
+cleanUp
+
+cp data/emu3_test_add_zone_3 $TEST_BANK_NAME.1
+cp data/emu3_test_add_zone_3 $TEST_BANK_NAME.2
+
+logAndRun '$srcdir/../src/emu3bm -a -j 2 -e 0 -q 25 -c 200 $TEST_BANK_NAME.1 $TEST_BANK_NAME.2'
+test
+logAndRun 'diff $TEST_BANK_NAME.1 data/emu3_test_edit_parameter_1'
+test
+logAndRun 'diff $TEST_BANK_NAME.2 data/emu3_test_edit_parameter_1'
+test
+
+# A failing bank does not stop the others.
+cp data/emu3_test_add_zone_3 $TEST_BANK_NAME.1
+cp data/emu3_test_add_zone_3 $TEST_BANK_NAME.2
+
+logAndRun '$srcdir/../src/emu3bm --batch -j 2 -e 0 -q 25 -c 200 $TEST_BANK_NAME.1 foo $TEST_BANK_NAME.2'
+testError
+logAndRun 'diff $TEST_BANK_NAME.1 data/emu3_test_edit_parameter_1'
+test
+logAndRun 'diff $TEST_BANK_NAME.2 data/emu3_test_edit_parameter_1'
+test
+
+# Errors are printed once.
+logAndRun '[ "$($srcdir/../src/emu3bm -a -j 2 foo data/emu3_test_add_sample_2 2>&1 | grep -c "foo for input")" == "1" ]'
+test
+
+# Listings are printed in the order of the banks.
+logAndRun '[ "$($srcdir/../src/emu3bm -a -j 2 data/emu3_test_add_sample_4 data/emu3_test_add_sample_2 | grep -c "^Sample")" == "6" ]'
+test
+logAndRun '$srcdir/../src/emu3bm -a -j 2 data/emu3_test_add_sample_4 data/emu3_test_add_sample_2 | tail -n 3 | head -n 1 | grep "^Bank file: data/emu3_test_add_sample_2$"'
+test
+
+# Samples are extracted to a directory for each bank.
+logAndRun '$srcdir/../src/emu3bm -a -j 2 -x data/emu3_test_add_sample_4 data/emu3_test_add_sample_2'
+test
+logAndRun 'diff emu3_test_add_sample_4_samples/s2_loop.wav data/s2_loop.back.wav'
+test
+logAndRun 'diff emu3_test_add_sample_2_samples/s2.wav data/s2.back.wav'
+test
+
+# Banks with the same file name can not be extracted together.
+logAndRun '$srcdir/../src/emu3bm -a -x data/emu3_test_add_sample_2 $srcdir/../test/data/emu3_test_add_sample_2'
+testError
+
+logAndRun '$srcdir/../src/emu3bm -a'
+testError
+
+logAndRun '$srcdir/../src/emu3bm -a -s data/s1.wav $TEST_BANK_NAME.1'
+testError
+
+cleanUp
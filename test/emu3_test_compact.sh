@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_compact
+
+cleanUp
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -p "P0" $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -s data/s1.wav $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s data/s2.wav $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s data/s1_loop.wav $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s data/s2_loop.wav $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -e 0 -z 1,pri,F1,C1,B1 $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -e 0 -z 3,pri,F3,C3,B3 $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -k -c 100 $TEST_BANK_NAME'
+testError
+
+logAndRun '$srcdir/../src/emu3bm -k $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_compact_1'
+test
+
+logAndRun '$srcdir/../src/emu3bm --compact $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_compact_1'
+test
+
+cleanUp
@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_dedup
+
+cleanUp
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -p "P0" $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -s data/s1.wav $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s data/s1.wav $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -s data/s2_loop.wav $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -e 0 -z 2,pri,F1,C1,B1 $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -e 0 -z 3,pri,F2,C2,B2 $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -D -l 50 $TEST_BANK_NAME'
+testError
+
+logAndRun '$srcdir/../src/emu3bm -D $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_dedup_1'
+test
+
+logAndRun '$srcdir/../src/emu3bm --dedup $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_dedup_1'
+test
+
+cleanUp
@@ -68,4 +68,24 @@ test
 logAndRun 'diff 004-s2_loop.wav ../data/s2_loop.back.wav'
 test
 
+rm -f *.wav
+
+logAndRun '$srcdir/../../src/emu3bm -j 4 -X ../data/emu3_test_add_sample_4'
+test
+
+logAndRun 'diff 001-s1.wav ../data/s1.back.wav'
+test
+
+logAndRun 'diff 002-s2.wav ../data/s2.back.wav'
+test
+
+logAndRun 'diff 003-s1_loop.wav ../data/s1_loop.back.wav'
+test
+
+logAndRun 'diff 004-s2_loop.wav ../data/s2_loop.back.wav'
+test
+
+logAndRun '$srcdir/../../src/emu3bm -j 0 -x ../data/emu3_test_add_sample_4'
+testError
+
 cleanUp
@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_info
+
+cleanUp
+
+logAndRun 'cp data/emu3_test_add_sfz_1 $TEST_BANK_NAME'
+test
+
+logAndRun '$srcdir/../src/emu3bm -i $TEST_BANK_NAME | grep "^Samples: 4$"'
+test
+
+# The sample metadata must match the one shown when reading the whole bank.
+logAndRun 'diff <($srcdir/../src/emu3bm -v $TEST_BANK_NAME | sed -n "/^Sample 001/,\$p" | grep -v "Presets:") <($srcdir/../src/emu3bm --info $TEST_BANK_NAME | sed -n "/^Sample 001/,\$p")'
+test
+
+logAndRun '$srcdir/../src/emu3bm -i -x $TEST_BANK_NAME'
+testError
+
+logAndRun 'head -c 12000 data/emu3_test_add_sfz_1 > $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -i $TEST_BANK_NAME'
+testError
+
+cleanUp
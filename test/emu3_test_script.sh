@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_script
+
+cleanUp
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -m data/test1.script $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_script_1'
+test
+
+cleanUp
+
+logAndRun '$srcdir/../src/emu3bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm --script - $TEST_BANK_NAME < data/test2.script'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_script_2'
+test
+
+cleanUp
+
+logAndRun 'cp data/emu3_test_add_zone_3 $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu3bm -m data/test3.script $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_edit_parameter_1'
+test
+
+# Nothing is written if any command fails.
+logAndRun 'printf "s = add-sample data/s2.wav\nadd-zone 0 \$t,pri,F1,C1,B1\n" | $srcdir/../src/emu3bm -m - $TEST_BANK_NAME'
+testError
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_edit_parameter_1'
+test
+
+logAndRun '$srcdir/../src/emu3bm -m data/test3.script -s data/s1.wav $TEST_BANK_NAME'
+testError
+
+cleanUp
@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+
+. $srcdir/test_common.sh
+
+TEST_BANK_NAME=$srcdir/emu3_test_serve
+TEST_SOCKET=$srcdir/emu3_test_serve.sock
+
+# socat is needed to talk to the server.
+command -v socat > /dev/null || exit 77
+
+function request() {
+  printf "$1\n" | socat -t 5 - UNIX-CONNECT:$TEST_SOCKET
+}
+
+cleanUp
+
+logAndRun 'cp data/emu3_test_add_sample_1 $TEST_BANK_NAME'
+test
+
+$srcdir/../src/emu3bm -u $TEST_SOCKET &
+SERVER_PID=$!
+trap "kill $SERVER_PID; rm -f $TEST_SOCKET" EXIT
+for i in $(seq 1 50); do
+  [ -S $TEST_SOCKET ] && break
+  sleep 0.1
+done
+
+logAndRun 'request "list $TEST_BANK_NAME" | grep "^Sample 001: s1"'
+test
+
+logAndRun '[ "$(request "add-sample $TEST_BANK_NAME data/s2.wav" | tr "\n" " ")" == "2 OK " ]'
+test
+
+# Nothing is written until the bank is flushed.
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_1'
+test
+
+logAndRun 'request "list $TEST_BANK_NAME" | grep "^Sample 002: s2"'
+test
+
+logAndRun '[ "$(request "flush $TEST_BANK_NAME")" == "OK" ]'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu3_test_add_sample_2'
+test
+
+logAndRun 'request "add-zone $TEST_BANK_NAME 0 3,pri,F1,C1,B1" | grep "^ERROR"'
+test
+
+logAndRun 'request "list $srcdir/foo" | grep "^ERROR"'
+test
+
+# Files that are not audio are rejected and the server keeps running.
+logAndRun 'request "add-sample $TEST_BANK_NAME $srcdir/test_common.sh" | grep "^ERROR.*test_common.sh"'
+test
+logAndRun 'request "list $TEST_BANK_NAME" | grep "^Sample 002: s2"'
+test
+
+logAndRun 'request "list" | grep "^ERROR"'
+test
+
+# Several requests in the same connection
+logAndRun 'cp data/emu3_test_add_zone_3 $TEST_BANK_NAME.2'
+test
+logAndRun 'request "edit $TEST_BANK_NAME.2 0 filter-q 25\nedit $TEST_BANK_NAME.2 0 filter-cutoff 200\nflush $TEST_BANK_NAME.2" | grep -c "^OK$" | grep 3'
+test
+logAndRun 'diff $TEST_BANK_NAME.2 data/emu3_test_edit_parameter_1'
+test
+rm -f $TEST_BANK_NAME.2
+
+# The listing is returned and the samples go to the given directory.
+logAndRun 'request "extract $TEST_BANK_NAME $srcdir/emu3_test_serve_samples" | grep "^Sample 002: s2"'
+test
+logAndRun 'diff $srcdir/emu3_test_serve_samples/s2.wav data/s2.back.wav'
+test
+rm -rf $srcdir/emu3_test_serve_samples
+
+logAndRun 'request "extract $TEST_BANK_NAME a b" | grep "^ERROR"'
+test
+
+cleanUp
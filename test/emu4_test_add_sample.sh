@@ -19,6 +19,21 @@ test
 logAndRun 'diff $TEST_BANK_NAME data/emu4_test_add_sample_2'
 test
 
+# Several samples written at once
+logAndRun '$srcdir/../src/emu4bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu4bm -j 2 -s data/s1_loop.wav -s data/s2_loop.wav $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu4_test_add_sample_2'
+test
+
+logAndRun '$srcdir/../src/emu4bm -n $TEST_BANK_NAME'
+test
+logAndRun '$srcdir/../src/emu4bm -s data/s1_loop.wav -s data/s2_loop.wav $TEST_BANK_NAME'
+test
+logAndRun 'diff $TEST_BANK_NAME data/emu4_test_add_sample_2'
+test
+
 logAndRun '$srcdir/../src/emu4bm -n $TEST_BANK_NAME'
 test
 for s in $(seq 1 999); do
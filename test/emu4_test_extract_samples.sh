@@ -32,4 +32,15 @@ test
 logAndRun 'diff 002-s2_loop.wav ../data/s2_loop.back.wav'
 test
 
+rm -f *.wav
+
+logAndRun '$srcdir/../../src/emu4bm -j 2 -X ../data/emu4_test_add_sample_2'
+test
+
+logAndRun 'diff 001-s1_loop.wav ../data/s1_loop.back.wav'
+test
+
+logAndRun 'diff 002-s2_loop.wav ../data/s2_loop.back.wav'
+test
+
 cleanUp
@@ -1,6 +1,10 @@
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
+#include <math.h>
+#include <unistd.h>
 #include "../src/emu3bm.h"
+#include "../src/resampler.h"
+#include "../src/sfz.h"
 
 gfloat emu3_get_time_163_69_from_u8 (guint8 v);
 guint8 emu3_get_u8_from_time_163_69 (gfloat v);
@@ -28,6 +32,8 @@ guint8 emu3_get_u8_from_lfo_rate (gfloat v);
 gfloat emu3_get_time_21_69_from_u8 (guint8 v);
 guint8 emu3_get_u8_from_time_21_69 (gfloat v);
 
+static struct emu_context *ctx;
+
 static void
 test_time_163_69 ()
 {
@@ -108,6 +114,28 @@ test_emu3_get_filter_id_from_sfz_fil_type ()
   CU_ASSERT_EQUAL (emu3_get_filter_id_from_sfz_fil_type ("foo"), 0);
 }
 
+static void
+test_sfz_get_opcode ()
+{
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("amp_veltrack"),
+		   EMU_SFZ_OPCODE_AMP_VELTRACK);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("bendup"), EMU_SFZ_OPCODE_BENDUP);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("lfo01_rate"),
+		   EMU_SFZ_OPCODE_LFO01_RATE);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("pitch_keycenter"),
+		   EMU_SFZ_OPCODE_PITCH_KEYCENTER);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("tune"), EMU_SFZ_OPCODE_TUNE);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("foo"), EMU_SFZ_OPCODE_NONE);
+  CU_ASSERT_EQUAL (emu_sfz_get_opcode ("Sample"), EMU_SFZ_OPCODE_NONE);
+
+  for (gint i = 0; i < EMU_SFZ_OPCODES; i++)
+    {
+      CU_ASSERT_EQUAL (emu_sfz_get_opcode (emu_sfz_get_opcode_name (i)), i);
+    }
+}
+
 static void
 test_vcf_tracking ()
 {
@@ -172,12 +200,213 @@ test_time_21_69 ()
   CU_ASSERT_EQUAL (emu3_get_time_21_69_from_u8 (128), 21.69f);
 }
 
+static void
+test_transaction ()
+{
+  gint err;
+  struct emu_file *file, *expected;
+  struct emu3_transaction *tx;
+  struct emu_zone_range zone_range;
+  const gchar *path = "tests_emu3bm_transaction";
+
+  printf ("\n");
+
+  file = emu3_open_file (ctx, "data/emu3_test_add_zone_2", FALSE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (file);
+  file->name = path;
+
+  // Same edits than in emu3_test_add_zone.sh but in a single commit.
+  tx = emu3_transaction_begin (file);
+
+  zone_range.layer = 1;
+  zone_range.original_key = 20;
+  zone_range.lower_key = 15;
+  zone_range.higher_key = 26;
+  err = emu3_transaction_add_preset_zone (tx, 0, 1, &zone_range);
+  CU_ASSERT_EQUAL (err, EXIT_SUCCESS);
+
+  zone_range.original_key = 32;
+  zone_range.lower_key = 27;
+  zone_range.higher_key = 38;
+  err = emu3_transaction_add_preset_zone (tx, 0, 1, &zone_range);
+  CU_ASSERT_EQUAL (err, EXIT_SUCCESS);
+
+  zone_range.layer = 2;
+  zone_range.original_key = 20;
+  zone_range.lower_key = 15;
+  zone_range.higher_key = 26;
+  err = emu3_transaction_add_preset_zone (tx, 0, 1, &zone_range);
+  CU_ASSERT_EQUAL (err, EXIT_SUCCESS);
+
+  err = emu3_transaction_add_preset_zone (tx, 1, 1, &zone_range);
+  CU_ASSERT_EQUAL (err, EXIT_FAILURE);
+
+  err = emu3_transaction_commit (tx);
+  CU_ASSERT_EQUAL (err, EXIT_SUCCESS);
+
+  err = emu3_write_file (file);
+  CU_ASSERT_EQUAL (err, EXIT_SUCCESS);
+  emu_close_file (file);
+
+  file = emu3_open_file (ctx, path, TRUE);
+  expected = emu3_open_file (ctx, "data/emu3_test_add_zone_5", TRUE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (file);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (expected);
+
+  CU_ASSERT_EQUAL (file->size, expected->size);
+  CU_ASSERT_EQUAL (memcmp (file->raw, expected->raw, expected->size), 0);
+
+  emu_close_file (file);
+  emu_close_file (expected);
+  unlink (path);
+}
+
+static void
+test_sample_presets ()
+{
+  GArray *presets;
+  struct emu_file *file;
+
+  printf ("\n");
+
+  file = emu3_open_file (ctx, "data/emu3_test_add_zone_5", TRUE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (file);
+
+  presets = emu3_get_sample_presets (file, 1);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (presets);
+  CU_ASSERT_EQUAL (presets->len, 1);
+  CU_ASSERT_EQUAL (g_array_index (presets, gint, 0), 0);
+  g_array_free (presets, TRUE);
+
+  presets = emu3_get_sample_presets (file, 2);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (presets);
+  CU_ASSERT_EQUAL (presets->len, 0);
+  g_array_free (presets, TRUE);
+
+  CU_ASSERT_PTR_NULL (emu3_get_sample_presets (file, 0));
+
+  emu_close_file (file);
+}
+
+static void
+test_context ()
+{
+  gchar *error;
+  struct emu_file *file_a, *file_b;
+  struct emu_context *ctx_a = emu_context_new ();
+  struct emu_context *ctx_b = emu_context_new ();
+
+  printf ("\n");
+
+  file_a = emu3_open_file (ctx_a, "data/emu3_test_add_zone_5", TRUE);
+  file_b = emu3_open_file (ctx_b, "data/emu3_test_add_zone_5", TRUE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (file_a);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (file_b);
+  CU_ASSERT_PTR_EQUAL (file_a->ctx, ctx_a);
+  CU_ASSERT_PTR_EQUAL (file_b->ctx, ctx_b);
+
+  //Errors are only recorded in the context of the bank.
+  CU_ASSERT_PTR_NULL (emu3_get_sample_presets (file_a, 0));
+  CU_ASSERT_PTR_EQUAL (emu_get_context (), ctx_a);
+  error = emu_context_get_error (ctx_a);
+  CU_ASSERT_STRING_EQUAL (error, "Invalid sample number: 0");
+  g_free (error);
+  CU_ASSERT_PTR_NULL (emu_context_get_error (ctx_b));
+
+  emu_close_file (file_a);
+  emu_close_file (file_b);
+  emu_context_free (ctx_a);
+  emu_context_free (ctx_b);
+
+  emu_set_context (ctx);
+}
+
+static glong
+resample_in_blocks (const gfloat *input, glong frames, glong block,
+		    gfloat *output, glong output_frames)
+{
+  glong used, generated, in = 0, out = 0;
+  struct emu3_resampler *resampler;
+
+  resampler = emu3_resampler_new (EMU3_RESAMPLE_QUALITY_POLYPHASE, 2, 48000,
+				  44100);
+  if (!resampler)
+    {
+      return -1;
+    }
+
+  while (1)
+    {
+      glong len = MIN (block, frames - in);
+      gboolean end_of_input = in + len == frames;
+
+      if (emu3_resampler_process (resampler, &input[in * 2], len,
+				  end_of_input, &output[out * 2],
+				  MIN (block, output_frames - out), &used,
+				  &generated))
+	{
+	  out = -1;
+	  break;
+	}
+
+      in += used;
+      out += generated;
+
+      if (!used && !generated && end_of_input)
+	{
+	  break;
+	}
+    }
+
+  emu3_resampler_free (resampler);
+
+  return out;
+}
+
+static void
+test_polyphase_resampler ()
+{
+  gfloat input[4800 * 2];
+  gfloat output_a[4410 * 2 + 64], output_b[4410 * 2 + 64];
+  glong frames_a, frames_b;
+
+  printf ("\n");
+
+  CU_ASSERT_EQUAL (emu3_resampler_get_quality ("polyphase"),
+		   EMU3_RESAMPLE_QUALITY_POLYPHASE);
+  CU_ASSERT_EQUAL (emu3_resampler_get_quality ("unknown"), -1);
+
+  for (gint i = 0; i < 4800; i++)
+    {
+      input[i * 2] = 0.5 * sin (2 * M_PI * 1000 * i / 48000.0);
+      input[i * 2 + 1] = 0.25;
+    }
+
+  frames_a = resample_in_blocks (input, 4800, 4800, output_a, 4410 + 32);
+  frames_b = resample_in_blocks (input, 4800, 97, output_b, 4410 + 32);
+
+  CU_ASSERT_EQUAL_FATAL (frames_a, 4410);
+  CU_ASSERT_EQUAL_FATAL (frames_b, 4410);
+  CU_ASSERT (!memcmp (output_a, output_b, sizeof (gfloat) * 4410 * 2));
+
+  //Away from the edges, the output must match the input signal.
+  for (gint i = 100; i < 4310; i++)
+    {
+      CU_ASSERT_DOUBLE_EQUAL (output_a[i * 2],
+			      0.5 * sin (2 * M_PI * 1000 * i / 44100.0),
+			      0.001);
+      CU_ASSERT_DOUBLE_EQUAL (output_a[i * 2 + 1], 0.25, 0.001);
+    }
+}
+
 gint
 main (gint argc, gchar *argv[])
 {
   gint err = 0;
 
-  verbosity = 5;
+  ctx = emu_context_new ();
+  ctx->verbosity = 5;
+  emu_set_context (ctx);
 
   if (CU_initialize_registry () != CUE_SUCCESS)
     {
@@ -215,6 +444,11 @@ main (gint argc, gchar *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "sfz_get_opcode", test_sfz_get_opcode))
+    {
+      goto cleanup;
+    }
+
   if (!CU_add_test (suite, "vcf_tracking", test_vcf_tracking))
     {
       goto cleanup;
@@ -235,6 +469,26 @@ main (gint argc, gchar *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "transaction", test_transaction))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "sample_presets", test_sample_presets))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "polyphase_resampler", test_polyphase_resampler))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "context", test_context))
+    {
+      goto cleanup;
+    }
+
   CU_basic_set_mode (CU_BRM_VERBOSE);
 
   CU_basic_run_tests ();
@@ -242,5 +496,6 @@ main (gint argc, gchar *argv[])
 
 cleanup:
   CU_cleanup_registry ();
+  emu_context_free (ctx);
   return err || CU_get_error ();
 }